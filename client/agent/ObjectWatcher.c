@@ -14,7 +14,18 @@
 #include "agent_util.h"
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
@@ -27,7 +38,123 @@
 #define HEAP_TRACKER_native_newobj              _newobj
 #define HEAP_TRACKER_native_newarr              _newarr
 #define HEAP_TRACKER_engaged                    engaged
-#define MAX_FRAMES                              5
+// frames of a stack trace unless depth= says otherwise, and the most it may say
+#define DEFAULT_DEPTH                           5
+#define MAX_DEPTH                               256
+// per thread ring capacity, must be a power of two
+#define RING_SIZE                               2048
+// free batches in flight between GC and drainer
+#define FREE_BATCH_COUNT                        4
+// bytes of packed ids per free batch
+#define FREE_BATCH_SIZE                         262144
+// upper bound of one packed free, seven varints
+#define FREE_ENTRY_LENGTH                       70
+// most the overflow batch grows to while GCs outrun drainer
+#define FREE_OVERFLOW_LIMIT                     (64 * 1024 * 1024)
+// number of object ids a thread reserves at once
+#define ID_BLOCK_SIZE                           1024
+// how long drainer sleeps when there is nothing to drain
+#define DRAIN_INTERVAL_MILLIS                   1
+// buckets of the trace interning table, must be a power of two
+#define HASH_BUCKET_COUNT                       4096
+#define HASH_INDEX_MASK                         (HASH_BUCKET_COUNT - 1)
+// buckets of the frame trie table, must be a power of two
+#define FRAME_BUCKET_COUNT                      16384
+#define FRAME_INDEX_MASK                        (FRAME_BUCKET_COUNT - 1)
+// site ids reported in aggregate snapshots
+#define MAX_SITES                               (1 << 20)
+// per object records of one slab chunk, must be a power of two
+#define SLAB_CHUNK_SIZE                         65536
+// objects beyond SLAB_CHUNK_SIZE * SLAB_MAX_CHUNKS live ones are not tracked
+#define SLAB_MAX_CHUNKS                         4096
+// slab free list head: version above, slot reference in the low bits
+#define SLAB_REF_MASK                           0xffffffffULL
+// default interval between aggregate snapshots
+#define SNAPSHOT_INTERVAL_MILLIS                1000
+#define NANOS_PER_MILLI                         1000000LL
+#define NANOS_PER_SECOND                        1000000000LL
+// lifetime histograms: 2^HISTOGRAM_SUB_BITS buckets per power of two
+#define HISTOGRAM_SUB_BITS                      2
+// bucket count covering any positive jlong of nanoseconds
+#define LIFETIME_BUCKETS                        248
+// bucket count covering up to 2^17 GC cycles
+#define GC_CYCLE_BUCKETS                        64
+// upper bound of one site's encoded lifetime histograms
+#define LIFETIME_ENTRY_LENGTH                   4096
+// latency histograms of the agent's own operations, up to about 18 minutes
+#define LATENCY_BUCKETS                         160
+// buckets of the jmethodID metadata cache, must be a power of two
+#define METHOD_BUCKET_COUNT                     4096
+#define METHOD_INDEX_MASK                       (METHOD_BUCKET_COUNT - 1)
+// HotSpot's extension event fired when a class is unloaded
+#define CLASS_UNLOAD_EVENT                      "com.sun.hotspot.events.ClassUnload"
+// drainer's write buffer, also the size of a send queue chunk
+#define OUT_BUFFER_SIZE                         65536
+// chunks queued between drainer and sender thread
+#define SEND_QUEUE_CHUNKS                       64
+// how long sender waits for a connection or for the socket to drain
+#define SEND_CONNECT_TIMEOUT_MILLIS             1000
+#define SEND_POLL_MILLIS                        100
+// reconnect backoff bounds
+#define SEND_BACKOFF_MIN_MILLIS                 100
+#define SEND_BACKOFF_MAX_MILLIS                 10000
+// how long VM death waits for queued output to reach the server
+#define SEND_SHUTDOWN_MILLIS                    5000
+// how often drainer looks at the control file
+#define CONTROL_POLL_MILLIS                     500
+// frames of compressed connections: default size and latency, largest size
+#define FRAME_SIZE_DEFAULT                      131072
+#define FRAME_SIZE_MAX                          (4 * 1024 * 1024)
+#define FRAME_LATENCY_MILLIS                    50
+// LZ4 block format: hash table of 2^LZ_HASH_BITS positions, shortest match,
+// literals every block ends with, no match starts in the last LZ_MF_LIMIT bytes
+#define LZ_HASH_BITS                            14
+#define LZ_MIN_MATCH                            4
+#define LZ_LAST_LITERALS                        5
+#define LZ_MF_LIMIT                             12
+#define LZ_MAX_OFFSET                           65535
+// longest newline terminated command the server may send
+#define COMMAND_BUFFER_SIZE                     256
+// upper bound of one encoded id range of a heap snapshot
+#define ID_RANGE_LENGTH                         32
+// upper bound of a single encoded record
+#define MAX_RECORD_LENGTH                       32768
+// longer strings get truncated on the wire
+#define MAX_STRING_LENGTH                       1024
+// size of one spool file segment, header included
+#define SPOOL_SEGMENT_SIZE                      (64 * 1024 * 1024)
+#define SPOOL_MAGIC                             "JOS"
+#define SPOOL_VERSION                           1
+// data bytes of the shared memory ring, must be a power of two
+#define SHM_RING_SIZE                           (16 * 1024 * 1024)
+#define SHM_MAGIC                               "JOM"
+#define SHM_VERSION                             1
+// yields before drainer sleeps waiting for room in the shared memory ring
+#define SHM_SPIN_YIELDS                         64
+#define CAPTURE_MAGIC                           "JOR"
+#define CAPTURE_VERSION                         1
+// capture block starts a stream of its own, replayed on a new connection
+#define CAPTURE_NEW_STREAM                      1
+
+// binary wire protocol, see encode* functions
+#define WIRE_MAGIC                              "JOI"
+#define WIRE_VERSION                            13
+#define RECORD_TRACE                            1
+#define RECORD_CREATE                           2
+#define RECORD_FREE                             3
+#define RECORD_FREE_BATCH                       4
+#define RECORD_SNAPSHOT                         5
+#define RECORD_DROPS                            6
+#define RECORD_LIFETIMES                        7
+#define RECORD_STATS                            8
+#define RECORD_CLASS                            9
+#define RECORD_HEAP_SNAPSHOT                    10
+#define RECORD_FRAME                            11
+#define RECORD_THREAD                           12
+#define RECORD_THREAD_SNAPSHOT                  13
+// compression offer, sent before the stream on a connection
+#define FRAME_MAGIC                             "JOZ"
+#define FRAME_VERSION                           1
 
 // macros
 #define _STRING(s)      #s
@@ -51,38 +178,576 @@ static char * flavorDesc[] = {
     "X" //unknown
 };
 
+typedef enum {
+    FORMAT_BINARY = 0,
+    FORMAT_TEXT = 1
+} WireFormat;
+
+typedef enum {
+    CODEC_NONE = 0,
+    CODEC_LZ4 = 1
+} FrameCodec;
+
+typedef enum {
+    // stream to the server
+    OUTPUT_SOCKET = 0,
+    // append to memory mapped spool segments
+    OUTPUT_FILE = 1,
+    // write into a ring in /dev/shm for a reader on the same host
+    OUTPUT_SHM = 2
+} OutputTarget;
+
+typedef enum {
+    // allocating threads wait for the drainer. Frees never wait, ObjectFree
+    // runs inside the GC: those which don't fit go to an overflow batch.
+    BACKPRESSURE_BLOCK = 0,
+    // events which don't fit are dropped and counted
+    BACKPRESSURE_DROP = 1,
+    // events which don't fit go into per site counters
+    BACKPRESSURE_AGGREGATE = 2
+} BackpressurePolicy;
+
+typedef enum {
+    // every create and free is sent
+    MODE_EVENTS = 0,
+    // only per site counters are sent, periodically
+    MODE_AGGREGATE = 1
+} AgentMode;
+
+typedef enum {
+    // every allocation is tracked
+    SAMPLE_NONE = 0,
+    // every sampleInterval-th allocation of a thread
+    SAMPLE_EVERY = 1,
+    // first allocation after geometrically distributed byte intervals
+    SAMPLE_BYTES = 2,
+    // JVMTI SampledObjectAlloc instead of bytecode injection
+    SAMPLE_JVMTI = 3
+} SampleMode;
+
+typedef enum {
+    ENGAGE_NONE = 0,
+    // turn tracking on, or off
+    ENGAGE_ON = 1,
+    ENGAGE_OFF = 2
+} EngageRequest;
+
+typedef enum {
+    FILTER_NONE = 0,
+    FILTER_INCLUDE = 1,
+    FILTER_EXCLUDE = 2
+} FilterVerdict;
+
+typedef enum {
+    // GetStackTrace of a recorded allocation
+    STAT_STACK_TRACE = 0,
+    // resolving a site's frames for its definition
+    STAT_RESOLVE = 1,
+    // writing a chunk to the socket or the spool
+    STAT_SEND = 2,
+    // waiting for room in a ring, backpressure=block
+    STAT_BACKPRESSURE = 3,
+    // drainer waiting for room in the send queue
+    STAT_QUEUE_WAIT = 4,
+    // ObjectFree waiting for freeLock
+    STAT_LOCK_WAIT = 5,
+    // walking the heap for the live tag set
+    STAT_HEAP_SNAPSHOT = 6,
+    // compressing a frame for the server
+    STAT_COMPRESS = 7,
+    STAT_LAST = 7
+} StatOp;
+
+static char * statDesc[] = {
+    "stackTrace",
+    "resolve",
+    "send",
+    "backpressure",
+    "queueWait",
+    "lockWait",
+    "heapSnapshot",
+    "compress"
+};
+
+/**
+ * Latency histogram of one agent operation, in nanoseconds. Updated
+ * atomically and never cleared.
+ */
+typedef struct LatencyStats {
+    volatile jlong count;
+    volatile jlong totalNanos;
+    volatile jlong buckets[LATENCY_BUCKETS];
+} LatencyStats;
+
+/**
+ * What the agent itself costs. Allocating threads count into their ring so
+ * they don't share cache lines, everybody else into gdata. Drainer folds
+ * the rings of dead threads into gdata.
+ */
+typedef struct AgentStats {
+    // allocations recorded and frees seen
+    volatile jlong created;
+    volatile jlong freed;
+    // bytes handed to the socket or the spool
+    volatile jlong bytesOut;
+    // the same before compression
+    volatile jlong bytesEncoded;
+    // heap the agent allocated for itself, JVMTI allocations aside
+    volatile jlong memory;
+    LatencyStats latency[STAT_LAST + 1];
+} AgentStats;
+
+/**
+ * Stack trace as GetStackTrace returns it, top frame first. Only lives on the
+ * allocating thread's stack, sites keep their frames in the frame trie.
+ */
 typedef struct Trace {
     jint numberOfFrames;
-    jvmtiFrameInfo frames[MAX_FRAMES + 2];
+    // room for the HeapTracker frames above the allocating method
+    jvmtiFrameInfo frames[MAX_DEPTH + 2];
     TraceFlavor flavor;
 } Trace;
 
+/**
+ * Node of the frame trie: a frame and the node of its caller. Stacks sharing
+ * callers share nodes, so a site refers to the node of its top frame only.
+ * Nodes are inserted lock-free by allocating threads and never removed.
+ */
+typedef struct FrameNode {
+    jvmtiFrameInfo frame;
+    // caller, NULL for the bottom frame
+    struct FrameNode *parent;
+    jint hashCode;
+    // id the frame's definition is sent under
+    jlong id;
+    struct FrameNode *hashNext;
+    // owned by drainer: definition sent
+    jboolean announced;
+} FrameNode;
+
+/**
+ * Unique allocation site. Sites are inserted lock-free by allocating threads
+ * and never removed.
+ */
+typedef struct TraceSite {
+    // top frame, NULL for an empty trace
+    FrameNode *node;
+    TraceFlavor flavor;
+    jint hashCode;
+    // id the site's definition is sent under
+    jlong id;
+    struct TraceSite *hashNext;
+
+    // aggregate mode counters, updated atomically
+    volatile jlong allocated;
+    volatile jlong freed;
+    volatile jlong liveBytes;
+
+    // lifetime histograms in nanoseconds, then in GC cycles survived;
+    // allocated on first free and cleared by drainer as it reports them
+    jlong *lifetimes;
+    volatile jboolean lifetimesDirty;
+
+    // owned by drainer: definition sent, counters of the last snapshot
+    jboolean announced;
+    jlong reportedAllocated;
+    jlong reportedFreed;
+    jlong reportedLiveBytes;
+} TraceSite;
+
+/**
+ * Class of allocated objects. Resolved once per class by the first thread
+ * allocating one and never freed; the class object's tag is the negated
+ * address of its ClassInfo, object tags are positive slab references.
+ */
+typedef struct ClassInfo {
+    // id the class definition is sent under
+    jlong id;
+    // JVM signature, e.g. Ljava/lang/String; or [I
+    char *signature;
+    jboolean isArray;
+    // passes include= and exclude=
+    jboolean tracked;
+    // owned by drainer: definition sent
+    jboolean announced;
+    struct ClassInfo *next;
+} ClassInfo;
+
+/**
+ * Node of a class pattern trie over internal class names, a ; ending exact
+ * names. Built at load time, then only read. The root's verdict applies to
+ * classes no pattern matches.
+ */
+typedef struct FilterNode {
+    char c;
+    // verdict of the pattern ending here, FILTER_NONE if none does
+    FilterVerdict verdict;
+    struct FilterNode *child;
+    struct FilterNode *sibling;
+} FilterNode;
+
+/**
+ * Per object record. Lives in a slab slot the object's tag refers to from
+ * allocation until ObjectFree, and is copied into the ring for the drainer.
+ */
 typedef struct TraceInfo {
-    Trace trace;
+    TraceSite *site;
+    // NULL if the class could not be resolved
+    ClassInfo *klass;
 
     jlong allocationTime;
     jlong deallocationTime;
+    // GC cycles started before the allocation
+    jlong allocationEpoch;
 
     jlong id;
+    jlong size;
+    // array length, -1 for plain objects
+    jint length;
+    // serial of the allocating thread
+    jint thread;
+    // number of allocations this sampled one stands for
+    jint weight;
+    // next slot on the free list while this one is unused
+    volatile unsigned int nextFree;
 } TraceInfo;
 
+/**
+ * Symbol data of a method, resolved once and owned by the drainer thread
+ */
+typedef struct MethodInfo {
+    jmethodID method;
+    char *signature;
+    char *methodName;
+    char *fileName;
+    jboolean isTracker;
+    // sorted by start_location
+    jint lineCount;
+    jvmtiLineNumberEntry *lineTable;
+    struct MethodInfo *hashNext;
+} MethodInfo;
+
+/**
+ * Objects freed during one GC cycle, packed per object as zigzag varint id
+ * and allocation time deltas plus site, size, weight and class. Filled by
+ * ObjectFree, sealed at GarbageCollectionFinish and sent as one record by
+ * the drainer.
+ */
+typedef struct FreeBatch {
+    unsigned char *data;
+    int length;
+    int capacity;
+    jint count;
+    jlong lastId;
+    jlong lastTime;
+    // GC cycle the batch was sealed in
+    jlong epoch;
+    jlong time;
+    // sum of the weights of the freed objects
+    jlong weight;
+} FreeBatch;
+
+/**
+ * Ids of live tracked objects, collected by a heap walk
+ */
+typedef struct LiveIds {
+    jlong *ids;
+    jlong count;
+    jlong capacity;
+} LiveIds;
+
+/**
+ * Chunk of encoded output queued for the sender thread
+ */
+typedef struct SendChunk {
+    unsigned char *data;
+    int length;
+    // connection the chunk was encoded for, see sendEpoch
+    jint epoch;
+    // weighted number of creates and frees in the chunk
+    jlong events;
+} SendChunk;
+
+/**
+ * Single producer ring of allocation events owned by one Java thread and
+ * consumed by the drainer thread. Only the owner writes head, only the
+ * drainer writes tail.
+ */
+typedef struct ThreadRing {
+    volatile jlong head;
+    volatile jlong tail;
+
+    // object id block reserved by the owner thread
+    jlong nextId;
+    jlong lastId;
+    // serial of the owner thread, the thread id on the wire
+    jint serial;
+    // name and group of the owner thread, JVMTI allocated and resolved when
+    // the ring is created, resolved again at ThreadEnd
+    char *threadName;
+    char *threadGroup;
+    char *endName;
+    char *endGroup;
+    // owned by drainer: identity went out on the current stream
+    jboolean threadAnnounced;
+
+    // weighted tracked allocations and their bytes, written by the owner
+    // thread only, drainer sends deltas since what it reported
+    jlong allocated;
+    jlong allocatedBytes;
+    jlong reportedAllocated;
+    jlong reportedBytes;
+
+    // sampling state of the owner thread
+    jlong sampleCountdown;
+    jlong bytesUntilSample;
+    unsigned long long random;
+
+    // allocations of the owner past the engaged check, disengage waits for
+    // them to be tagged; only the owner writes it
+    volatile jint tracking;
+    // set at ThreadEnd, drainer frees the ring once it is empty and finished
+    volatile jboolean retired;
+    jboolean finished;
+    struct ThreadRing *next;
+
+    // overhead of the owner thread
+    AgentStats stats;
+
+    TraceInfo events[RING_SIZE];
+} ThreadRing;
+
+/**
+ * Header of a spool segment. The segment's data follows the header and only
+ * the first committed bytes of it are valid, the rest is preallocated. The
+ * data of all segments in sequence order is the same stream a server
+ * connection would get.
+ */
+typedef struct SpoolHeader {
+    char magic[3];
+    unsigned char version;
+    jint sequence;
+    volatile jlong committed;
+} SpoolHeader;
+
+/**
+ * Header of a capture file of record=, a sequence of blocks follows it
+ */
+typedef struct CaptureHeader {
+    char magic[3];
+    unsigned char version;
+    // WireFormat of the stream
+    jint format;
+    // wall clock nanoseconds recording started at
+    jlong startTime;
+} CaptureHeader;
+
+/**
+ * Header of a capture block: the bytes of one flush of the output buffer,
+ * before compression, with the time they were flushed at. Records may span
+ * blocks, blocks of one stream in sequence are what a connection got.
+ */
+typedef struct CaptureBlock {
+    // wall clock nanoseconds
+    jlong time;
+    jint length;
+    jint flags;
+    // weighted events encoded into the block
+    jlong events;
+} CaptureBlock;
+
+/**
+ * Header of the shared memory ring, SHM_RING_SIZE data bytes follow it.
+ * Drainer appends the stream a server connection would get at head, the
+ * reader consumes it in place up to head and moves tail. The reader attaches
+ * by bumping attachRequests, drainer answers with a fresh stream starting at
+ * streamStart and sets streamEpoch to the request it served. Head and tail
+ * sit on cache lines of their own.
+ */
+typedef struct ShmHeader {
+    char magic[3];
+    unsigned char version;
+    jint capacity;
+    jint agentPid;
+    // set once the agent wrote its last byte
+    volatile jint closed;
+    // written by the reader
+    volatile jint attachRequests;
+    volatile jint readerPid;
+    // written by drainer
+    volatile jint streamEpoch;
+    jint reserved;
+    volatile jlong streamStart;
+    // bumped by the reader to ask for a heap snapshot
+    volatile jlong snapshotRequests;
+    char padding1[16];
+    volatile jlong head;
+    char padding2[56];
+    volatile jlong tail;
+    char padding3[56];
+} ShmHeader;
+
 typedef struct {
     jvmtiEnv *jvmti;
 
     jboolean vmStarted;
     jboolean vmInitialized;
     jboolean vmDead;
+    // loaded into a running VM by Agent_OnAttach
+    jboolean attached;
+    // jar holding HeapTracker, added to the boot class path
+    char *bootClassPath;
+
+    // tracking events are on and HeapTracker is engaged, changed by drainer
+    volatile jboolean engaged;
+    // set by the engage and disengage commands, drainer applies it
+    volatile EngageRequest engageRequest;
+    // file holding engage or disengage, polled by drainer
+    char *controlPath;
+    struct timespec controlModified;
+    jlong lastControlTime;
 
     int maxDump;
 
     jrawMonitorID lock;
+    jrawMonitorID drainLock;
+    jrawMonitorID freeLock;
 
-    jlong counter;
+    // handed out in blocks of ID_BLOCK_SIZE
+    volatile jlong counter;
+    // registered per thread rings, guarded by lock
+    ThreadRing *rings;
+    jint threadCounter;
+    // per object records, chunks are allocated on demand and never freed
+    TraceInfo *slabChunks[SLAB_MAX_CHUNKS];
+    volatile jlong slabTop;
+    volatile unsigned long long slabFreeHead;
+    // batches[freeSealed % FREE_BATCH_COUNT] is open for ObjectFree,
+    // sealed ones up to freeSealed wait for drainer; guarded by freeLock
+    FreeBatch freeBatches[FREE_BATCH_COUNT];
+    // frees arriving while all batches are sealed, with backpressure=block;
+    // moved into the next batch that opens, guarded by freeLock
+    FreeBatch freeOverflow;
+    volatile jlong freeSealed;
+    volatile jlong freeSent;
+    // incremented at every GarbageCollectionStart
+    volatile jlong gcEpoch;
+    volatile jboolean gcActive;
+
+    jboolean drainerStarted;
+    volatile jboolean drainerStop;
+    jboolean drainerDone;
     TraceInfo *emptyTrace[TRACE_LAST + 1];
+    // trace interning table, buckets are swapped in with CAS
+    TraceSite *hashBuckets[HASH_BUCKET_COUNT];
+    volatile jlong siteCounter;
+    // frame trie nodes by parent and frame, buckets are swapped in with CAS
+    FrameNode *frameBuckets[FRAME_BUCKET_COUNT];
+    volatile jlong frameCounter;
+    // frames walked per allocation, depth=
+    jint depth;
+    // sites by id, for decoding aggregate mode tags
+    TraceSite **sitesById;
+    // jmethodID metadata cache, only touched by drainer
+    MethodInfo *methodBuckets[METHOD_BUCKET_COUNT];
+    // set when a class got unloaded, cache is flushed on next lookup
+    volatile jboolean methodCacheStale;
+    // classes of allocated objects, pushed under lock
+    ClassInfo *classes;
+    jlong classCounter;
+    // include=/exclude= patterns, NULL if there are none
+    FilterNode *classFilter;
+    // instrument= patterns, NULL to instrument java/lang/Object only
+    FilterNode *instrumentFilter;
     char *serverHostname;
     int port;
+    // owned by sender thread, -1 while disconnected
     int socket_desc;
     struct sockaddr_in server;
+
+    // drainer publishes chunks at sendHead, sender consumes at sendTail
+    jrawMonitorID sendLock;
+    SendChunk *sendChunks;
+    volatile jlong sendHead;
+    volatile jlong sendTail;
+    // bumped by sender on every reconnect, the server starts from scratch
+    volatile jint sendEpoch;
+    // epoch drainer encodes for
+    jint writeEpoch;
+    jboolean everConnected;
+    jboolean senderStarted;
+    volatile jboolean senderStop;
+    volatile jboolean senderAbort;
+    volatile jboolean senderDone;
+    // partial command read from the server, owned by sender
+    char commandBuffer[COMMAND_BUFFER_SIZE];
+    int commandLength;
+
+    // compress=, offered on every connect
+    FrameCodec compressCodec;
+    jint frameSize;
+    jlong frameLatency;
+    // owned by sender: the server answered the offer, the connection
+    // carries frames in the codec it picked
+    jboolean codecAnswered;
+    jboolean framed;
+    FrameCodec frameCodec;
+    // chunks accumulated since frameStart, compressed into compressBuffer
+    unsigned char *frameBuffer;
+    int frameLength;
+    jlong frameEvents;
+    jlong frameStart;
+    unsigned char *compressBuffer;
+    jint *lzTable;
+
+    // set by the snapshot command or signal, drainer walks the heap
+    volatile jboolean heapSnapshotRequested;
+    jlong heapSnapshotCounter;
+    // signal requesting a heap snapshot, 0 for none
+    int snapshotSignal;
+
+    BackpressurePolicy backpressure;
+    // weighted event counts lost or degraded to counters, reported by drainer
+    volatile jlong droppedCreates;
+    volatile jlong droppedFrees;
+    volatile jlong degradedCreates;
+    volatile jlong degradedFrees;
+    volatile jlong discardedEvents;
+    jlong reportedDrops;
+
+    OutputTarget output;
+    char *spoolPath;
+    // current spool segment, owned by drainer once it runs
+    SpoolHeader *spoolSegment;
+    jint spoolSequence;
+    jlong spoolLength;
+    char *shmName;
+    // shared memory ring, owned by drainer once it runs
+    ShmHeader *shm;
+    jlong shmSnapshotRequests;
+    // record= capture of the output, owned by drainer once it runs
+    char *capturePath;
+    FILE *capture;
+    jboolean captureNewStream;
+
+    WireFormat format;
+    AgentMode mode;
+    jlong snapshotInterval;
+    jlong lastSnapshotTime;
+    SampleMode sampleMode;
+    jlong sampleInterval;
+    // output state, only touched by drainer once it runs
+    unsigned char *outBuffer;
+    int outLength;
+    jlong outEvents;
+    unsigned char *recordBuffer;
+    // timestamps go out as deltas against the previous one
+    jlong lastTime;
+    // wall clock minus monotonic clock at startup, in nanoseconds
+    jlong clockBase;
+
+    // overhead outside of thread rings, and of threads gone
+    AgentStats stats;
 } GlobalAgentData;
 
 static GlobalAgentData *gdata;
@@ -110,374 +775,4049 @@ unlock(jvmtiEnv *jvmti) {
 }
 
 /**
- * creates socket connection to server
+ * Allocates zeroed memory owned by the agent, counting it in the stats
+ * @param size
+ * @return never NULL
  */
-static void initiateSocketConnection() {
-    //create socket
-    gdata->socket_desc = socket(AF_INET, SOCK_STREAM, 0);
-    if (gdata->socket_desc == -1) {
-        printf("could not create socket");
-    }
-    printf("connecting to %s:%d \n", gdata->serverHostname, gdata->port);
-    gdata->server.sin_addr.s_addr = inet_addr(gdata->serverHostname);
-    gdata->server.sin_family = AF_INET;
-    gdata->server.sin_port = htons(gdata->port);
+static void *
+allocateMemory(size_t size) {
+    void *p;
 
-    //Connect to remote server
-    if (connect(gdata->socket_desc, (struct sockaddr *) &gdata->server, sizeof (gdata->server)) < 0) {
-        puts("connect error\n");
-        return;
+    p = calloc(1, size);
+    if (p == NULL) {
+        fatal_error("ERROR: Ran out of malloc() space\n");
     }
-
-    puts("Connected\n");
+    __sync_fetch_and_add(&gdata->stats.memory, (jlong) size);
+    return p;
 }
 
 /**
- * Writes message to socket
- * @param message
+ * Frees memory taken with allocateMemory
+ * @param p
+ * @param size the size it was allocated with
  */
 static void
-flushToSocket(char* message) {
-    if (send(gdata->socket_desc, message, strlen(message), 0) < 0) {
-        puts("Send failed");
-        return;
-    }
+releaseMemory(void *p, size_t size) {
+    free(p);
+    __sync_fetch_and_sub(&gdata->stats.memory, (jlong) size);
 }
 
 /**
- * Returns empty stacktrace
- * @param flavor
+ * Gets current time in nanoseconds since epoch. Taken from the monotonic
+ * clock, so it never goes backwards when the wall clock is adjusted.
  * @return
  */
-static TraceInfo *
-emptyTrace(TraceFlavor flavor) {
-    return gdata->emptyTrace[flavor];
+static jlong
+getTime() {
+    struct timespec now;
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+    return gdata->clockBase + (jlong) now.tv_sec * NANOS_PER_SECOND + now.tv_nsec;
 }
 
 /**
- * Converts FrameInfo into String
- * @param jvmti
- * @param buf
- * @param buflen
- * @param finfo
+ * Anchors getTime() to the wall clock
  */
 static void
-frameToString(jvmtiEnv *jvmti, char *buf, int buflen, jvmtiFrameInfo *finfo) {
-    jvmtiError error;
-    jclass klass;
-    char *signature;
-    char *methodname;
-    char *methodsig;
-    jboolean isNative;
-    char *filename;
-    int lineCount;
-    jvmtiLineNumberEntry*lineTable;
-    int lineNumber;
-
-    buf[0] = 0;
-    klass = NULL;
-    signature = NULL;
-    methodname = NULL;
-    methodsig = NULL;
-    isNative = JNI_FALSE;
-    filename = NULL;
-    lineCount = 0;
-    lineTable = NULL;
-    lineNumber = 0;
-
-    error = (*jvmti)->GetMethodDeclaringClass(jvmti, finfo->method, &klass);
-    check_jvmti_error(jvmti, error, "cannot get method's class");
+initClock() {
+    struct timespec wall;
+    struct timespec monotonic;
+    (void) clock_gettime(CLOCK_REALTIME, &wall);
+    (void) clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    gdata->clockBase = ((jlong) wall.tv_sec - (jlong) monotonic.tv_sec) * NANOS_PER_SECOND
+            + wall.tv_nsec - monotonic.tv_nsec;
+}
 
-    // get the class signature
-    error = (*jvmti)->GetClassSignature(jvmti, klass, &signature, NULL);
-    check_jvmti_error(jvmti, error, "cannot get class signature");
+/**
+ * Returns histogram bucket of a value, log-linear: exact below
+ * 2^HISTOGRAM_SUB_BITS, then 2^HISTOGRAM_SUB_BITS buckets per power of two
+ * @param value
+ * @param count number of buckets, larger values land in the last one
+ * @return
+ */
+static int
+histogramBucket(jlong value, int count) {
+    int msb;
+    int index;
 
-    // skip for HeapTracker class
-    if (strcmp(signature, "L" STRING(HEAP_TRACKER_class) ";") == 0) {
-        deallocate(jvmti, signature);
-        return;
+    if (value < (1 << HISTOGRAM_SUB_BITS)) {
+        return value < 0 ? 0 : (int) value;
     }
+    msb = 63 - __builtin_clzll((unsigned long long) value);
+    index = ((msb - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+            | (int) ((value >> (msb - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+    return index < count ? index : count - 1;
+}
 
-    // get the name and signature for the method
-    error = (*jvmti)->GetMethodName(jvmti, finfo->method,
-            &methodname, &methodsig, NULL);
-    check_jvmti_error(jvmti, error, "cannot method name");
-
-    // Check to see if it's a native method, which means no lineNumber
-    error = (*jvmti)->IsMethodNative(jvmti, finfo->method, &isNative);
-    check_jvmti_error(jvmti, error, "Cannot get method native status");
+/**
+ * Returns the smallest value falling into a histogram bucket
+ * @param bucket
+ * @return
+ */
+static jlong
+histogramLowerBound(int bucket) {
+    int msb;
 
-    // get source file name
-    error = (*jvmti)->GetSourceFileName(jvmti, klass, &filename);
-    if (error != JVMTI_ERROR_NONE && error != JVMTI_ERROR_ABSENT_INFORMATION) {
-        check_jvmti_error(jvmti, error, "Cannot get source filename");
+    if (bucket < (1 << HISTOGRAM_SUB_BITS)) {
+        return bucket;
     }
+    msb = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    return (jlong) ((1 << HISTOGRAM_SUB_BITS) | (bucket & ((1 << HISTOGRAM_SUB_BITS) - 1)))
+            << (msb - HISTOGRAM_SUB_BITS);
+}
 
-    // Get lineNumber if we can
-    if (!isNative) {
-        int i;
+/**
+ * Counts one run of an operation
+ * @param stats
+ * @param start getTime() when the operation started
+ */
+static void
+recordLatency(LatencyStats *stats, jlong start) {
+    jlong nanos;
 
-        // Get method line table
-        error = (*jvmti)->GetLineNumberTable(jvmti, finfo->method, &lineCount, &lineTable);
-        if (error == JVMTI_ERROR_NONE) {
-            // Search for line
-            lineNumber = lineTable[0].line_number;
-            for (i = 1; i < lineCount; i++) {
-                if (finfo->location < lineTable[i].start_location) {
-                    break;
-                }
-                lineNumber = lineTable[i].line_number;
-            }
-        } else if (error != JVMTI_ERROR_ABSENT_INFORMATION) {
-            check_jvmti_error(jvmti, error, "Cannot get method line table");
-        }
-    }
+    nanos = getTime() - start;
+    __sync_fetch_and_add(&stats->count, 1);
+    __sync_fetch_and_add(&stats->totalNanos, nanos);
+    __sync_fetch_and_add(&stats->buckets[histogramBucket(nanos, LATENCY_BUCKETS)], 1);
+}
 
-    // TODO: i18n
-    (void) sprintf(buf, "%s.%s@%d[%s:%d]",
-            (signature == NULL ? "UnknownClass" : signature),
-            (methodname == NULL ? "UnknownMethod" : methodname),
-            (int) finfo->location,
-            (filename == NULL ? "UnknownFile" : filename),
-            lineNumber);
+/**
+ * Adds one set of stats to another, memory aside since the agent's memory
+ * is counted in gdata only
+ * @param total
+ * @param stats
+ */
+static void
+addStats(AgentStats *total, AgentStats *stats) {
+    int op;
+    int i;
 
-    /// Free up JVMTI space allocated by the above calls
-    deallocate(jvmti, signature);
-    deallocate(jvmti, methodname);
-    deallocate(jvmti, methodsig);
-    deallocate(jvmti, filename);
-    deallocate(jvmti, lineTable);
+    __sync_fetch_and_add(&total->created, __atomic_load_n(&stats->created, __ATOMIC_RELAXED));
+    __sync_fetch_and_add(&total->freed, __atomic_load_n(&stats->freed, __ATOMIC_RELAXED));
+    __sync_fetch_and_add(&total->bytesOut, __atomic_load_n(&stats->bytesOut, __ATOMIC_RELAXED));
+    __sync_fetch_and_add(&total->bytesEncoded, __atomic_load_n(&stats->bytesEncoded, __ATOMIC_RELAXED));
+    for (op = 0; op <= STAT_LAST; op++) {
+        __sync_fetch_and_add(&total->latency[op].count,
+                __atomic_load_n(&stats->latency[op].count, __ATOMIC_RELAXED));
+        __sync_fetch_and_add(&total->latency[op].totalNanos,
+                __atomic_load_n(&stats->latency[op].totalNanos, __ATOMIC_RELAXED));
+        for (i = 0; i < LATENCY_BUCKETS; i++) {
+            __sync_fetch_and_add(&total->latency[op].buckets[i],
+                    __atomic_load_n(&stats->latency[op].buckets[i], __ATOMIC_RELAXED));
+        }
+    }
 }
 
 /**
- * Gets current time in millisecond
- * @return
+ * Sums up the stats of gdata and of every live ring
+ * @param jvmti
+ * @param total zeroed on entry
  */
-static jlong
-getTime() {
-    time_t seconds;
-    time(&seconds);
-    unsigned long long millis = (unsigned long long) seconds * 1000;
-    return millis;
+static void
+collectStats(jvmtiEnv *jvmti, AgentStats *total) {
+    ThreadRing *ring;
+
+    addStats(total, &gdata->stats);
+    total->memory = __atomic_load_n(&gdata->stats.memory, __ATOMIC_RELAXED);
+    lock(jvmti);
+    for (ring = gdata->rings; ring != NULL; ring = ring->next) {
+        addStats(total, &ring->stats);
+    }
+    unlock(jvmti);
 }
 
 /**
- * Constructs TraceInfo
- * @param trace
- * @param flavor
+ * Returns the value below which the given share of a histogram's counts
+ * fall, as the lower bound of the bucket it lands in
+ * @param buckets
+ * @param count number of buckets
+ * @param percentile 0 to 100
  * @return
  */
-static TraceInfo *
-constructTraceInfo(Trace *trace, TraceFlavor flavor) {
-    TraceInfo *tinfo;
-    tinfo = (TraceInfo*) malloc(sizeof (TraceInfo));
-    if (tinfo == NULL) {
-        fatal_error("ERROR: Ran out of malloc() space\n");
-    } else {
-        gdata->counter = gdata->counter + 1;
-        tinfo->trace = *trace;
-        tinfo->trace.flavor = flavor;
-        tinfo->id = gdata->counter;
-        tinfo->allocationTime = getTime();
+static jlong
+histogramPercentile(jlong *buckets, int count, double percentile) {
+    jlong total;
+    jlong seen;
+    int i;
+
+    total = 0;
+    for (i = 0; i < count; i++) {
+        total += buckets[i];
+    }
+    seen = 0;
+    for (i = 0; i < count; i++) {
+        seen += buckets[i];
+        if (seen > 0 && (double) seen >= total * percentile / 100.0) {
+            return histogramLowerBound(i);
+        }
     }
-    return tinfo;
+    return 0;
 }
 
 /**
- * prints traceinfo
- *
- * @param jvmti
- * @param tinfo
- * @param stringData
+ * creates non-blocking socket connection to server, waiting at most
+ * SEND_CONNECT_TIMEOUT_MILLIS for it
+ * @return socket, -1 if server could not be reached
  */
-static void
-printTraceInfo(jvmtiEnv *jvmti, TraceInfo* tinfo, char* stringData) {
-    if (tinfo == NULL) {
-        fatal_error("%d: NULL ENTRY ERROR\n", index);
-        return;
+static int
+connectSocket() {
+    struct pollfd pfd;
+    socklen_t length;
+    int error;
+    int fd;
+
+    //create socket
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        printf("could not create socket\n");
+        return -1;
     }
+    (void) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    gdata->server.sin_addr.s_addr = inet_addr(gdata->serverHostname);
+    gdata->server.sin_family = AF_INET;
+    gdata->server.sin_port = htons(gdata->port);
 
-    if (tinfo->trace.numberOfFrames > 0) {
-        int i;
-        int fcount;
+    //Connect to remote server
+    if (connect(fd, (struct sockaddr *) &gdata->server, sizeof (gdata->server)) < 0) {
+        if (errno != EINPROGRESS) {
+            (void) close(fd);
+            return -1;
+        }
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        error = 0;
+        length = sizeof (error);
+        if (poll(&pfd, 1, SEND_CONNECT_TIMEOUT_MILLIS) <= 0
+                || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+            (void) close(fd);
+            return -1;
+        }
+    }
+    printf("connected to %s:%d\n", gdata->serverHostname, gdata->port);
+    return fd;
+}
 
-        fcount = 0;
-        strcpy(stringData, "\0");
-        for (i = 0; i < tinfo->trace.numberOfFrames; i++) {
-            char buf[4096];
+/**
+ * Writes bytes to socket, sender thread only. Waits for a slow server,
+ * once the VM is dead only up to SEND_SHUTDOWN_MILLIS.
+ * @param data
+ * @param length
+ * @return false if the connection broke
+ */
+static jboolean
+sendToSocket(const unsigned char *data, int length) {
+    struct pollfd pfd;
+    jlong stalled;
+    int offset;
+    ssize_t sent;
 
-            frameToString(jvmti, buf, (int) sizeof (buf), tinfo->trace.frames + i);
-            if (buf[0] == 0) {
-                // skip Tracker's
-                continue;
+    offset = 0;
+    stalled = 0;
+    while (offset < length) {
+        sent = send(gdata->socket_desc, data + offset, (size_t) (length - offset),
+                MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                puts("Send failed");
+                return JNI_FALSE;
+            }
+            if (gdata->vmDead && stalled >= SEND_SHUTDOWN_MILLIS) {
+                gdata->senderAbort = JNI_TRUE;
             }
-            fcount++;
-            strcat(stringData, buf);
-            if (i < (tinfo->trace.numberOfFrames - 1)) {
-                //stdout_message(",");
-                strcat(stringData, ",\0");
+            if (gdata->senderAbort) {
+                return JNI_FALSE;
             }
+            pfd.fd = gdata->socket_desc;
+            pfd.events = POLLOUT;
+            (void) poll(&pfd, 1, SEND_POLL_MILLIS);
+            stalled += SEND_POLL_MILLIS;
+            continue;
         }
-        strcat(stringData, "\n\0");
-    } else {
-        strcpy(stringData, "<empty>\n\0");
+        stalled = 0;
+        offset += (int) sent;
     }
+    return JNI_TRUE;
 }
 
 /**
- * Custom event handler for deallocation of object
- * @param id
+ * Hands the output buffer to the sender thread and switches to the next free
+ * chunk, waiting for one when the queue is full. Only drainer waits here,
+ * allocating threads never do unless backpressure=block.
  */
 static void
-eventDeallocatation(jlong id) {
-    char *message;
-    asprintf(&message, "d_%ld_%ld\n", id, getTime());
-    flushToSocket(message);
-    deallocate(gdata->jvmti, message);
+publishChunk() {
+    jvmtiEnv *jvmti;
+    SendChunk *chunk;
+    jlong head;
+    jlong start;
+
+    jvmti = gdata->jvmti;
+    head = gdata->sendHead;
+    chunk = &gdata->sendChunks[head % SEND_QUEUE_CHUNKS];
+    chunk->length = gdata->outLength;
+    chunk->epoch = gdata->writeEpoch;
+    chunk->events = gdata->outEvents;
+    gdata->outLength = 0;
+    gdata->outEvents = 0;
+
+    (*jvmti)->RawMonitorEnter(jvmti, gdata->sendLock);
+    if (gdata->senderDone) {
+        // nobody is going to send it
+        __sync_fetch_and_add(&gdata->discardedEvents, chunk->events);
+    } else {
+        __atomic_store_n(&gdata->sendHead, head + 1, __ATOMIC_RELEASE);
+        (*jvmti)->RawMonitorNotifyAll(jvmti, gdata->sendLock);
+        if (head + 1 - __atomic_load_n(&gdata->sendTail, __ATOMIC_ACQUIRE) >= SEND_QUEUE_CHUNKS) {
+            start = getTime();
+            while (head + 1 - __atomic_load_n(&gdata->sendTail, __ATOMIC_ACQUIRE) >= SEND_QUEUE_CHUNKS
+                    && !gdata->senderDone) {
+                (*jvmti)->RawMonitorWait(jvmti, gdata->sendLock, SEND_POLL_MILLIS);
+            }
+            recordLatency(&gdata->stats.latency[STAT_QUEUE_WAIT], start);
+        }
+        head++;
+    }
+    (*jvmti)->RawMonitorExit(jvmti, gdata->sendLock);
+    gdata->outBuffer = gdata->sendChunks[head % SEND_QUEUE_CHUNKS].data;
 }
 
 /**
- * Custom event handler for allocation of object
- * @param tinfo
+ * Maps next spool segment, pre-sized so appending never grows the file
  */
 static void
-eventAllocation(TraceInfo *tinfo) {
-    // limit it to USER flavor for now
-    if (!tinfo->trace.flavor == TRACE_USER) {
+openSpoolSegment() {
+    char path[1024];
+    void *segment;
+    int fd;
+
+    (void) snprintf(path, sizeof (path), "%s.%06d", gdata->spoolPath, (int) gdata->spoolSequence);
+    gdata->spoolSegment = NULL;
+    gdata->spoolLength = 0;
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("could not create spool segment %s\n", path);
+        return;
+    }
+    if (ftruncate(fd, SPOOL_SEGMENT_SIZE) != 0) {
+        printf("could not size spool segment %s\n", path);
+        (void) close(fd);
+        return;
+    }
+    segment = mmap(NULL, SPOOL_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // the mapping keeps the file alive
+    (void) close(fd);
+    if (segment == MAP_FAILED) {
+        printf("could not map spool segment %s\n", path);
         return;
     }
-    char* stringData = (char*) malloc(4096 * sizeof (char));
-    printTraceInfo(gdata->jvmti, tinfo, stringData);
-    char *headerPart;
-    char *entireMessage;
-    char *code = "c";
-    asprintf(&headerPart, "%s_%d_%s_%ld", code, tinfo->id, flavorDesc[tinfo->trace.flavor], getTime());
-    asprintf(&entireMessage, "%s_%s", headerPart, stringData);
-    flushToSocket(entireMessage);
-    deallocate(gdata->jvmti, entireMessage);
-    deallocate(gdata->jvmti, headerPart);
-    deallocate(gdata->jvmti, stringData);
+    gdata->spoolSegment = (SpoolHeader*) segment;
+    (void) memcpy(gdata->spoolSegment->magic, SPOOL_MAGIC, 3);
+    gdata->spoolSegment->version = SPOOL_VERSION;
+    gdata->spoolSegment->sequence = gdata->spoolSequence;
+    gdata->spoolSegment->committed = 0;
+    printf("spooling to %s\n", path);
 }
 
 /**
- * Process the trace
- * @param jvmti
- * @param trace
- * @param flavor
- * @return
+ * Publishes everything appended to the current segment so far. Whatever was
+ * committed survives a crash of the process.
  */
-static TraceInfo *
-processTrace(jvmtiEnv *jvmti, Trace *trace, TraceFlavor flavor) {
-    TraceInfo *tinfo;
-    lock(jvmti);
-    {
-        tinfo = constructTraceInfo(trace, flavor);
-        eventAllocation(tinfo);
+static void
+commitSpool() {
+    if (gdata->spoolSegment != NULL) {
+        __atomic_store_n(&gdata->spoolSegment->committed, gdata->spoolLength, __ATOMIC_RELEASE);
     }
-    unlock(jvmti);
-    return tinfo;
 }
 
 /**
- * Gets the TraceInfo
- * @param jvmti
- * @param thread
- * @param flavor
- * @return
+ * Unmaps the current spool segment
  */
-static TraceInfo *
-getTraceInfo(jvmtiEnv *jvmti, jthread thread, TraceFlavor flavor) {
-    TraceInfo *tinfo;
-    jvmtiError error;
-
-    tinfo = NULL;
-    if (thread != NULL) {
-        static Trace empty;
-        Trace trace;
-
-        // Before VM_INIT thread could be NULL, watch out
-        trace = empty;
-        error = (*jvmti)->GetStackTrace(jvmti, thread, 0, MAX_FRAMES + 2,
-                trace.frames, &(trace.numberOfFrames));
-        // If we get a PHASE error, the VM isn't ready, or it died
-        if (error == JVMTI_ERROR_WRONG_PHASE) {
-            // It is assumed this is before VM_INIT
-            if (flavor == TRACE_USER) {
-                //tinfo = emptyTrace(TRACE_BEFORE_VM_INIT);
-            } else {
-                //tinfo = emptyTrace(flavor);
-            }
-        } else {
-            check_jvmti_error(jvmti, error, "Cannot get stack trace");
-            tinfo = processTrace(jvmti, &trace, flavor);
-        }
-    } else {
-        // If thread==NULL, it's assumed this is before VM_START
-        if (flavor == TRACE_USER) {
-            // TODO: take care of these later
-            //tinfo = emptyTrace(TRACE_BEFORE_VM_START);
-        } else {
-            //tinfo = emptyTrace(flavor);
-        }
+static void
+closeSpoolSegment() {
+    if (gdata->spoolSegment != NULL) {
+        commitSpool();
+        (void) munmap((void*) gdata->spoolSegment, SPOOL_SEGMENT_SIZE);
+        gdata->spoolSegment = NULL;
     }
-    return tinfo;
 }
 
 /**
- * Tags object with heap-inspector's object id
+ * Appends bytes to the spool, rotating to the next segment when the current
+ * one is full. Records may span segments.
+ * @param data
+ * @param length
+ */
+static void
+writeToSpool(const unsigned char *data, int length) {
+    jlong room;
+    int n;
+
+    while (length > 0 && gdata->spoolSegment != NULL) {
+        room = SPOOL_SEGMENT_SIZE - (jlong) sizeof (SpoolHeader) - gdata->spoolLength;
+        if (room == 0) {
+            closeSpoolSegment();
+            gdata->spoolSequence++;
+            openSpoolSegment();
+            continue;
+        }
+        n = room < length ? (int) room : length;
+        (void) memcpy((unsigned char*) (gdata->spoolSegment + 1) + gdata->spoolLength, data, (size_t) n);
+        gdata->spoolLength += n;
+        data += n;
+        length -= n;
+    }
+}
+
+/**
+ * Creates the capture file of record=, replacing an earlier one
+ */
+static void
+openCapture() {
+    CaptureHeader header;
+
+    gdata->capture = fopen(gdata->capturePath, "wb");
+    if (gdata->capture == NULL) {
+        printf("could not create capture %s\n", gdata->capturePath);
+        return;
+    }
+    (void) memset(&header, 0, sizeof (header));
+    (void) memcpy(header.magic, CAPTURE_MAGIC, 3);
+    header.version = CAPTURE_VERSION;
+    header.format = (jint) gdata->format;
+    header.startTime = getTime();
+    if (fwrite(&header, sizeof (header), 1, gdata->capture) != 1) {
+        printf("could not write capture %s\n", gdata->capturePath);
+        (void) fclose(gdata->capture);
+        gdata->capture = NULL;
+        return;
+    }
+    gdata->captureNewStream = JNI_TRUE;
+    printf("recording output to %s\n", gdata->capturePath);
+}
+
+/**
+ * Appends the output buffer to the capture as one block, recording stops
+ * when the file can't be written, e.g. because the disk is full
+ */
+static void
+writeToCapture() {
+    CaptureBlock block;
+
+    block.time = getTime();
+    block.length = gdata->outLength;
+    block.flags = gdata->captureNewStream ? CAPTURE_NEW_STREAM : 0;
+    block.events = gdata->outEvents;
+    if (fwrite(&block, sizeof (block), 1, gdata->capture) != 1
+            || fwrite(gdata->outBuffer, (size_t) gdata->outLength, 1, gdata->capture) != 1) {
+        printf("could not write capture %s, recording stopped\n", gdata->capturePath);
+        (void) fclose(gdata->capture);
+        gdata->capture = NULL;
+        return;
+    }
+    gdata->captureNewStream = JNI_FALSE;
+}
+
+/**
+ * Closes the capture, everything written before reaches the file
+ */
+static void
+closeCapture() {
+    if (gdata->capture != NULL) {
+        (void) fclose(gdata->capture);
+        gdata->capture = NULL;
+    }
+}
+
+/**
+ * Creates the shared memory ring, replacing whatever a previous agent left
+ * under the same name
+ */
+static void
+openShm() {
+    char path[1024];
+    ShmHeader *shm;
+    void *mapping;
+    int fd;
+
+    (void) snprintf(path, sizeof (path), "/dev/shm/%s", gdata->shmName);
+    gdata->shm = NULL;
+    // a reader still mapping the old one sees it closed
+    (void) unlink(path);
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        printf("could not create shared memory ring %s\n", path);
+        return;
+    }
+    if (ftruncate(fd, (off_t) (sizeof (ShmHeader) + SHM_RING_SIZE)) != 0) {
+        printf("could not size shared memory ring %s\n", path);
+        (void) close(fd);
+        return;
+    }
+    mapping = mmap(NULL, sizeof (ShmHeader) + SHM_RING_SIZE, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    (void) close(fd);
+    if (mapping == MAP_FAILED) {
+        printf("could not map shared memory ring %s\n", path);
+        return;
+    }
+    shm = (ShmHeader*) mapping;
+    shm->version = SHM_VERSION;
+    shm->capacity = SHM_RING_SIZE;
+    shm->agentPid = (jint) getpid();
+    // readers wait for the magic
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    (void) memcpy(shm->magic, SHM_MAGIC, 3);
+    gdata->shm = shm;
+    printf("writing to shared memory ring %s\n", path);
+}
+
+/**
+ * Tells the reader no more bytes will come and removes the ring, a reader
+ * still mapping it reads on until the end
+ */
+static void
+closeShm() {
+    char path[1024];
+
+    if (gdata->shm != NULL) {
+        __atomic_store_n(&gdata->shm->closed, 1, __ATOMIC_RELEASE);
+        (void) snprintf(path, sizeof (path), "/dev/shm/%s", gdata->shmName);
+        (void) unlink(path);
+        (void) munmap((void*) gdata->shm, sizeof (ShmHeader) + SHM_RING_SIZE);
+        gdata->shm = NULL;
+    }
+}
+
+/**
+ * Whether a reader consumes the stream drainer encodes for
+ * @return
+ */
+static jboolean
+shmReaderAttached() {
+    return gdata->shm != NULL && __atomic_load_n(&gdata->shm->readerPid, __ATOMIC_ACQUIRE) != 0
+            && __atomic_load_n(&gdata->shm->attachRequests, __ATOMIC_ACQUIRE) == gdata->writeEpoch;
+}
+
+/**
+ * Detaches a reader whose process is gone, so drainer stops waiting for it
+ * @return
+ */
+static jboolean
+shmReaderDied() {
+    jint pid;
+
+    pid = __atomic_load_n(&gdata->shm->readerPid, __ATOMIC_ACQUIRE);
+    if (pid != 0 && kill((pid_t) pid, 0) != 0 && errno == ESRCH) {
+        (void) __sync_bool_compare_and_swap(&gdata->shm->readerPid, pid, 0);
+        return JNI_TRUE;
+    }
+    return pid == 0;
+}
+
+/**
+ * Appends bytes to the shared memory ring, waiting for the reader to make
+ * room. Only sleeps while the ring is full, the reader polls head.
+ * @param data
+ * @param length
+ * @return JNI_FALSE if there is no reader to take the bytes
+ */
+static jboolean
+writeToShm(const unsigned char *data, int length) {
+    unsigned char *ring;
+    jlong start;
+    jlong head;
+    jlong room;
+    jlong offset;
+    int spins;
+    int n;
+
+    ring = (unsigned char*) (gdata->shm + 1);
+    head = gdata->shm->head;
+    start = 0;
+    spins = 0;
+    while (length > 0) {
+        if (!shmReaderAttached()) {
+            return JNI_FALSE;
+        }
+        room = SHM_RING_SIZE - (head - __atomic_load_n(&gdata->shm->tail, __ATOMIC_ACQUIRE));
+        if (room <= 0) {
+            if (start == 0) {
+                start = getTime();
+            }
+            if (spins++ < SHM_SPIN_YIELDS) {
+                sched_yield();
+            } else if (shmReaderDied()) {
+                return JNI_FALSE;
+            } else {
+                (void) poll(NULL, 0, DRAIN_INTERVAL_MILLIS);
+            }
+            continue;
+        }
+        offset = head & (SHM_RING_SIZE - 1);
+        n = (int) (SHM_RING_SIZE - offset);
+        if (n > room) {
+            n = (int) room;
+        }
+        if (n > length) {
+            n = length;
+        }
+        (void) memcpy(ring + offset, data, (size_t) n);
+        head += n;
+        data += n;
+        length -= n;
+        __atomic_store_n(&gdata->shm->head, head, __ATOMIC_RELEASE);
+    }
+    if (start != 0) {
+        recordLatency(&gdata->stats.latency[STAT_QUEUE_WAIT], start);
+    }
+    return JNI_TRUE;
+}
+
+/**
+ * Picks up heap snapshots the shared memory reader asked for, drainer only
+ */
+static void
+readShmCommands() {
+    jlong requests;
+
+    if (gdata->shm == NULL) {
+        return;
+    }
+    requests = __atomic_load_n(&gdata->shm->snapshotRequests, __ATOMIC_ACQUIRE);
+    if (requests != gdata->shmSnapshotRequests) {
+        gdata->shmSnapshotRequests = requests;
+        gdata->heapSnapshotRequested = JNI_TRUE;
+    }
+}
+
+/**
+ * Stream the output currently goes to: bumped on every reconnect of the
+ * sender and every attach of a shared memory reader
+ * @return
+ */
+static jint
+currentEpoch() {
+    if (gdata->output == OUTPUT_SOCKET) {
+        return __atomic_load_n(&gdata->sendEpoch, __ATOMIC_ACQUIRE);
+    }
+    if (gdata->output == OUTPUT_SHM && gdata->shm != NULL) {
+        return __atomic_load_n(&gdata->shm->attachRequests, __ATOMIC_ACQUIRE);
+    }
+    return gdata->writeEpoch;
+}
+
+/**
+ * Writes buffered output to the configured output
+ */
+static void
+flushOutput() {
+    jlong start;
+
+    if (gdata->capture != NULL) {
+        writeToCapture();
+    }
+    if (gdata->output == OUTPUT_SOCKET) {
+        publishChunk();
+        return;
+    }
+    start = getTime();
+    if (gdata->output == OUTPUT_FILE) {
+        writeToSpool(gdata->outBuffer, gdata->outLength);
+    } else if (!writeToShm(gdata->outBuffer, gdata->outLength)) {
+        // nobody listening, like a broken connection
+        __sync_fetch_and_add(&gdata->discardedEvents, gdata->outEvents);
+        gdata->outLength = 0;
+        gdata->outEvents = 0;
+        return;
+    }
+    recordLatency(&gdata->stats.latency[STAT_SEND], start);
+    __sync_fetch_and_add(&gdata->stats.bytesOut, gdata->outLength);
+    __sync_fetch_and_add(&gdata->stats.bytesEncoded, gdata->outLength);
+    gdata->outLength = 0;
+    gdata->outEvents = 0;
+}
+
+/**
+ * Appends bytes to the output buffer, flushing it whenever it is full
+ * @param data
+ * @param length
+ */
+static void
+writeOutput(const void *data, int length) {
+    const unsigned char *p;
+    int n;
+
+    p = (const unsigned char*) data;
+    while (length > 0) {
+        if (gdata->outLength == OUT_BUFFER_SIZE) {
+            flushOutput();
+        }
+        n = OUT_BUFFER_SIZE - gdata->outLength;
+        if (n > length) {
+            n = length;
+        }
+        (void) memcpy(gdata->outBuffer + gdata->outLength, p, (size_t) n);
+        gdata->outLength += n;
+        p += n;
+        length -= n;
+    }
+}
+
+/**
+ * Formats into a buffer like snprintf, but never past its end
+ * @param buf
+ * @param buflen
+ * @param format
+ * @return number of bytes written, terminator aside
+ */
+static int
+printText(char *buf, int buflen, const char *format, ...) {
+    va_list args;
+    int n;
+
+    if (buflen <= 0) {
+        return 0;
+    }
+    va_start(args, format);
+    n = vsnprintf(buf, (size_t) buflen, format, args);
+    va_end(args);
+    if (n < 0) {
+        buf[0] = 0;
+        return 0;
+    }
+    return n < buflen ? n : buflen - 1;
+}
+
+/**
+ * Formats a line of the text format in the record buffer and writes it out,
+ * drainer only. Lines too long for the buffer are cut, newline kept.
+ * @param format
+ */
+static void
+writeLine(const char *format, ...) {
+    va_list args;
+    char *line;
+    int n;
+
+    line = (char*) gdata->recordBuffer;
+    va_start(args, format);
+    n = vsnprintf(line, MAX_RECORD_LENGTH, format, args);
+    va_end(args);
+    if (n < 0) {
+        return;
+    }
+    if (n >= MAX_RECORD_LENGTH) {
+        n = MAX_RECORD_LENGTH - 1;
+        line[n - 1] = '\n';
+    }
+    writeOutput(line, n);
+}
+
+/**
+ * Encodes unsigned LEB128 varint
+ * @param p
+ * @param value
+ * @return number of bytes written
+ */
+static int
+putVarint(unsigned char *p, unsigned long long value) {
+    int n;
+
+    n = 0;
+    while (value >= 0x80) {
+        p[n++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    p[n++] = (unsigned char) value;
+    return n;
+}
+
+/**
+ * Reads 4 bytes for comparison, unaligned
+ * @param p
+ * @return
+ */
+static unsigned int
+readInt(const unsigned char *p) {
+    unsigned int value;
+
+    (void) memcpy(&value, p, sizeof (value));
+    return value;
+}
+
+/**
+ * Appends an LZ4 length continuation: 255 while more remains, then the rest
+ * @param op
+ * @param length beyond what the token holds
+ * @return next output byte
+ */
+static unsigned char *
+putLzLength(unsigned char *op, int length) {
+    for (; length >= 255; length -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (unsigned char) length;
+    return op;
+}
+
+/**
+ * Compresses into LZ4's block format with a single hash probe per position,
+ * skipping faster through data that doesn't match
+ * @param src
+ * @param length
+ * @param dst
+ * @param capacity
+ * @param table 2^LZ_HASH_BITS entries, contents don't matter
+ * @return compressed length, 0 if it doesn't fit in capacity
+ */
+static int
+lzCompress(const unsigned char *src, int length, unsigned char *dst, int capacity, jint *table) {
+    const unsigned char *ip;
+    const unsigned char *anchor;
+    const unsigned char *ref;
+    const unsigned char *matchLimit;
+    const unsigned char *mfLimit;
+    const unsigned char *end;
+    unsigned char *op;
+    unsigned char *opEnd;
+    unsigned char *token;
+    unsigned int sequence;
+    unsigned int hash;
+    int literals;
+    int match;
+
+    (void) memset(table, 0, sizeof (jint) << LZ_HASH_BITS);
+    end = src + length;
+    matchLimit = end - LZ_LAST_LITERALS;
+    mfLimit = end - LZ_MF_LIMIT;
+    ip = src;
+    anchor = src;
+    op = dst;
+    opEnd = dst + capacity;
+    while (length > LZ_MF_LIMIT && ip < mfLimit) {
+        sequence = readInt(ip);
+        hash = (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+        ref = src + table[hash];
+        table[hash] = (jint) (ip - src);
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || readInt(ref) != sequence) {
+            // step up after every 64 misses in a row
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        for (match = LZ_MIN_MATCH; ip + match < matchLimit && ref[match] == ip[match]; match++) {
+        }
+        literals = (int) (ip - anchor);
+        // token, lengths, literals, offset
+        if (op + 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1 > opEnd) {
+            return 0;
+        }
+        token = op++;
+        *token = (unsigned char) ((literals < 15 ? literals : 15) << 4);
+        if (literals >= 15) {
+            op = putLzLength(op, literals - 15);
+        }
+        (void) memcpy(op, anchor, (size_t) literals);
+        op += literals;
+        *op++ = (unsigned char) (ip - ref);
+        *op++ = (unsigned char) ((ip - ref) >> 8);
+        *token |= (unsigned char) (match - LZ_MIN_MATCH < 15 ? match - LZ_MIN_MATCH : 15);
+        if (match - LZ_MIN_MATCH >= 15) {
+            op = putLzLength(op, match - LZ_MIN_MATCH - 15);
+        }
+        ip += match;
+        anchor = ip;
+    }
+    literals = (int) (end - anchor);
+    if (op + 1 + literals / 255 + 1 + literals > opEnd) {
+        return 0;
+    }
+    token = op++;
+    *token = (unsigned char) ((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15) {
+        op = putLzLength(op, literals - 15);
+    }
+    (void) memcpy(op, anchor, (size_t) literals);
+    op += literals;
+    return (int) (op - dst);
+}
+
+/**
+ * Sends the accumulated frame: codec, raw length, payload length and the
+ * payload, stored as is when compressing doesn't make it smaller. Sender
+ * thread only.
+ * @return false if the connection broke
+ */
+static jboolean
+flushFrame() {
+    unsigned char header[1 + 10 + 10];
+    unsigned char *payload;
+    FrameCodec codec;
+    jlong start;
+    int length;
+    int n;
+
+    if (gdata->frameLength == 0) {
+        return JNI_TRUE;
+    }
+    codec = gdata->frameCodec;
+    payload = gdata->frameBuffer;
+    length = gdata->frameLength;
+    if (codec == CODEC_LZ4) {
+        start = getTime();
+        n = lzCompress(gdata->frameBuffer, gdata->frameLength, gdata->compressBuffer,
+                gdata->frameLength - 1, gdata->lzTable);
+        recordLatency(&gdata->stats.latency[STAT_COMPRESS], start);
+        if (n > 0) {
+            payload = gdata->compressBuffer;
+            length = n;
+        } else {
+            codec = CODEC_NONE;
+        }
+    }
+    n = 0;
+    header[n++] = (unsigned char) codec;
+    n += putVarint(header + n, (unsigned long long) gdata->frameLength);
+    n += putVarint(header + n, (unsigned long long) length);
+    start = getTime();
+    if (!sendToSocket(header, n) || !sendToSocket(payload, length)) {
+        return JNI_FALSE;
+    }
+    gdata->frameLength = 0;
+    gdata->frameEvents = 0;
+    recordLatency(&gdata->stats.latency[STAT_SEND], start);
+    __sync_fetch_and_add(&gdata->stats.bytesOut, n + length);
+    return JNI_TRUE;
+}
+
+/**
+ * Drops a frame meant for a broken connection
+ */
+static void
+discardFrame() {
+    __sync_fetch_and_add(&gdata->discardedEvents, gdata->frameEvents);
+    gdata->frameLength = 0;
+    gdata->frameEvents = 0;
+}
+
+/**
+ * Writes a queued chunk to socket, or adds it to the frame on compressed
+ * connections, sender thread only
+ * @param chunk
+ * @return false if the connection broke
+ */
+static jboolean
+sendChunk(SendChunk *chunk) {
+    jlong start;
+
+    __sync_fetch_and_add(&gdata->stats.bytesEncoded, chunk->length);
+    if (gdata->framed) {
+        if (gdata->frameLength == 0) {
+            gdata->frameStart = getTime();
+        }
+        (void) memcpy(gdata->frameBuffer + gdata->frameLength, chunk->data, (size_t) chunk->length);
+        gdata->frameLength += chunk->length;
+        gdata->frameEvents += chunk->events;
+        return gdata->frameLength < gdata->frameSize || flushFrame();
+    }
+    start = getTime();
+    if (!sendToSocket(chunk->data, chunk->length)) {
+        return JNI_FALSE;
+    }
+    recordLatency(&gdata->stats.latency[STAT_SEND], start);
+    __sync_fetch_and_add(&gdata->stats.bytesOut, chunk->length);
+    return JNI_TRUE;
+}
+
+/**
+ * Decodes unsigned LEB128 varint
+ * @param p
+ * @param value
+ * @return number of bytes read
+ */
+static int
+getVarint(const unsigned char *p, unsigned long long *value) {
+    int shift;
+    int n;
+
+    *value = 0;
+    shift = 0;
+    n = 0;
+    do {
+        *value |= (unsigned long long) (p[n] & 0x7f) << shift;
+        shift += 7;
+    } while (p[n++] & 0x80);
+    return n;
+}
+
+/**
+ * Encodes a signed value so small magnitudes stay small varints
+ * @param value
+ * @return
+ */
+static unsigned long long
+zigzag(jlong value) {
+    return ((unsigned long long) value << 1) ^ (unsigned long long) (value >> 63);
+}
+
+/**
+ * Encodes length prefixed string, truncated to MAX_STRING_LENGTH
+ * @param p
+ * @param str
+ * @return number of bytes written
+ */
+static int
+putString(unsigned char *p, const char *str) {
+    size_t length;
+    int n;
+
+    length = str == NULL ? 0 : strlen(str);
+    if (length > MAX_STRING_LENGTH) {
+        length = MAX_STRING_LENGTH;
+    }
+    n = putVarint(p, length);
+    (void) memcpy(p + n, str, length);
+    return n + (int) length;
+}
+
+/**
+ * Encodes time as delta against the previously encoded one
+ * @param p
+ * @param time
+ * @return number of bytes written
+ */
+static int
+putTime(unsigned char *p, jlong time) {
+    jlong delta;
+
+    delta = time - gdata->lastTime;
+    gdata->lastTime = time;
+    return putVarint(p, zigzag(delta));
+}
+
+/**
+ * Writes a record prefixed with its length
+ * @param record
+ * @param length
+ */
+static void
+writeRecord(unsigned char *record, int length) {
+    unsigned char prefix[10];
+    writeOutput(prefix, putVarint(prefix, (unsigned long long) length));
+    writeOutput(record, length);
+}
+
+/**
+ * Writes the stream header which tells the server the stream is binary
+ */
+static void
+writeHeader() {
+    unsigned char header[4];
+    (void) memcpy(header, WIRE_MAGIC, 3);
+    header[3] = WIRE_VERSION;
+    writeOutput(header, (int) sizeof (header));
+}
+
+/**
+ * Orders line table entries by start location
+ * @param a
+ * @param b
+ * @return
+ */
+static int
+compareLineEntries(const void *a, const void *b) {
+    jlocation la = ((const jvmtiLineNumberEntry*) a)->start_location;
+    jlocation lb = ((const jvmtiLineNumberEntry*) b)->start_location;
+    return la < lb ? -1 : (la > lb ? 1 : 0);
+}
+
+/**
+ * Releases a cached method's JVMTI space
+ * @param jvmti
+ * @param minfo
+ */
+static void
+freeMethodInfo(jvmtiEnv *jvmti, MethodInfo *minfo) {
+    deallocate(jvmti, minfo->signature);
+    deallocate(jvmti, minfo->methodName);
+    deallocate(jvmti, minfo->fileName);
+    deallocate(jvmti, minfo->lineTable);
+    releaseMemory(minfo, sizeof (MethodInfo));
+}
+
+/**
+ * Drops every cached method, jmethodIDs of unloaded classes must not be
+ * resolved again
+ * @param jvmti
+ */
+static void
+flushMethodCache(jvmtiEnv *jvmti) {
+    MethodInfo *minfo;
+    MethodInfo *next;
+    int i;
+
+    for (i = 0; i < METHOD_BUCKET_COUNT; i++) {
+        for (minfo = gdata->methodBuckets[i]; minfo != NULL; minfo = next) {
+            next = minfo->hashNext;
+            freeMethodInfo(jvmti, minfo);
+        }
+        gdata->methodBuckets[i] = NULL;
+    }
+}
+
+/**
+ * Resolves method's symbol data, through the cache
+ * @param jvmti
+ * @param method
+ * @return NULL if the method can't be resolved
+ */
+static MethodInfo *
+getMethodInfo(jvmtiEnv *jvmti, jmethodID method) {
+    jvmtiError error;
+    MethodInfo *minfo;
+    jclass klass;
+    jboolean isNative;
+    char *methodsig;
+    int index;
+
+    if (gdata->methodCacheStale) {
+        gdata->methodCacheStale = JNI_FALSE;
+        flushMethodCache(jvmti);
+    }
+
+    index = (int) (((ptrdiff_t) (void*) method) >> 3) & METHOD_INDEX_MASK;
+    for (minfo = gdata->methodBuckets[index]; minfo != NULL; minfo = minfo->hashNext) {
+        if (minfo->method == method) {
+            return minfo;
+        }
+    }
+
+    minfo = (MethodInfo*) allocateMemory(sizeof (MethodInfo));
+    minfo->method = method;
+
+    error = (*jvmti)->GetMethodDeclaringClass(jvmti, method, &klass);
+    if (error != JVMTI_ERROR_NONE) {
+        // class got unloaded in the meantime
+        releaseMemory(minfo, sizeof (MethodInfo));
+        return NULL;
+    }
+
+    // get the class signature
+    error = (*jvmti)->GetClassSignature(jvmti, klass, &minfo->signature, NULL);
+    check_jvmti_error(jvmti, error, "cannot get class signature");
+    minfo->isTracker = strcmp(minfo->signature, "L" STRING(HEAP_TRACKER_class) ";") == 0;
+
+    // get the name and signature for the method
+    methodsig = NULL;
+    error = (*jvmti)->GetMethodName(jvmti, method, &minfo->methodName, &methodsig, NULL);
+    check_jvmti_error(jvmti, error, "cannot method name");
+    deallocate(jvmti, methodsig);
+
+    // Check to see if it's a native method, which means no lineNumber
+    isNative = JNI_FALSE;
+    error = (*jvmti)->IsMethodNative(jvmti, method, &isNative);
+    check_jvmti_error(jvmti, error, "Cannot get method native status");
+
+    // get source file name
+    error = (*jvmti)->GetSourceFileName(jvmti, klass, &minfo->fileName);
+    if (error != JVMTI_ERROR_NONE && error != JVMTI_ERROR_ABSENT_INFORMATION) {
+        check_jvmti_error(jvmti, error, "Cannot get source filename");
+    }
+
+    // Get method line table, sorted for binary search
+    if (!isNative) {
+        error = (*jvmti)->GetLineNumberTable(jvmti, method, &minfo->lineCount, &minfo->lineTable);
+        if (error == JVMTI_ERROR_NONE) {
+            qsort(minfo->lineTable, (size_t) minfo->lineCount,
+                    sizeof (jvmtiLineNumberEntry), &compareLineEntries);
+        } else if (error != JVMTI_ERROR_ABSENT_INFORMATION) {
+            check_jvmti_error(jvmti, error, "Cannot get method line table");
+        } else {
+            minfo->lineCount = 0;
+            minfo->lineTable = NULL;
+        }
+    }
+
+    minfo->hashNext = gdata->methodBuckets[index];
+    gdata->methodBuckets[index] = minfo;
+    return minfo;
+}
+
+/**
+ * Finds line number of a location, by binary search over the line table
+ * @param minfo
+ * @param location
+ * @return
+ */
+static int
+findLineNumber(MethodInfo *minfo, jlocation location) {
+    int low;
+    int high;
+    int mid;
+
+    if (minfo->lineCount <= 0) {
+        return 0;
+    }
+    // last entry starting at or before location
+    low = 0;
+    high = minfo->lineCount - 1;
+    while (low < high) {
+        mid = (low + high + 1) / 2;
+        if (minfo->lineTable[mid].start_location <= location) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return minfo->lineTable[low].line_number;
+}
+
+/**
+ * Converts FrameInfo into String
+ * @param jvmti
+ * @param buf
+ * @param buflen
+ * @param finfo
+ * @return number of bytes written
+ */
+static int
+frameToString(jvmtiEnv *jvmti, char *buf, int buflen, jvmtiFrameInfo *finfo) {
+    MethodInfo *minfo;
+
+    minfo = getMethodInfo(jvmti, finfo->method);
+
+    // TODO: i18n
+    return printText(buf, buflen, "%s.%s@%d[%s:%d]",
+            (minfo == NULL || minfo->signature == NULL ? "UnknownClass" : minfo->signature),
+            (minfo == NULL || minfo->methodName == NULL ? "UnknownMethod" : minfo->methodName),
+            (int) finfo->location,
+            (minfo == NULL || minfo->fileName == NULL ? "UnknownFile" : minfo->fileName),
+            (minfo == NULL ? 0 : findLineNumber(minfo, finfo->location)));
+}
+
+/**
+ * Constructs TraceInfo in place
+ * @param tinfo
+ * @param site
+ * @param id
+ * @param weight
+ * @param size
+ * @param thread
+ * @param klass
+ * @param length
+ */
+static void
+constructTraceInfo(TraceInfo *tinfo, TraceSite *site, jlong id, jint weight,
+        jlong size, jint thread, ClassInfo *klass, jint length) {
+    tinfo->site = site;
+    tinfo->klass = klass;
+    tinfo->id = id;
+    tinfo->weight = weight;
+    tinfo->size = size;
+    tinfo->length = length;
+    tinfo->thread = thread;
+    tinfo->allocationTime = getTime();
+    tinfo->deallocationTime = 0;
+    tinfo->allocationEpoch = gdata->gcEpoch;
+}
+
+/**
+ * Id a class is sent under
+ * @param cinfo
+ * @return 0 if the class is unknown
+ */
+static jlong
+classId(ClassInfo *cinfo) {
+    return cinfo == NULL ? 0 : cinfo->id;
+}
+
+/**
+ * Custom event handler for a batch of freed objects
+ * @param batch
+ */
+static void
+eventDeallocatation(FreeBatch *batch) {
+    unsigned char *record;
+    unsigned char prefix[10];
+    unsigned long long delta;
+    unsigned long long siteId;
+    unsigned long long size;
+    unsigned long long weight;
+    unsigned long long klass;
+    unsigned long long thread;
+    jlong id;
+    jlong allocationTime;
+    int offset;
+    int n;
+
+    gdata->outEvents += batch->weight;
+    if (gdata->format == FORMAT_BINARY) {
+        // packed ids are sent as they are
+        record = gdata->recordBuffer;
+        n = 0;
+        record[n++] = RECORD_FREE_BATCH;
+        n += putVarint(record + n, (unsigned long long) batch->epoch);
+        n += putTime(record + n, batch->time);
+        n += putVarint(record + n, (unsigned long long) batch->count);
+        writeOutput(prefix, putVarint(prefix, (unsigned long long) (n + batch->length)));
+        writeOutput(record, n);
+        writeOutput(batch->data, batch->length);
+        return;
+    }
+    id = 0;
+    allocationTime = 0;
+    for (offset = 0; offset < batch->length; ) {
+        offset += getVarint(batch->data + offset, &delta);
+        id += (jlong) (delta >> 1) ^ -(jlong) (delta & 1);
+        offset += getVarint(batch->data + offset, &siteId);
+        offset += getVarint(batch->data + offset, &size);
+        offset += getVarint(batch->data + offset, &delta);
+        allocationTime += (jlong) (delta >> 1) ^ -(jlong) (delta & 1);
+        offset += getVarint(batch->data + offset, &weight);
+        offset += getVarint(batch->data + offset, &klass);
+        offset += getVarint(batch->data + offset, &thread);
+        writeLine("d_%ld_%ld_%llu_%llu_%ld_%llu_%llu_%llu\n", id, batch->time,
+                siteId, size, allocationTime, weight, klass, thread);
+    }
+}
+
+/**
+ * Hashes a frame together with the hash of its caller's node
+ * @param parentHash
+ * @param finfo
+ * @return
+ */
+static jint
+hashFrame(jint parentHash, jvmtiFrameInfo *finfo) {
+    jint hashCode;
+
+    hashCode = (parentHash << 3) + (jint) (ptrdiff_t) (void*) (finfo->method);
+    hashCode = (hashCode << 2) + (jint) (finfo->location);
+    return hashCode;
+}
+
+/**
+ * Hashes frames of the trace
+ * @param trace
+ * @return
+ */
+static jint
+hashTrace(Trace *trace) {
+    jint hashCode;
+    int i;
+
+    hashCode = 0;
+    for (i = 0; i < trace->numberOfFrames; i++) {
+        hashCode = hashFrame(hashCode, trace->frames + i);
+    }
+    hashCode = (hashCode << 3) + trace->numberOfFrames;
+    hashCode += trace->flavor;
+    return hashCode;
+}
+
+/**
+ * Compares site's frames, following the trie up from its node, with a trace
+ * @param site
+ * @param trace
+ * @return
+ */
+static jboolean
+sameTrace(TraceSite *site, Trace *trace) {
+    FrameNode *node;
+    int i;
+
+    if (site->flavor != trace->flavor) {
+        return JNI_FALSE;
+    }
+    node = site->node;
+    for (i = 0; i < trace->numberOfFrames; i++, node = node->parent) {
+        if (node == NULL || node->frame.method != trace->frames[i].method
+                || node->frame.location != trace->frames[i].location) {
+            return JNI_FALSE;
+        }
+    }
+    return node == NULL;
+}
+
+/**
+ * Looks up the trie node of a frame called from parent, inserting it on
+ * first sight. Safe to call from any thread, like internTrace.
+ * @param parent NULL for a bottom frame
+ * @param finfo
+ * @return
+ */
+static FrameNode *
+internFrame(FrameNode *parent, jvmtiFrameInfo *finfo) {
+    FrameNode *node;
+    FrameNode *head;
+    FrameNode *newNode;
+    jint hashCode;
+    int index;
+
+    hashCode = hashFrame(parent == NULL ? 0 : parent->hashCode, finfo);
+    index = hashCode & FRAME_INDEX_MASK;
+    newNode = NULL;
+    for (;;) {
+        head = __atomic_load_n(&gdata->frameBuckets[index], __ATOMIC_ACQUIRE);
+        for (node = head; node != NULL; node = node->hashNext) {
+            if (node->parent == parent && node->frame.method == finfo->method
+                    && node->frame.location == finfo->location) {
+                if (newNode != NULL) {
+                    releaseMemory(newNode, sizeof (FrameNode));
+                }
+                return node;
+            }
+        }
+        if (newNode == NULL) {
+            newNode = (FrameNode*) allocateMemory(sizeof (FrameNode));
+            newNode->frame = *finfo;
+            newNode->parent = parent;
+            newNode->hashCode = hashCode;
+            // before publishing, children interned under it send it as parent
+            newNode->id = __sync_add_and_fetch(&gdata->frameCounter, 1);
+        }
+        newNode->hashNext = head;
+        if (__atomic_compare_exchange_n(&gdata->frameBuckets[index], &head, newNode,
+                JNI_FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+    return newNode;
+}
+
+/**
+ * Node of a site's top frame, HeapTracker's frames skipped, drainer only
+ * @param jvmti
+ * @param site
+ * @return NULL if no frame is left
+ */
+static FrameNode *
+siteNode(jvmtiEnv *jvmti, TraceSite *site) {
+    MethodInfo *minfo;
+    FrameNode *node;
+
+    for (node = site->node; node != NULL; node = node->parent) {
+        minfo = getMethodInfo(jvmti, node->frame.method);
+        if (minfo == NULL || !minfo->isTracker) {
+            break;
+        }
+    }
+    return node;
+}
+
+/**
+ * Custom event handler for a newly seen frame node: its id, its caller's id,
+ * 0 for none, and the frame's class, method, location, file and line
+ * @param jvmti
+ * @param node
+ */
+static void
+eventFrameDefinition(jvmtiEnv *jvmti, FrameNode *node) {
+    unsigned char *record;
+    MethodInfo *minfo;
+    jlong parentId;
+    char *line;
+    int n;
+
+    parentId = node->parent == NULL ? 0 : node->parent->id;
+    if (gdata->format == FORMAT_TEXT) {
+        line = (char*) gdata->recordBuffer;
+        n = printText(line, MAX_RECORD_LENGTH, "f_%ld_%ld_", node->id, parentId);
+        n += frameToString(jvmti, line + n, MAX_RECORD_LENGTH - 1 - n, &node->frame);
+        line[n++] = '\n';
+        writeOutput(line, n);
+        return;
+    }
+    minfo = getMethodInfo(jvmti, node->frame.method);
+    record = gdata->recordBuffer;
+    n = 0;
+    record[n++] = RECORD_FRAME;
+    n += putVarint(record + n, (unsigned long long) node->id);
+    n += putVarint(record + n, (unsigned long long) parentId);
+    n += putString(record + n, minfo == NULL ? "UnknownClass" : minfo->signature);
+    n += putString(record + n, minfo == NULL ? "UnknownMethod" : minfo->methodName);
+    n += putVarint(record + n, (unsigned long long) node->frame.location);
+    n += putString(record + n, minfo == NULL || minfo->fileName == NULL ? "UnknownFile" : minfo->fileName);
+    n += putVarint(record + n, (unsigned long long) (minfo == NULL ? 0 : findLineNumber(minfo, node->frame.location)));
+    writeRecord(record, n);
+}
+
+/**
+ * Sends definitions of a node and its callers unless they went out already,
+ * callers first. Drainer only.
+ * @param jvmti
+ * @param node
+ */
+static void
+announceFrames(jvmtiEnv *jvmti, FrameNode *node) {
+    FrameNode *pending[MAX_DEPTH + 2];
+    int count;
+
+    count = 0;
+    for (; node != NULL && !node->announced && count < MAX_DEPTH + 2; node = node->parent) {
+        pending[count++] = node;
+    }
+    while (count > 0) {
+        node = pending[--count];
+        node->announced = JNI_TRUE;
+        eventFrameDefinition(jvmti, node);
+    }
+}
+
+/**
+ * Custom event handler for a newly seen allocation site: its id and the id of
+ * its top frame's node, 0 for an empty trace
+ * @param site
+ */
+static void
+eventTraceDefinition(TraceSite *site) {
+    unsigned char *record;
+    FrameNode *node;
+    jlong nodeId;
+    jlong start;
+    int n;
+
+    start = getTime();
+    node = siteNode(gdata->jvmti, site);
+    announceFrames(gdata->jvmti, node);
+    nodeId = node == NULL ? 0 : node->id;
+    if (gdata->format == FORMAT_BINARY) {
+        record = gdata->recordBuffer;
+        n = 0;
+        record[n++] = RECORD_TRACE;
+        n += putVarint(record + n, (unsigned long long) site->id);
+        n += putVarint(record + n, (unsigned long long) nodeId);
+        writeRecord(record, n);
+    } else {
+        writeLine("t_%ld_%ld\n", site->id, nodeId);
+    }
+    recordLatency(&gdata->stats.latency[STAT_RESOLVE], start);
+}
+
+/**
+ * Looks up allocation site of the trace, interning it on first sight along
+ * with its frames. Safe to call from any thread, a site is published with a
+ * CAS on its bucket, complete with its id.
+ * @param trace
+ * @return
+ */
+static TraceSite *
+internTrace(Trace *trace) {
+    TraceSite *site;
+    TraceSite *head;
+    TraceSite *newSite;
+    FrameNode *node;
+    jint hashCode;
+    int index;
+    int i;
+
+    hashCode = hashTrace(trace);
+    index = hashCode & HASH_INDEX_MASK;
+    newSite = NULL;
+    for (;;) {
+        head = __atomic_load_n(&gdata->hashBuckets[index], __ATOMIC_ACQUIRE);
+        for (site = head; site != NULL; site = site->hashNext) {
+            if (site->hashCode == hashCode && sameTrace(site, trace)) {
+                // somebody else interned it first; drainer may be looking at
+                // ours through sitesById, so it is only taken out of there
+                if (newSite != NULL && newSite->id < MAX_SITES) {
+                    __atomic_store_n(&gdata->sitesById[newSite->id], NULL, __ATOMIC_RELEASE);
+                } else if (newSite != NULL) {
+                    releaseMemory(newSite, sizeof (TraceSite));
+                }
+                return site;
+            }
+        }
+        if (newSite == NULL) {
+            // bottom frame first, so callers are shared with other stacks
+            node = NULL;
+            for (i = trace->numberOfFrames - 1; i >= 0; i--) {
+                node = internFrame(node, trace->frames + i);
+            }
+            newSite = (TraceSite*) allocateMemory(sizeof (TraceSite));
+            newSite->node = node;
+            newSite->flavor = trace->flavor;
+            newSite->hashCode = hashCode;
+            // before publishing, whoever finds the site queues events with its
+            // id; an id lost to a site interned twice is harmless
+            newSite->id = __sync_add_and_fetch(&gdata->siteCounter, 1);
+            if (newSite->id < MAX_SITES) {
+                __atomic_store_n(&gdata->sitesById[newSite->id], newSite, __ATOMIC_RELEASE);
+            }
+        }
+        newSite->hashNext = head;
+        if (__atomic_compare_exchange_n(&gdata->hashBuckets[index], &head, newSite,
+                JNI_FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+    return newSite;
+}
+
+/**
+ * Sends site's definition unless it went out already, drainer only
+ * @param site
+ */
+static void
+announceSite(TraceSite *site) {
+    if (!site->announced) {
+        site->announced = JNI_TRUE;
+        eventTraceDefinition(site);
+    }
+}
+
+/**
+ * Sends class definition unless it went out already, drainer only
+ * @param cinfo
+ */
+static void
+announceClass(ClassInfo *cinfo) {
+    unsigned char *record;
+    int n;
+
+    if (cinfo == NULL || cinfo->announced) {
+        return;
+    }
+    cinfo->announced = JNI_TRUE;
+    if (gdata->format == FORMAT_BINARY) {
+        record = gdata->recordBuffer;
+        n = 0;
+        record[n++] = RECORD_CLASS;
+        n += putVarint(record + n, (unsigned long long) cinfo->id);
+        n += putString(record + n, cinfo->signature);
+        writeRecord(record, n);
+        return;
+    }
+    writeLine("k_%ld_%s\n", cinfo->id, cinfo->signature);
+}
+
+/**
+ * Writes a thread group name for the text format, where it sits between
+ * fields: % and _ are percent escaped
+ * @param buf
+ * @param buflen
+ * @param group
+ * @return number of characters written
+ */
+static int
+escapeGroup(char *buf, int buflen, const char *group) {
+    int n;
+
+    n = 0;
+    for (; *group != 0 && n < buflen - 3; group++) {
+        if (*group == '%' || *group == '_') {
+            n += snprintf(buf + n, (size_t) (buflen - n), "%%%02X", (unsigned char) *group);
+        } else {
+            buf[n++] = *group;
+        }
+    }
+    buf[n] = 0;
+    return n;
+}
+
+/**
+ * Sends the thread's id, name and group, drainer only
+ * @param id
+ * @param name NULL if unknown
+ * @param group NULL if unknown
+ */
+static void
+eventThreadDefinition(jint id, const char *name, const char *group) {
+    unsigned char *record;
+    char escaped[MAX_STRING_LENGTH * 3 + 1];
+    int n;
+
+    if (name == NULL) {
+        name = "";
+    }
+    if (group == NULL) {
+        group = "";
+    }
+    if (gdata->format == FORMAT_BINARY) {
+        record = gdata->recordBuffer;
+        n = 0;
+        record[n++] = RECORD_THREAD;
+        n += putVarint(record + n, (unsigned long long) id);
+        n += putString(record + n, name);
+        n += putString(record + n, group);
+        writeRecord(record, n);
+        return;
+    }
+    (void) escapeGroup(escaped, (int) sizeof (escaped), group);
+    // names may hold underscores
+    writeLine("r_%d_%s_%s\n", (int) id, escaped, name);
+}
+
+/**
+ * Sends identity of a ring's thread unless it went out already, drainer only
+ * @param ring
+ */
+static void
+announceThread(ThreadRing *ring) {
+    if (!ring->threadAnnounced) {
+        ring->threadAnnounced = JNI_TRUE;
+        eventThreadDefinition(ring->serial, ring->threadName, ring->threadGroup);
+    }
+}
+
+/**
+ * Custom event handler for allocation of object
+ * @param tinfo
+ */
+static void
+eventAllocation(TraceInfo *tinfo) {
+    TraceSite *site;
+    unsigned char *record;
+    int n;
+
+    site = tinfo->site;
+    // limit it to USER flavor for now
+    if (site->flavor != TRACE_USER) {
+        return;
+    }
+    announceSite(site);
+    announceClass(tinfo->klass);
+    gdata->outEvents += tinfo->weight;
+    if (gdata->format == FORMAT_BINARY) {
+        record = gdata->recordBuffer;
+        n = 0;
+        record[n++] = RECORD_CREATE;
+        n += putVarint(record + n, (unsigned long long) tinfo->id);
+        record[n++] = (unsigned char) site->flavor;
+        n += putTime(record + n, tinfo->allocationTime);
+        n += putVarint(record + n, (unsigned long long) site->id);
+        n += putVarint(record + n, (unsigned long long) tinfo->weight);
+        n += putVarint(record + n, (unsigned long long) tinfo->size);
+        // class 0 if unresolved; array length plus one, 0 for plain objects
+        n += putVarint(record + n, (unsigned long long) classId(tinfo->klass));
+        n += putVarint(record + n, (unsigned long long) (tinfo->length + 1));
+        n += putVarint(record + n, (unsigned long long) tinfo->thread);
+        writeRecord(record, n);
+        return;
+    }
+    writeLine("c_%ld_%s_%ld_%ld_%d_%ld_%ld_%d_%d\n", tinfo->id, flavorDesc[site->flavor],
+            tinfo->allocationTime, site->id, (int) tinfo->weight, tinfo->size,
+            classId(tinfo->klass), (int) tinfo->length, (int) tinfo->thread);
+}
+
+/**
+ * Sends per site counter deltas since the previous snapshot, drainer only
+ * @param jvmti
+ * @return number of sites reported
+ */
+static int
+eventSnapshot(jvmtiEnv *jvmti) {
+    TraceSite *site;
+    unsigned char *record;
+    jlong siteCount;
+    jlong allocated;
+    jlong freed;
+    jlong liveBytes;
+    jlong time;
+    jlong id;
+    int entries;
+    int count;
+    int n;
+
+    siteCount = __atomic_load_n(&gdata->siteCounter, __ATOMIC_ACQUIRE);
+    if (siteCount >= MAX_SITES) {
+        siteCount = MAX_SITES - 1;
+    }
+    // definitions first, they share the record buffer with the snapshot
+    for (id = 1; id <= siteCount; id++) {
+        site = __atomic_load_n(&gdata->sitesById[id], __ATOMIC_ACQUIRE);
+        if (site != NULL && site->allocated != site->reportedAllocated) {
+            announceSite(site);
+        }
+    }
+
+    time = getTime();
+    record = gdata->recordBuffer;
+    n = 0;
+    entries = 0;
+    count = 0;
+    for (id = 1; id <= siteCount; id++) {
+        site = __atomic_load_n(&gdata->sitesById[id], __ATOMIC_ACQUIRE);
+        if (site == NULL || !site->announced) {
+            continue;
+        }
+        allocated = __atomic_load_n(&site->allocated, __ATOMIC_RELAXED);
+        freed = __atomic_load_n(&site->freed, __ATOMIC_RELAXED);
+        liveBytes = __atomic_load_n(&site->liveBytes, __ATOMIC_RELAXED);
+        if (allocated == site->reportedAllocated && freed == site->reportedFreed
+                && liveBytes == site->reportedLiveBytes) {
+            continue;
+        }
+        if (gdata->format == FORMAT_TEXT) {
+            writeLine("s_%ld_%ld_%ld_%ld_%ld\n", time, site->id,
+                    allocated - site->reportedAllocated, freed - site->reportedFreed,
+                    liveBytes - site->reportedLiveBytes);
+        } else {
+            if (entries > 0 && n + 64 > MAX_RECORD_LENGTH) {
+                writeRecord(record, n);
+                n = 0;
+                entries = 0;
+            }
+            if (entries == 0) {
+                // entries run to the end of the record
+                record[n++] = RECORD_SNAPSHOT;
+                n += putTime(record + n, time);
+            }
+            n += putVarint(record + n, (unsigned long long) site->id);
+            n += putVarint(record + n, (unsigned long long) (allocated - site->reportedAllocated));
+            n += putVarint(record + n, (unsigned long long) (freed - site->reportedFreed));
+            n += putVarint(record + n, zigzag(liveBytes - site->reportedLiveBytes));
+            entries++;
+        }
+        site->reportedAllocated = allocated;
+        site->reportedFreed = freed;
+        site->reportedLiveBytes = liveBytes;
+        count++;
+    }
+    if (entries > 0) {
+        writeRecord(record, n);
+    }
+    return count;
+}
+
+/**
+ * Sends deltas of a ring's allocation counters since the previous report,
+ * drainer only
+ * @param ring
+ * @param time
+ * @return 1 if there was anything to report
+ */
+static int
+eventThreadSnapshot(ThreadRing *ring, jlong time) {
+    unsigned char *record;
+    jlong allocated;
+    jlong bytes;
+    int n;
+
+    allocated = __atomic_load_n(&ring->allocated, __ATOMIC_RELAXED);
+    bytes = __atomic_load_n(&ring->allocatedBytes, __ATOMIC_RELAXED);
+    if (allocated == ring->reportedAllocated) {
+        return 0;
+    }
+    announceThread(ring);
+    if (gdata->format == FORMAT_TEXT) {
+        writeLine("u_%ld_%d_%ld_%ld\n", time, (int) ring->serial,
+                allocated - ring->reportedAllocated, bytes - ring->reportedBytes);
+    } else {
+        record = gdata->recordBuffer;
+        n = 0;
+        record[n++] = RECORD_THREAD_SNAPSHOT;
+        n += putTime(record + n, time);
+        n += putVarint(record + n, (unsigned long long) ring->serial);
+        n += putVarint(record + n, (unsigned long long) (allocated - ring->reportedAllocated));
+        n += putVarint(record + n, (unsigned long long) (bytes - ring->reportedBytes));
+        writeRecord(record, n);
+    }
+    ring->reportedAllocated = allocated;
+    ring->reportedBytes = bytes;
+    return 1;
+}
+
+/**
+ * Sends per thread allocation deltas since the previous snapshot, drainer
+ * only
+ * @return number of threads reported
+ */
+static int
+eventThreadSnapshots() {
+    ThreadRing *ring;
+    jlong time;
+    int count;
+
+    // only drainer removes rings
+    ring = __atomic_load_n(&gdata->rings, __ATOMIC_ACQUIRE);
+    time = getTime();
+    count = 0;
+    for (; ring != NULL; ring = ring->next) {
+        count += eventThreadSnapshot(ring, time);
+    }
+    return count;
+}
+
+/**
+ * Moves histogram buckets counted since the last report into deltas,
+ * clearing them
+ * @param deltas
+ * @param buckets
+ * @param count
+ */
+static void
+takeHistogram(jlong *deltas, jlong *buckets, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        deltas[i] = __atomic_exchange_n(&buckets[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Encodes histogram buckets: number of non-empty buckets, then per bucket
+ * its index delta and count
+ * @param p
+ * @param buckets
+ * @param count
+ * @return number of bytes written
+ */
+static int
+putHistogram(unsigned char *p, const jlong *buckets, int count) {
+    int nonEmpty;
+    int last;
+    int i;
+    int n;
+
+    nonEmpty = 0;
+    for (i = 0; i < count; i++) {
+        if (buckets[i] != 0) {
+            nonEmpty++;
+        }
+    }
+    n = putVarint(p, (unsigned long long) nonEmpty);
+    last = 0;
+    for (i = 0; i < count; i++) {
+        if (buckets[i] != 0) {
+            n += putVarint(p + n, (unsigned long long) (i - last));
+            n += putVarint(p + n, (unsigned long long) buckets[i]);
+            last = i;
+        }
+    }
+    return n;
+}
+
+/**
+ * Formats histogram buckets as index:count,...
+ * @param buf
+ * @param buflen
+ * @param buckets
+ * @param count
+ * @return number of characters written
+ */
+static int
+printHistogram(char *buf, int buflen, const jlong *buckets, int count) {
+    int i;
+    int n;
+
+    n = 0;
+    for (i = 0; i < count && n < buflen; i++) {
+        if (buckets[i] != 0) {
+            n += snprintf(buf + n, (size_t) (buflen - n), "%s%d:%ld", n == 0 ? "" : ",", i, buckets[i]);
+        }
+    }
+    if (n == 0) {
+        n = snprintf(buf, (size_t) buflen, "-");
+    }
+    return n < buflen ? n : buflen - 1;
+}
+
+/**
+ * Sends lifetime histogram buckets counted since the previous report, per
+ * site whose objects got freed. Drainer only.
+ * @param jvmti
+ * @return number of sites reported
+ */
+static int
+eventLifetimes(jvmtiEnv *jvmti) {
+    jlong nanos[LIFETIME_BUCKETS];
+    jlong gcCycles[GC_CYCLE_BUCKETS];
+    TraceSite *site;
+    unsigned char *record;
+    jlong siteCount;
+    jlong time;
+    jlong id;
+    char *line;
+    int entries;
+    int count;
+    int n;
+
+    siteCount = __atomic_load_n(&gdata->siteCounter, __ATOMIC_ACQUIRE);
+    if (siteCount >= MAX_SITES) {
+        siteCount = MAX_SITES - 1;
+    }
+    // definitions first, they share the record buffer with the histograms
+    for (id = 1; id <= siteCount; id++) {
+        site = __atomic_load_n(&gdata->sitesById[id], __ATOMIC_ACQUIRE);
+        if (site != NULL && site->lifetimesDirty) {
+            announceSite(site);
+        }
+    }
+
+    time = getTime();
+    record = gdata->recordBuffer;
+    n = 0;
+    entries = 0;
+    count = 0;
+    for (id = 1; id <= siteCount; id++) {
+        site = __atomic_load_n(&gdata->sitesById[id], __ATOMIC_ACQUIRE);
+        if (site == NULL || !site->lifetimesDirty || !site->announced) {
+            continue;
+        }
+        // cleared before reading, a concurrent free sets it again
+        __atomic_store_n(&site->lifetimesDirty, JNI_FALSE, __ATOMIC_SEQ_CST);
+        takeHistogram(nanos, site->lifetimes, LIFETIME_BUCKETS);
+        takeHistogram(gcCycles, site->lifetimes + LIFETIME_BUCKETS, GC_CYCLE_BUCKETS);
+        if (gdata->format == FORMAT_TEXT) {
+            line = (char*) record;
+            n = snprintf(line, MAX_RECORD_LENGTH, "l_%ld_%ld_", time, site->id);
+            n += printHistogram(line + n, MAX_RECORD_LENGTH / 2 - n, nanos, LIFETIME_BUCKETS);
+            line[n++] = '_';
+            n += printHistogram(line + n, MAX_RECORD_LENGTH - 1 - n, gcCycles, GC_CYCLE_BUCKETS);
+            line[n++] = '\n';
+            writeOutput(line, n);
+            n = 0;
+        } else {
+            if (entries > 0 && n + LIFETIME_ENTRY_LENGTH > MAX_RECORD_LENGTH) {
+                writeRecord(record, n);
+                n = 0;
+                entries = 0;
+            }
+            if (entries == 0) {
+                // entries run to the end of the record
+                record[n++] = RECORD_LIFETIMES;
+                n += putTime(record + n, time);
+            }
+            n += putVarint(record + n, (unsigned long long) site->id);
+            n += putHistogram(record + n, nanos, LIFETIME_BUCKETS);
+            n += putHistogram(record + n, gcCycles, GC_CYCLE_BUCKETS);
+            entries++;
+        }
+        count++;
+    }
+    if (entries > 0) {
+        writeRecord(record, n);
+    }
+    return count;
+}
+
+/**
+ * Sends the cumulative counts of events which were dropped or degraded to
+ * counters, when they changed since the last report. Drainer only.
+ * @return 1 if a report was sent
+ */
+static int
+eventDrops() {
+    unsigned char *record;
+    jlong droppedCreates;
+    jlong droppedFrees;
+    jlong degradedCreates;
+    jlong degradedFrees;
+    jlong discarded;
+    jlong total;
+    jlong time;
+    int n;
+
+    droppedCreates = __atomic_load_n(&gdata->droppedCreates, __ATOMIC_RELAXED);
+    droppedFrees = __atomic_load_n(&gdata->droppedFrees, __ATOMIC_RELAXED);
+    degradedCreates = __atomic_load_n(&gdata->degradedCreates, __ATOMIC_RELAXED);
+    degradedFrees = __atomic_load_n(&gdata->degradedFrees, __ATOMIC_RELAXED);
+    discarded = __atomic_load_n(&gdata->discardedEvents, __ATOMIC_RELAXED);
+    total = droppedCreates + droppedFrees + degradedCreates + degradedFrees + discarded;
+    if (total == gdata->reportedDrops) {
+        return 0;
+    }
+    gdata->reportedDrops = total;
+    time = getTime();
+    if (gdata->format == FORMAT_TEXT) {
+        writeLine("x_%ld_%ld_%ld_%ld_%ld_%ld\n", time, droppedCreates, droppedFrees,
+                degradedCreates, degradedFrees, discarded);
+        return 1;
+    }
+    record = gdata->recordBuffer;
+    n = 0;
+    record[n++] = RECORD_DROPS;
+    n += putTime(record + n, time);
+    n += putVarint(record + n, (unsigned long long) droppedCreates);
+    n += putVarint(record + n, (unsigned long long) droppedFrees);
+    n += putVarint(record + n, (unsigned long long) degradedCreates);
+    n += putVarint(record + n, (unsigned long long) degradedFrees);
+    n += putVarint(record + n, (unsigned long long) discarded);
+    writeRecord(record, n);
+    return 1;
+}
+
+/**
+ * Returns the number of events lost so far, not counting the ones degraded
+ * to counters
+ * @return
+ */
+static jlong
+lostEvents() {
+    return __atomic_load_n(&gdata->droppedCreates, __ATOMIC_RELAXED)
+            + __atomic_load_n(&gdata->droppedFrees, __ATOMIC_RELAXED)
+            + __atomic_load_n(&gdata->discardedEvents, __ATOMIC_RELAXED);
+}
+
+/**
+ * Sends the agent's own cumulative overhead: event, byte and memory
+ * counters, then count, total and histogram of every operation's latency.
+ * Drainer only.
+ * @param jvmti
+ */
+static void
+eventStats(jvmtiEnv *jvmti) {
+    AgentStats stats;
+    jlong buckets[LATENCY_BUCKETS];
+    unsigned char *record;
+    jlong time;
+    char *line;
+    int op;
+    int i;
+    int n;
+
+    (void) memset(&stats, 0, sizeof (stats));
+    collectStats(jvmti, &stats);
+    time = getTime();
+    record = gdata->recordBuffer;
+    if (gdata->format == FORMAT_TEXT) {
+        line = (char*) record;
+        n = snprintf(line, MAX_RECORD_LENGTH, "a_%ld_%ld_%ld_%ld_%ld_%ld_%ld", time, stats.created,
+                stats.freed, stats.bytesOut, lostEvents(), stats.memory, stats.bytesEncoded);
+        for (op = 0; op <= STAT_LAST; op++) {
+            for (i = 0; i < LATENCY_BUCKETS; i++) {
+                buckets[i] = stats.latency[op].buckets[i];
+            }
+            n += snprintf(line + n, (size_t) (MAX_RECORD_LENGTH - n), "_%ld_%ld_",
+                    stats.latency[op].count, stats.latency[op].totalNanos);
+            n += printHistogram(line + n, MAX_RECORD_LENGTH - 1 - n, buckets, LATENCY_BUCKETS);
+        }
+        line[n++] = '\n';
+        writeOutput(line, n);
+        return;
+    }
+    n = 0;
+    record[n++] = RECORD_STATS;
+    n += putTime(record + n, time);
+    n += putVarint(record + n, (unsigned long long) stats.created);
+    n += putVarint(record + n, (unsigned long long) stats.freed);
+    n += putVarint(record + n, (unsigned long long) stats.bytesOut);
+    n += putVarint(record + n, (unsigned long long) lostEvents());
+    n += putVarint(record + n, (unsigned long long) stats.memory);
+    n += putVarint(record + n, (unsigned long long) stats.bytesEncoded);
+    n += putVarint(record + n, STAT_LAST + 1);
+    for (op = 0; op <= STAT_LAST; op++) {
+        for (i = 0; i < LATENCY_BUCKETS; i++) {
+            buckets[i] = stats.latency[op].buckets[i];
+        }
+        n += putVarint(record + n, (unsigned long long) stats.latency[op].count);
+        n += putVarint(record + n, (unsigned long long) stats.latency[op].totalNanos);
+        n += putHistogram(record + n, buckets, LATENCY_BUCKETS);
+    }
+    writeRecord(record, n);
+}
+
+/**
+ * Prints the agent's overhead to stdout
+ * @param jvmti
+ */
+static void
+printStats(jvmtiEnv *jvmti) {
+    AgentStats stats;
+    jlong buckets[LATENCY_BUCKETS];
+    LatencyStats *latency;
+    int op;
+    int i;
+
+    (void) memset(&stats, 0, sizeof (stats));
+    collectStats(jvmti, &stats);
+    printf("[agent] created %ld, freed %ld, wrote %ld bytes of %ld encoded, lost %ld events, holds %ld bytes\n",
+            stats.created, stats.freed, stats.bytesOut, stats.bytesEncoded, lostEvents(), stats.memory);
+    for (op = 0; op <= STAT_LAST; op++) {
+        latency = &stats.latency[op];
+        if (latency->count == 0) {
+            continue;
+        }
+        for (i = 0; i < LATENCY_BUCKETS; i++) {
+            buckets[i] = latency->buckets[i];
+        }
+        printf("[agent] %s: %ld times, %ld ns total, mean %ld ns, p50 %ld ns, p99 %ld ns\n",
+                statDesc[op], latency->count, latency->totalNanos, latency->totalNanos / latency->count,
+                histogramPercentile(buckets, LATENCY_BUCKETS, 50),
+                histogramPercentile(buckets, LATENCY_BUCKETS, 99));
+    }
+}
+
+/**
+ * Starts a new stream after sender reconnected or a shared memory reader
+ * attached: the server knows nothing of the previous connection, so
+ * definitions, snapshot baselines and the time base are reset. Drainer only.
+ */
+static void
+restartStream() {
+    TraceSite *site;
+    FrameNode *node;
+    ClassInfo *cinfo;
+    ThreadRing *ring;
+    int i;
+
+    // whatever is encoded so far was meant for the broken connection
+    __sync_fetch_and_add(&gdata->discardedEvents, gdata->outEvents);
+    gdata->outLength = 0;
+    gdata->outEvents = 0;
+    gdata->writeEpoch = currentEpoch();
+    gdata->lastTime = 0;
+    gdata->reportedDrops = 0;
+    for (i = 0; i < HASH_BUCKET_COUNT; i++) {
+        site = __atomic_load_n(&gdata->hashBuckets[i], __ATOMIC_ACQUIRE);
+        for (; site != NULL; site = site->hashNext) {
+            site->announced = JNI_FALSE;
+            site->reportedAllocated = 0;
+            site->reportedFreed = 0;
+            site->reportedLiveBytes = 0;
+        }
+    }
+    for (i = 0; i < FRAME_BUCKET_COUNT; i++) {
+        node = __atomic_load_n(&gdata->frameBuckets[i], __ATOMIC_ACQUIRE);
+        for (; node != NULL; node = node->hashNext) {
+            node->announced = JNI_FALSE;
+        }
+    }
+    cinfo = __atomic_load_n(&gdata->classes, __ATOMIC_ACQUIRE);
+    for (; cinfo != NULL; cinfo = cinfo->next) {
+        cinfo->announced = JNI_FALSE;
+    }
+    // only drainer removes rings
+    ring = __atomic_load_n(&gdata->rings, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next) {
+        ring->threadAnnounced = JNI_FALSE;
+        ring->reportedAllocated = 0;
+        ring->reportedBytes = 0;
+    }
+    if (gdata->output == OUTPUT_SHM && gdata->shm != NULL) {
+        // the reader skips whatever the previous one left unread
+        __atomic_store_n(&gdata->shm->streamStart,
+                __atomic_load_n(&gdata->shm->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+        __atomic_store_n(&gdata->shm->streamEpoch, gdata->writeEpoch, __ATOMIC_RELEASE);
+    }
+    gdata->captureNewStream = JNI_TRUE;
+    if (gdata->format == FORMAT_BINARY) {
+        writeHeader();
+    }
+}
+
+/**
+ * Resolves name and group of a thread. Line breaks are blanked out, they
+ * would end a line of the text format.
+ * @param jvmti
+ * @param env
+ * @param thread
+ * @param name set to a JVMTI allocated string, NULL if it can't be resolved
+ * @param group likewise
+ */
+static void
+resolveThreadIdentity(jvmtiEnv *jvmti, JNIEnv *env, jthread thread, char **name, char **group) {
+    jvmtiThreadInfo info;
+    jvmtiThreadGroupInfo groupInfo;
+    char *p;
+
+    *name = NULL;
+    *group = NULL;
+    (void) memset(&info, 0, sizeof (info));
+    if ((*jvmti)->GetThreadInfo(jvmti, thread, &info) != JVMTI_ERROR_NONE) {
+        return;
+    }
+    *name = info.name;
+    if (info.thread_group != NULL) {
+        (void) memset(&groupInfo, 0, sizeof (groupInfo));
+        if ((*jvmti)->GetThreadGroupInfo(jvmti, info.thread_group, &groupInfo) == JVMTI_ERROR_NONE) {
+            *group = groupInfo.name;
+            if (groupInfo.parent != NULL) {
+                (*env)->DeleteLocalRef(env, groupInfo.parent);
+            }
+        }
+        (*env)->DeleteLocalRef(env, info.thread_group);
+    }
+    if (info.context_class_loader != NULL) {
+        (*env)->DeleteLocalRef(env, info.context_class_loader);
+    }
+    for (p = *name; p != NULL && *p != 0; p++) {
+        if (*p == '\n' || *p == '\r') {
+            *p = ' ';
+        }
+    }
+    for (p = *group; p != NULL && *p != 0; p++) {
+        if (*p == '\n' || *p == '\r') {
+            *p = ' ';
+        }
+    }
+}
+
+/**
+ * Returns calling thread's ring, creating and registering it on first use.
+ * The thread's name and group are resolved then, once per thread.
+ * @param jvmti
+ * @param env
+ * @param thread the calling thread
+ * @return NULL if the current thread has no thread local storage (yet)
+ */
+static ThreadRing *
+getThreadRing(jvmtiEnv *jvmti, JNIEnv *env, jthread thread) {
+    jvmtiError error;
+    ThreadRing *ring;
+
+    ring = NULL;
+    error = (*jvmti)->GetThreadLocalStorage(jvmti, NULL, (void**) &ring);
+    if (error != JVMTI_ERROR_NONE) {
+        return NULL;
+    }
+    if (ring != NULL) {
+        return ring;
+    }
+
+    ring = (ThreadRing*) allocateMemory(sizeof (ThreadRing));
+    error = (*jvmti)->SetThreadLocalStorage(jvmti, NULL, (const void*) ring);
+    if (error != JVMTI_ERROR_NONE) {
+        releaseMemory(ring, sizeof (ThreadRing));
+        return NULL;
+    }
+    resolveThreadIdentity(jvmti, env, thread, &ring->threadName, &ring->threadGroup);
+    // registration happens once per thread, the only locked step
+    lock(jvmti);
+    {
+        ring->serial = ++gdata->threadCounter;
+        ring->next = gdata->rings;
+        gdata->rings = ring;
+    }
+    unlock(jvmti);
+    return ring;
+}
+
+/**
+ * Hands out next object id from ring's id block
+ * @param ring
+ * @return
+ */
+static jlong
+nextObjectId(ThreadRing *ring) {
+    if (ring->nextId == ring->lastId) {
+        ring->nextId = __sync_fetch_and_add(&gdata->counter, ID_BLOCK_SIZE) + 1;
+        ring->lastId = ring->nextId + ID_BLOCK_SIZE;
+    }
+    return ring->nextId++;
+}
+
+/**
+ * Returns the per object record a tag refers to
+ * @param ref slot reference, the object's tag
+ * @return NULL if there is no such slot
+ */
+static TraceInfo *
+slabRecord(jlong ref) {
+    TraceInfo *chunk;
+
+    if (ref <= 0 || ref > (jlong) SLAB_CHUNK_SIZE * SLAB_MAX_CHUNKS) {
+        return NULL;
+    }
+    chunk = __atomic_load_n(&gdata->slabChunks[(ref - 1) / SLAB_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    return &chunk[(ref - 1) & (SLAB_CHUNK_SIZE - 1)];
+}
+
+/**
+ * Takes a slot off the slab's free list, or carves a fresh one. Lock-free,
+ * the free list head carries a version so a concurrently recycled slot
+ * can't be popped twice.
+ * @return slot reference, 0 if the slab is exhausted
+ */
+static jlong
+allocateSlot() {
+    unsigned long long head;
+    unsigned long long next;
+    TraceInfo *chunk;
+    TraceInfo *newChunk;
+    jlong ref;
+    int index;
+
+    head = __atomic_load_n(&gdata->slabFreeHead, __ATOMIC_ACQUIRE);
+    while ((head & SLAB_REF_MASK) != 0) {
+        next = slabRecord((jlong) (head & SLAB_REF_MASK))->nextFree;
+        if (__atomic_compare_exchange_n(&gdata->slabFreeHead, &head,
+                (((head >> 32) + 1) << 32) | next,
+                JNI_FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return (jlong) (head & SLAB_REF_MASK);
+        }
+    }
+
+    ref = __sync_add_and_fetch(&gdata->slabTop, 1);
+    if (ref > (jlong) SLAB_CHUNK_SIZE * SLAB_MAX_CHUNKS) {
+        return 0;
+    }
+    index = (int) ((ref - 1) / SLAB_CHUNK_SIZE);
+    if (__atomic_load_n(&gdata->slabChunks[index], __ATOMIC_ACQUIRE) == NULL) {
+        newChunk = (TraceInfo*) allocateMemory(SLAB_CHUNK_SIZE * sizeof (TraceInfo));
+        chunk = NULL;
+        if (!__atomic_compare_exchange_n(&gdata->slabChunks[index], &chunk, newChunk,
+                JNI_FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            // another thread carved the first slot of the same chunk
+            releaseMemory(newChunk, SLAB_CHUNK_SIZE * sizeof (TraceInfo));
+        }
+    }
+    return ref;
+}
+
+/**
+ * Puts a slot back onto the slab's free list
+ * @param ref
+ */
+static void
+releaseSlot(jlong ref) {
+    TraceInfo *tinfo;
+    unsigned long long head;
+
+    tinfo = slabRecord(ref);
+    head = __atomic_load_n(&gdata->slabFreeHead, __ATOMIC_ACQUIRE);
+    do {
+        tinfo->nextFree = (unsigned int) (head & SLAB_REF_MASK);
+    } while (!__atomic_compare_exchange_n(&gdata->slabFreeHead, &head,
+            (((head >> 32) + 1) << 32) | (unsigned long long) ref,
+            JNI_FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Heap iteration callback, collects the ids of tracked objects
+ * @param class_tag
+ * @param size
+ * @param tag_ptr
+ * @param length
+ * @param user_data the LiveIds
+ * @return
+ */
+static jint JNICALL
+collectLiveId(jlong class_tag, jlong size, jlong* tag_ptr, jint length, void* user_data) {
+    LiveIds *live;
+    TraceInfo *tinfo;
+    jlong *ids;
+
+    live = (LiveIds*) user_data;
+    // class objects carry negative tags, degraded allocations have no id
+    tinfo = slabRecord(*tag_ptr);
+    if (tinfo == NULL || tinfo->id == 0) {
+        return 0;
+    }
+    if (live->count == live->capacity) {
+        ids = (jlong*) allocateMemory((size_t) live->capacity * 2 * sizeof (jlong));
+        (void) memcpy(ids, live->ids, (size_t) live->count * sizeof (jlong));
+        releaseMemory(live->ids, (size_t) live->capacity * sizeof (jlong));
+        live->ids = ids;
+        live->capacity *= 2;
+    }
+    live->ids[live->count++] = tinfo->id;
+    return 0;
+}
+
+/**
+ * Heap iteration callback, stops tracking an object: clears its tag and
+ * releases its slot, it will get no free event. It leaves its site's
+ * counters like a free, for the next snapshot to take off the server, in
+ * events mode too.
+ * @param class_tag
+ * @param size
+ * @param tag_ptr
+ * @param length
+ * @param user_data counts the objects
+ * @return
+ */
+static jint JNICALL
+untagObject(jlong class_tag, jlong size, jlong* tag_ptr, jint length, void* user_data) {
+    TraceInfo *tinfo;
+    TraceSite *site;
+
+    // class objects keep their negative tags
+    tinfo = slabRecord(*tag_ptr);
+    if (tinfo == NULL) {
+        return 0;
+    }
+    site = tinfo->site;
+    if (site->id < MAX_SITES) {
+        __sync_fetch_and_add(&site->freed, tinfo->weight);
+        __sync_fetch_and_sub(&site->liveBytes, tinfo->size * tinfo->weight);
+    } else {
+        // only events mode tracks sites snapshots can't report
+        __sync_fetch_and_add(&gdata->droppedFrees, tinfo->weight);
+    }
+    releaseSlot(*tag_ptr);
+    *tag_ptr = 0;
+    (*(jlong*) user_data)++;
+    return 0;
+}
+
+/**
+ * Orders ids for qsort
+ * @param a
+ * @param b
+ * @return
+ */
+static int
+compareIds(const void *a, const void *b) {
+    jlong x;
+    jlong y;
+
+    x = *(const jlong*) a;
+    y = *(const jlong*) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Starts a heap snapshot record, or a text line in the record buffer
+ * @param time
+ * @param sequence
+ * @param count
+ * @param last set to where the last part flag goes
+ * @return number of bytes written
+ */
+static int
+beginHeapSnapshot(jlong time, jlong sequence, jlong count, int *last) {
+    unsigned char *record;
+    int n;
+
+    record = gdata->recordBuffer;
+    if (gdata->format == FORMAT_TEXT) {
+        n = printText((char*) record, MAX_RECORD_LENGTH, "h_%ld_%ld_%ld_", time, sequence, count);
+        *last = n;
+        record[n++] = '0';
+        record[n++] = '_';
+        return n;
+    }
+    n = 0;
+    record[n++] = RECORD_HEAP_SNAPSHOT;
+    n += putVarint(record + n, (unsigned long long) sequence);
+    n += putTime(record + n, time);
+    n += putVarint(record + n, (unsigned long long) count);
+    *last = n;
+    record[n++] = 0;
+    return n;
+}
+
+/**
+ * Ends a heap snapshot record or line and writes it out
+ * @param n record length
+ * @param last where the last part flag is
+ * @param isLast
+ */
+static void
+endHeapSnapshot(int n, int last, jboolean isLast) {
+    unsigned char *record;
+
+    record = gdata->recordBuffer;
+    if (gdata->format == FORMAT_TEXT) {
+        if (record[n - 1] == '_') {
+            record[n++] = '-';
+        }
+        record[last] = isLast ? '1' : '0';
+        record[n++] = '\n';
+        writeOutput(record, n);
+        return;
+    }
+    record[last] = isLast ? 1 : 0;
+    writeRecord(record, n);
+}
+
+/**
+ * Walks the heap and sends the ids of all tracked objects still alive, as
+ * sorted runs of consecutive ids: per run the gap since the end of the
+ * previous one and its length. Ids come in per thread blocks, so objects
+ * allocated together and still alive collapse into few runs. Snapshots too
+ * large for a record are split into parts, the last one flagged. Drainer
+ * only, right after draining, so creates of all but the newest ids went
+ * out before.
+ * @param jvmti
+ * @return 1 if a snapshot was sent
+ */
+static int
+eventHeapSnapshot(jvmtiEnv *jvmti) {
+    jvmtiHeapCallbacks callbacks;
+    jvmtiError error;
+    LiveIds live;
+    unsigned char *record;
+    jlong sequence;
+    jlong previousEnd;
+    jlong start;
+    jlong time;
+    jlong i;
+    jlong j;
+    int last;
+    int n;
+
+    if (gdata->mode == MODE_AGGREGATE) {
+        printf("[agent] heap snapshots need mode=events\n");
+        return 0;
+    }
+    start = getTime();
+    live.count = 0;
+    live.capacity = __atomic_load_n(&gdata->slabTop, __ATOMIC_ACQUIRE) + 1024;
+    live.ids = (jlong*) allocateMemory((size_t) live.capacity * sizeof (jlong));
+    (void) memset(&callbacks, 0, sizeof (callbacks));
+    callbacks.heap_iteration_callback = &collectLiveId;
+    time = getTime();
+    error = (*jvmti)->IterateThroughHeap(jvmti, JVMTI_HEAP_FILTER_UNTAGGED, NULL, &callbacks, &live);
+    if (error != JVMTI_ERROR_NONE) {
+        printf("[agent] heap snapshot failed: %d\n", error);
+        releaseMemory(live.ids, (size_t) live.capacity * sizeof (jlong));
+        return 0;
+    }
+    qsort(live.ids, (size_t) live.count, sizeof (jlong), &compareIds);
+
+    record = gdata->recordBuffer;
+    sequence = ++gdata->heapSnapshotCounter;
+    n = beginHeapSnapshot(time, sequence, live.count, &last);
+    previousEnd = 0;
+    for (i = 0; i < live.count; i = j) {
+        for (j = i + 1; j < live.count && live.ids[j] == live.ids[j - 1] + 1; j++) {
+        }
+        if (n + ID_RANGE_LENGTH > MAX_RECORD_LENGTH - 2) {
+            endHeapSnapshot(n, last, JNI_FALSE);
+            n = beginHeapSnapshot(time, sequence, live.count, &last);
+            previousEnd = 0;
+        }
+        if (gdata->format == FORMAT_TEXT) {
+            n += printText((char*) record + n, MAX_RECORD_LENGTH - n, "%s%ld:%ld",
+                    previousEnd == 0 ? "" : ",", live.ids[i], j - i);
+        } else {
+            n += putVarint(record + n, (unsigned long long) (live.ids[i] - previousEnd));
+            n += putVarint(record + n, (unsigned long long) (j - i));
+        }
+        previousEnd = live.ids[j - 1] + 1;
+    }
+    endHeapSnapshot(n, last, JNI_TRUE);
+    releaseMemory(live.ids, (size_t) live.capacity * sizeof (jlong));
+    recordLatency(&gdata->stats.latency[STAT_HEAP_SNAPSHOT], start);
+    printf("[agent] heap snapshot %ld: %ld live objects\n", sequence, live.count);
+    return 1;
+}
+
+/**
+ * Asks drainer for a heap snapshot, safe in a signal handler
+ */
+static void
+requestHeapSnapshot() {
+    gdata->heapSnapshotRequested = JNI_TRUE;
+}
+
+/**
+ * Handler of snapshotSignal
+ * @param signal
+ */
+static void
+onSnapshotSignal(int signal) {
+    requestHeapSnapshot();
+}
+
+/**
+ * Installs the handler of snapshotSignal, if there is one
+ */
+static void
+installSnapshotSignal() {
+    struct sigaction action;
+
+    if (gdata->snapshotSignal <= 0) {
+        return;
+    }
+    (void) memset(&action, 0, sizeof (action));
+    action.sa_handler = &onSnapshotSignal;
+    action.sa_flags = SA_RESTART;
+    (void) sigemptyset(&action.sa_mask);
+    if (sigaction(gdata->snapshotSignal, &action, NULL) != 0) {
+        printf("[agent] cannot handle signal %d: %s\n", gdata->snapshotSignal, strerror(errno));
+    }
+}
+
+/**
+ * Wakes up drainer, only used on slow paths
+ * @param jvmti
+ */
+static void
+wakeDrainer(jvmtiEnv *jvmti) {
+    jvmtiError error;
+    error = (*jvmti)->RawMonitorEnter(jvmti, gdata->drainLock);
+    check_jvmti_error(jvmti, error, "error getting drain lock");
+    error = (*jvmti)->RawMonitorNotify(jvmti, gdata->drainLock);
+    check_jvmti_error(jvmti, error, "error notifying drainer");
+    error = (*jvmti)->RawMonitorExit(jvmti, gdata->drainLock);
+    check_jvmti_error(jvmti, error, "error releasing drain lock");
+}
+
+/**
+ * Handles an allocation the ring has no room for, without waiting: drops it,
+ * or with backpressure=aggregate counts it on its site
+ * @param ring
+ * @param site
+ * @param weight
+ * @param size
+ * @param klass
+ * @param length
+ * @return tag for the object, 0 if it was dropped
+ */
+static jlong
+skipAllocation(ThreadRing *ring, TraceSite *site, jint weight, jlong size,
+        ClassInfo *klass, jint length) {
+    jlong ref;
+
+    if (gdata->backpressure != BACKPRESSURE_AGGREGATE || site->id >= MAX_SITES
+            || (ref = allocateSlot()) == 0) {
+        __sync_fetch_and_add(&gdata->droppedCreates, weight);
+        return 0;
+    }
+    // id 0 tells ObjectFree to count the free on the site as well
+    constructTraceInfo(slabRecord(ref), site, 0, weight, size, ring->serial, klass, length);
+    __sync_fetch_and_add(&site->allocated, weight);
+    __sync_fetch_and_add(&site->liveBytes, size * weight);
+    __sync_fetch_and_add(&gdata->degradedCreates, weight);
+    return ref;
+}
+
+/**
+ * Process the trace: fills the object's slab record, then in aggregate mode
+ * bumps the site's counters, otherwise publishes a copy of the record into
+ * calling thread's ring.
+ * @param jvmti
+ * @param ring
+ * @param trace
+ * @param flavor
+ * @param weight
+ * @param size
+ * @param klass
+ * @param length
+ * @return tag for the object, 0 if it could not be recorded
+ */
+static jlong
+processTrace(jvmtiEnv *jvmti, ThreadRing *ring, Trace *trace, TraceFlavor flavor,
+        jint weight, jlong size, ClassInfo *klass, jint length) {
+    TraceSite *site;
+    TraceInfo *tinfo;
+    jlong start;
+    jlong head;
+    jlong ref;
+
+    trace->flavor = flavor;
+    site = internTrace(trace);
+    if (gdata->mode == MODE_AGGREGATE) {
+        if (site->id >= MAX_SITES || (ref = allocateSlot()) == 0) {
+            return 0;
+        }
+        constructTraceInfo(slabRecord(ref), site, 0, weight, size, ring->serial, klass, length);
+        __sync_fetch_and_add(&site->allocated, weight);
+        __sync_fetch_and_add(&site->liveBytes, size * weight);
+        return ref;
+    }
+
+    head = ring->head;
+    // ring is full, let drainer catch up
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= RING_SIZE) {
+        if (gdata->backpressure != BACKPRESSURE_BLOCK) {
+            return skipAllocation(ring, site, weight, size, klass, length);
+        }
+        start = getTime();
+        while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= RING_SIZE) {
+            if (gdata->drainerDone) {
+                return 0;
+            }
+            wakeDrainer(jvmti);
+            sched_yield();
+        }
+        recordLatency(&ring->stats.latency[STAT_BACKPRESSURE], start);
+    }
+    ref = allocateSlot();
+    if (ref == 0) {
+        return 0;
+    }
+    tinfo = slabRecord(ref);
+    constructTraceInfo(tinfo, site, nextObjectId(ring), weight, size, ring->serial,
+            klass, length);
+    // the slot may be recycled before drainer gets to it, hence the copy
+    ring->events[head & (RING_SIZE - 1)] = *tinfo;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return ref;
+}
+
+/**
+ * Gets the stack trace and records the allocation
+ * @param jvmti
+ * @param ring
+ * @param thread
+ * @param flavor
+ * @param weight
+ * @param size
+ * @param klass
+ * @param length
+ * @return tag for the object, 0 if allocation wasn't recorded
+ */
+static jlong
+getTraceInfo(jvmtiEnv *jvmti, ThreadRing *ring, jthread thread, TraceFlavor flavor,
+        jint weight, jlong size, ClassInfo *klass, jint length) {
+    jvmtiError error;
+    jlong start;
+    jlong id;
+
+    id = 0;
+    if (thread != NULL) {
+        Trace trace;
+
+        // Before VM_INIT thread could be NULL, watch out
+        trace.numberOfFrames = 0;
+        start = getTime();
+        error = (*jvmti)->GetStackTrace(jvmti, thread, 0, gdata->depth + 2,
+                trace.frames, &(trace.numberOfFrames));
+        recordLatency(&ring->stats.latency[STAT_STACK_TRACE], start);
+        // If we get a PHASE error, the VM isn't ready, or it died, and the
+        // allocation goes untracked
+        if (error != JVMTI_ERROR_WRONG_PHASE) {
+            check_jvmti_error(jvmti, error, "Cannot get stack trace");
+            id = processTrace(jvmti, ring, &trace, flavor, weight, size, klass, length);
+        }
+    }
+    // If thread==NULL, it's assumed this is before VM_START, untracked too
+    return id;
+}
+
+/**
+ * Tags object with the reference of its slab record
+ * @param jvmti
+ * @param object
+ * @param id
+ */
+static void
+tagObjectWithId(jvmtiEnv *jvmti, jobject object, jlong id) {
+    jvmtiError error;
+    error = (*jvmti)->SetTag(jvmti, object, id);
+    check_jvmti_error(jvmti, error, "Cannot tag object");
+}
+
+/**
+ * Draws next geometrically distributed byte interval, mean is sampleInterval
+ * @param ring
+ * @return
+ */
+static jlong
+nextSampleInterval(ThreadRing *ring) {
+    unsigned long long x;
+    double u;
+
+    if (ring->random == 0) {
+        ring->random = ((unsigned long long) (ptrdiff_t) (void*) ring) ^ (unsigned long long) time(NULL);
+        ring->random |= 1;
+    }
+    // xorshift64
+    x = ring->random;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    ring->random = x;
+
+    // uniform in (0, 1]
+    u = ((double) (x >> 11) + 1.0) / 9007199254740992.0;
+    return (jlong) (-log(u) * (double) gdata->sampleInterval) + 1;
+}
+
+/**
+ * Weight of a byte sampled object: inverse of the probability that an
+ * object of that size gets sampled
+ * @param size
+ * @return
+ */
+static jint
+byteSampleWeight(jlong size) {
+    double probability;
+
+    if (size <= 0) {
+        return 1;
+    }
+    probability = 1.0 - exp(-(double) size / (double) gdata->sampleInterval);
+    if (probability <= 0.0) {
+        return (jint) gdata->sampleInterval;
+    }
+    return (jint) (1.0 / probability + 0.5);
+}
+
+/**
+ * Number of allocations a tracked object of that size stands for
+ * @param size
+ * @return
+ */
+static jint
+sampleWeight(jlong size) {
+    switch (gdata->sampleMode) {
+        case SAMPLE_EVERY:
+            return (jint) gdata->sampleInterval;
+        case SAMPLE_BYTES:
+        case SAMPLE_JVMTI:
+            return byteSampleWeight(size);
+        default:
+            return 1;
+    }
+}
+
+/**
+ * Decides whether an allocation gets tracked
+ * @param ring
+ * @param size object size, known in byte sampling modes
+ * @return sampling weight, 0 if the allocation is skipped
+ */
+static jint
+sampleAllocation(ThreadRing *ring, jlong size) {
+    switch (gdata->sampleMode) {
+        case SAMPLE_EVERY:
+            if (--ring->sampleCountdown > 0) {
+                return 0;
+            }
+            ring->sampleCountdown = gdata->sampleInterval;
+            return sampleWeight(size);
+        case SAMPLE_BYTES:
+            if (ring->bytesUntilSample == 0) {
+                ring->bytesUntilSample = nextSampleInterval(ring);
+            }
+            ring->bytesUntilSample -= size;
+            if (ring->bytesUntilSample > 0) {
+                return 0;
+            }
+            ring->bytesUntilSample = nextSampleInterval(ring);
+            return sampleWeight(size);
+        default:
+            // nothing to decide, or the VM already sampled it
+            return sampleWeight(size);
+    }
+}
+
+/**
+ * Adds colon separated class patterns to a pattern trie. A pattern is a
+ * class name, or a package or class name prefix ending in *; java.util.*
+ * covers java.util and its subpackages. Once there is an include pattern,
+ * classes no pattern matches are excluded.
+ * @param root trie to add to, created on first use
+ * @param patterns
+ * @param verdict
+ */
+static void
+addClassFilter(FilterNode **root, const char *patterns, FilterVerdict verdict) {
+    FilterNode *node;
+    FilterNode *child;
+    char name[MAX_STRING_LENGTH];
+    const char *end;
+    int length;
+    int i;
+
+    if (*root == NULL) {
+        *root = (FilterNode*) allocateMemory(sizeof (FilterNode));
+        (*root)->verdict = FILTER_INCLUDE;
+    }
+    if (verdict == FILTER_INCLUDE) {
+        (*root)->verdict = FILTER_EXCLUDE;
+    }
+    for (; *patterns != 0; patterns = *end == 0 ? end : end + 1) {
+        end = strchr(patterns, ':');
+        if (end == NULL) {
+            end = patterns + strlen(patterns);
+        }
+        if (end == patterns || end - patterns >= MAX_STRING_LENGTH - 1) {
+            continue;
+        }
+        // java.util.Map -> java/util/Map; and java.util.* -> java/util/
+        length = 0;
+        for (i = 0; patterns + i < end; i++) {
+            name[length++] = patterns[i] == '.' ? '/' : patterns[i];
+        }
+        if (name[length - 1] == '*') {
+            length--;
+        } else {
+            name[length++] = ';';
+        }
+
+        node = *root;
+        for (i = 0; i < length; i++) {
+            for (child = node->child; child != NULL && child->c != name[i]; child = child->sibling) {
+            }
+            if (child == NULL) {
+                child = (FilterNode*) allocateMemory(sizeof (FilterNode));
+                child->c = name[i];
+                child->sibling = node->child;
+                node->child = child;
+            }
+            node = child;
+        }
+        node->verdict = verdict;
+    }
+}
+
+/**
+ * Matches an internal class name against a pattern trie, the longest
+ * matching pattern wins. Doesn't lock or allocate.
+ * @param root
+ * @param name e.g. java/util/Map
+ * @param length number of characters of name to match
+ * @return whether the class is included
+ */
+static jboolean
+matchClassFilter(FilterNode *root, const char *name, size_t length) {
+    FilterNode *node;
+    FilterVerdict verdict;
+    size_t i;
+    char c;
+
+    verdict = root->verdict;
+    node = root;
+    for (i = 0; i <= length; i++) {
+        // exact patterns end in ;
+        c = i < length ? name[i] : ';';
+        for (node = node->child; node != NULL && node->c != c; node = node->sibling) {
+        }
+        if (node == NULL) {
+            break;
+        }
+        if (node->verdict != FILTER_NONE) {
+            verdict = node->verdict;
+        }
+    }
+    return verdict == FILTER_INCLUDE;
+}
+
+/**
+ * Matches a class signature against include= and exclude=. Arrays are
+ * matched by their element class, primitive arrays by no pattern.
+ * @param signature
+ * @return whether allocations of the class get tracked
+ */
+static jboolean
+classTracked(const char *signature) {
+    size_t length;
+
+    if (gdata->classFilter == NULL) {
+        return JNI_TRUE;
+    }
+    while (*signature == '[') {
+        signature++;
+    }
+    length = strlen(signature);
+    if (signature[0] != 'L' || length < 2) {
+        return gdata->classFilter->verdict == FILTER_INCLUDE;
+    }
+    // Ljava/util/Map; -> java/util/Map
+    return matchClassFilter(gdata->classFilter, signature + 1, length - 2);
+}
+
+/**
+ * Returns the class of an object, resolving its signature on first sight.
+ * The fast path is one tag lookup on the class object, lock-free.
+ * @param jvmti
+ * @param env
+ * @param object
+ * @param klass object's class, or NULL to look it up
+ * @return NULL if the class could not be resolved
+ */
+static ClassInfo *
+getClassInfo(jvmtiEnv *jvmti, JNIEnv *env, jobject object, jclass klass) {
+    jvmtiError error;
+    ClassInfo *cinfo;
+    jboolean localRef;
+    jlong tag;
+
+    localRef = klass == NULL;
+    if (localRef) {
+        klass = (*env)->GetObjectClass(env, object);
+        if (klass == NULL) {
+            return NULL;
+        }
+    }
+    cinfo = NULL;
+    error = (*jvmti)->GetTag(jvmti, klass, &tag);
+    if (error == JVMTI_ERROR_NONE && tag < 0) {
+        cinfo = (ClassInfo*) (ptrdiff_t) -tag;
+    } else if (error == JVMTI_ERROR_NONE) {
+        lock(jvmti);
+        {
+            // somebody may have resolved it while we waited
+            error = (*jvmti)->GetTag(jvmti, klass, &tag);
+            if (error == JVMTI_ERROR_NONE && tag < 0) {
+                cinfo = (ClassInfo*) (ptrdiff_t) -tag;
+            } else {
+                cinfo = (ClassInfo*) allocateMemory(sizeof (ClassInfo));
+                error = (*jvmti)->GetClassSignature(jvmti, klass, &cinfo->signature, NULL);
+                if (error != JVMTI_ERROR_NONE) {
+                    releaseMemory(cinfo, sizeof (ClassInfo));
+                    cinfo = NULL;
+                } else {
+                    cinfo->id = ++gdata->classCounter;
+                    cinfo->isArray = cinfo->signature[0] == '[';
+                    cinfo->tracked = classTracked(cinfo->signature);
+                    cinfo->next = gdata->classes;
+                    __atomic_store_n(&gdata->classes, cinfo, __ATOMIC_RELEASE);
+                    error = (*jvmti)->SetTag(jvmti, klass, -(jlong) (ptrdiff_t) cinfo);
+                    check_jvmti_error(jvmti, error, "Cannot tag class");
+                }
+            }
+        }
+        unlock(jvmti);
+    }
+    if (localRef) {
+        (*env)->DeleteLocalRef(env, klass);
+    }
+    return cinfo;
+}
+
+/**
+ * Tracks an allocation of the ring's thread while tracking is engaged
+ * @param jvmti
+ * @param env
+ * @param ring
+ * @param thread
+ * @param object
+ * @param klass
+ * @param flavor
+ * @param size
+ */
+static void
+trackRingAllocation(jvmtiEnv *jvmti, JNIEnv *env, ThreadRing *ring, jthread thread, jobject object,
+        jclass klass, TraceFlavor flavor, jlong size) {
+    jvmtiError error;
+    ClassInfo *cinfo;
+    jint length;
+    jint weight;
+    jlong tag;
+
+    cinfo = NULL;
+    if (gdata->classFilter != NULL) {
+        // filtered out allocations cost the class lookup and nothing else
+        cinfo = getClassInfo(jvmti, env, object, klass);
+        if (cinfo == NULL ? gdata->classFilter->verdict != FILTER_INCLUDE : !cinfo->tracked) {
+            return;
+        }
+    }
+    if (size < 0) {
+        error = (*jvmti)->GetObjectSize(jvmti, object, &size);
+        check_jvmti_error(jvmti, error, "Cannot get object size");
+    }
+    weight = sampleAllocation(ring, size);
+    if (weight == 0) {
+        return;
+    }
+    if (cinfo == NULL) {
+        // without filters only sampled allocations pay for the class lookup
+        cinfo = getClassInfo(jvmti, env, object, klass);
+    }
+    length = -1;
+    if (cinfo != NULL && cinfo->isArray) {
+        length = (*env)->GetArrayLength(env, (jarray) object);
+    }
+    tag = getTraceInfo(jvmti, ring, thread, flavor, weight, size, cinfo, length);
+    if (tag != 0) {
+        tagObjectWithId(jvmti, object, tag);
+        __sync_fetch_and_add(&ring->stats.created, 1);
+        // only this thread writes them
+        __atomic_store_n(&ring->allocated, ring->allocated + weight, __ATOMIC_RELAXED);
+        __atomic_store_n(&ring->allocatedBytes, ring->allocatedBytes + size * weight, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Samples, records and tags an allocation
+ * @param jvmti
+ * @param env
+ * @param thread
+ * @param object
+ * @param klass object's class, or NULL if the caller doesn't have it
+ * @param flavor
+ * @param size object size or -1 if unknown
+ */
+static void
+trackAllocation(jvmtiEnv *jvmti, JNIEnv *env, jthread thread, jobject object, jclass klass,
+        TraceFlavor flavor, jlong size) {
+    ThreadRing *ring;
+
+    // instrumented code that passed HeapTracker.engaged just before disengage
+    if (!gdata->engaged) {
+        return;
+    }
+    ring = getThreadRing(jvmti, env, thread);
+    if (ring == NULL) {
+        return;
+    }
+    // announced before looking at engaged again, disengage looks at them the
+    // other way round, so either this sees it or disengage waits for it
+    __atomic_store_n(&ring->tracking, ring->tracking + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&gdata->engaged, __ATOMIC_SEQ_CST)) {
+        trackRingAllocation(jvmti, env, ring, thread, object, klass, flavor, size);
+    }
+    __atomic_store_n(&ring->tracking, ring->tracking - 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Java Native Method for Object.<init>
+ * @param env
+ * @param klass
+ * @param thread
+ * @param o
+ */
+static void JNICALL
+HEAP_TRACKER_native_newobj(JNIEnv *env, jclass klass, jthread thread, jobject o) {
+    if (gdata->vmDead) {
+        return;
+    }
+    trackAllocation(gdata->jvmti, env, thread, o, NULL, TRACE_USER, -1);
+}
+
+/**
+ * Java Native Method for newarray
+ * @param env
+ * @param klass
+ * @param thread
+ * @param a
+ */
+static void JNICALL
+HEAP_TRACKER_native_newarr(JNIEnv *env, jclass klass, jthread thread, jobject a) {
+    if (gdata->vmDead) {
+        return;
+    }
+    trackAllocation(gdata->jvmti, env, thread, a, NULL, TRACE_USER, -1);
+}
+
+/**
+ * Drains published events of a ring
+ * @param ring
+ * @return number of events drained
+ */
+static int
+drainRing(ThreadRing *ring) {
+    jlong head;
+    jlong tail;
+    int count;
+
+    count = 0;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (ring->tail < head) {
+        announceThread(ring);
+    }
+    for (tail = ring->tail; tail < head; tail++) {
+        eventAllocation(&ring->events[tail & (RING_SIZE - 1)]);
+        count++;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    return count;
+}
+
+/**
+ * Seals the open free batch, caller holds freeLock
+ */
+static void
+sealFreeBatch() {
+    FreeBatch *batch;
+
+    batch = &gdata->freeBatches[gdata->freeSealed % FREE_BATCH_COUNT];
+    batch->epoch = gdata->gcEpoch;
+    batch->time = getTime();
+    __atomic_store_n(&gdata->freeSealed, gdata->freeSealed + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Doubles the capacity of a free batch, up to FREE_OVERFLOW_LIMIT
+ * @param batch
+ * @return JNI_FALSE if it can't grow
+ */
+static jboolean
+growFreeBatch(FreeBatch *batch) {
+    unsigned char *data;
+    int capacity;
+
+    capacity = batch->capacity > 0 ? batch->capacity * 2 : FREE_BATCH_SIZE;
+    if (capacity > FREE_OVERFLOW_LIMIT) {
+        return JNI_FALSE;
+    }
+    data = (unsigned char*) realloc(batch->data, (size_t) capacity);
+    if (data == NULL) {
+        return JNI_FALSE;
+    }
+    __sync_fetch_and_add(&gdata->stats.memory, (jlong) (capacity - batch->capacity));
+    batch->data = data;
+    batch->capacity = capacity;
+    return JNI_TRUE;
+}
+
+/**
+ * Returns the open batch, holding the overflow first if there is any: the
+ * batch was just emptied by drainer and the overflow has the older frees.
+ * Caller holds freeLock and made sure not all batches are sealed.
+ * @return
+ */
+static FreeBatch *
+currentFreeBatch() {
+    FreeBatch *batch;
+    FreeBatch swap;
+
+    batch = &gdata->freeBatches[gdata->freeSealed % FREE_BATCH_COUNT];
+    if (gdata->freeOverflow.count > 0) {
+        swap = *batch;
+        *batch = gdata->freeOverflow;
+        gdata->freeOverflow = swap;
+    }
+    return batch;
+}
+
+/**
+ * Returns the batch ObjectFree appends to, with room for one more free.
+ * ObjectFree runs inside the GC and must never wait for drainer, which may
+ * itself be waiting for the GC to end in a JVMTI call. So when all batches
+ * are sealed, backpressure=block appends to the overflow batch, the other
+ * policies count the free instead. Caller holds freeLock.
+ * @return NULL if there is no room
+ */
+static FreeBatch *
+openFreeBatch() {
+    FreeBatch *batch;
+
+    if (gdata->freeSealed - __atomic_load_n(&gdata->freeSent, __ATOMIC_ACQUIRE) >= FREE_BATCH_COUNT) {
+        if (gdata->backpressure != BACKPRESSURE_BLOCK) {
+            return NULL;
+        }
+        batch = &gdata->freeOverflow;
+        if (batch->length + FREE_ENTRY_LENGTH > batch->capacity && !growFreeBatch(batch)) {
+            return NULL;
+        }
+        return batch;
+    }
+    batch = currentFreeBatch();
+    if (batch->length + FREE_ENTRY_LENGTH > batch->capacity) {
+        // batch is full, hand it over early
+        sealFreeBatch();
+        return openFreeBatch();
+    }
+    return batch;
+}
+
+/**
+ * Seals the open batch if it holds any frees, overflow included, without
+ * waiting. Caller holds freeLock.
+ */
+static void
+sealPendingFrees() {
+    if (gdata->freeSealed - __atomic_load_n(&gdata->freeSent, __ATOMIC_ACQUIRE) < FREE_BATCH_COUNT
+            && currentFreeBatch()->count > 0) {
+        sealFreeBatch();
+    }
+}
+
+/**
+ * Sends free batches sealed before the given sequence
+ * @param sealed
+ * @return number of freed objects sent
+ */
+static int
+drainFrees(jlong sealed) {
+    FreeBatch *batch;
+    jlong sent;
+    int count;
+
+    count = 0;
+    for (sent = gdata->freeSent; sent < sealed; sent++) {
+        batch = &gdata->freeBatches[sent % FREE_BATCH_COUNT];
+        eventDeallocatation(batch);
+        count += batch->count;
+        if (batch->capacity > FREE_BATCH_SIZE) {
+            // it held an overflow, give the memory back
+            releaseMemory(batch->data, (size_t) batch->capacity);
+            batch->data = (unsigned char*) allocateMemory(FREE_BATCH_SIZE);
+            batch->capacity = FREE_BATCH_SIZE;
+        }
+        batch->length = 0;
+        batch->count = 0;
+        batch->lastId = 0;
+        batch->lastTime = 0;
+        batch->weight = 0;
+        __atomic_store_n(&gdata->freeSent, sent + 1, __ATOMIC_RELEASE);
+    }
+    return count;
+}
+
+/**
+ * Last words of dead threads once their rings are empty: their totals, and
+ * the name they ended with if it changed. Drainer only.
+ * @return number of events sent
+ */
+static int
+finishThreads() {
+    ThreadRing *ring;
+    int count;
+
+    count = 0;
+    // only drainer removes rings
+    ring = __atomic_load_n(&gdata->rings, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next) {
+        if (ring->finished || !__atomic_load_n(&ring->retired, __ATOMIC_ACQUIRE)
+                || ring->tail != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        if (gdata->mode == MODE_AGGREGATE || gdata->backpressure == BACKPRESSURE_AGGREGATE) {
+            count += eventThreadSnapshot(ring, getTime());
+        }
+        if (ring->threadAnnounced && ring->endName != NULL
+                && (ring->threadName == NULL || strcmp(ring->endName, ring->threadName) != 0)) {
+            eventThreadDefinition(ring->serial, ring->endName, ring->endGroup);
+        }
+        ring->finished = JNI_TRUE;
+    }
+    return count;
+}
+
+/**
+ * Drains every ring once. Frees are bounded by the batches sealed before the
+ * thread rings are drained, so a free never overtakes its own allocation.
+ * @param jvmti
+ * @return number of events drained
+ */
+static int
+drainAll(jvmtiEnv *jvmti) {
+    ThreadRing *ring;
+    ThreadRing *prev;
+    ThreadRing *next;
+    jlong freeSealed;
+    int count;
+
+    count = 0;
+    if (currentEpoch() != gdata->writeEpoch) {
+        restartStream();
+    }
+    // VMs which report frees outside of GC leave batches open
+    if (!gdata->gcActive) {
+        (*jvmti)->RawMonitorEnter(jvmti, gdata->freeLock);
+        if (!gdata->gcActive) {
+            sealPendingFrees();
+        }
+        (*jvmti)->RawMonitorExit(jvmti, gdata->freeLock);
+    }
+    freeSealed = __atomic_load_n(&gdata->freeSealed, __ATOMIC_ACQUIRE);
+    lock(jvmti);
+    ring = gdata->rings;
+    unlock(jvmti);
+    // new rings are only ever pushed in front, so this snapshot stays valid
+    for (; ring != NULL; ring = ring->next) {
+        count += drainRing(ring);
+    }
+    count += drainFrees(freeSealed);
+    if (gdata->output == OUTPUT_SHM) {
+        readShmCommands();
+    }
+    if (gdata->heapSnapshotRequested) {
+        gdata->heapSnapshotRequested = JNI_FALSE;
+        count += eventHeapSnapshot(jvmti);
+    }
+    if (getTime() - gdata->lastSnapshotTime >= gdata->snapshotInterval * NANOS_PER_MILLI) {
+        gdata->lastSnapshotTime = getTime();
+        // degraded events are only visible through snapshots
+        if (gdata->mode == MODE_AGGREGATE || gdata->backpressure == BACKPRESSURE_AGGREGATE) {
+            count += eventSnapshot(jvmti);
+            count += eventThreadSnapshots();
+        }
+        count += eventLifetimes(jvmti);
+        count += eventDrops();
+        eventStats(jvmti);
+    }
+    count += finishThreads();
+    if (gdata->outLength > 0) {
+        flushOutput();
+    }
+    // a drain pass ends on a record boundary
+    if (gdata->output == OUTPUT_FILE) {
+        commitSpool();
+    }
+    if (gdata->capture != NULL) {
+        (void) fflush(gdata->capture);
+    }
+
+    // release rings of dead threads once they are finished
+    lock(jvmti);
+    {
+        prev = NULL;
+        for (ring = gdata->rings; ring != NULL; ring = next) {
+            next = ring->next;
+            if (ring->finished) {
+                if (prev == NULL) {
+                    gdata->rings = next;
+                } else {
+                    prev->next = next;
+                }
+                addStats(&gdata->stats, &ring->stats);
+                deallocate(gdata->jvmti, ring->threadName);
+                deallocate(gdata->jvmti, ring->threadGroup);
+                deallocate(gdata->jvmti, ring->endName);
+                deallocate(gdata->jvmti, ring->endGroup);
+                releaseMemory(ring, sizeof (ThreadRing));
+            } else {
+                prev = ring;
+            }
+        }
+    }
+    unlock(jvmti);
+    return count;
+}
+
+/**
+ * Sets HeapTracker.engaged, without which instrumented code doesn't call
+ * into the agent at all
+ * @param env
+ * @param engaged
+ */
+static void
+setTrackerEngaged(JNIEnv *env, jint engaged) {
+    jclass klass;
+    jfieldID field;
+
+    klass = (*env)->FindClass(env, STRING(HEAP_TRACKER_class));
+    if (klass == NULL) {
+        fatal_error("ERROR: JNI: Cannot find %s with FindClass\n",
+                STRING(HEAP_TRACKER_class));
+    }
+    field = (*env)->GetStaticFieldID(env, klass, STRING(HEAP_TRACKER_engaged), "I");
+    if (field == NULL) {
+        fatal_error("ERROR: JNI: Cannot get field from %s\n",
+                STRING(HEAP_TRACKER_class));
+    }
+    (*env)->SetStaticIntField(env, klass, field, engaged);
+}
+
+/**
+ * Turns the events reporting frees and GC cycles on or off
+ * @param jvmti
+ * @param mode
+ */
+static void
+setFreeEvents(jvmtiEnv *jvmti, jvmtiEventMode mode) {
+    jvmtiError error;
+
+    error = (*jvmti)->SetEventNotificationMode(jvmti, mode, JVMTI_EVENT_OBJECT_FREE, (jthread) NULL);
+    check_jvmti_error(jvmti, error, "Cannot set event notification");
+    error = (*jvmti)->SetEventNotificationMode(jvmti, mode,
+            JVMTI_EVENT_GARBAGE_COLLECTION_START, (jthread) NULL);
+    check_jvmti_error(jvmti, error, "Cannot set event notification");
+    error = (*jvmti)->SetEventNotificationMode(jvmti, mode,
+            JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, (jthread) NULL);
+    check_jvmti_error(jvmti, error, "Cannot set event notification");
+}
+
+/**
+ * Turns the event reporting allocations the VM makes, or samples, on or off
+ * @param jvmti
+ * @param mode
+ */
+static void
+setAllocationEvents(jvmtiEnv *jvmti, jvmtiEventMode mode) {
+    jvmtiError error;
+
+#ifdef HAVE_JVMTI_SAMPLED_ALLOC
+    if (gdata->sampleMode == SAMPLE_JVMTI) {
+        // sampled events cover VM internal allocations as well
+        error = (*jvmti)->SetEventNotificationMode(jvmti, mode,
+                JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, (jthread) NULL);
+        check_jvmti_error(jvmti, error, "Cannot set event notification");
+        return;
+    }
+#endif
+    error = (*jvmti)->SetEventNotificationMode(jvmti, mode,
+            JVMTI_EVENT_VM_OBJECT_ALLOC, (jthread) NULL);
+    check_jvmti_error(jvmti, error, "Cannot set event notification");
+}
+
+/**
+ * Turns tracking back on. Drainer only.
+ * @param jvmti
+ * @param env
+ */
+static void
+engageTracking(jvmtiEnv *jvmti, JNIEnv *env) {
+    // frees first, so no tracked object misses its free
+    setFreeEvents(jvmti, JVMTI_ENABLE);
+    setAllocationEvents(jvmti, JVMTI_ENABLE);
+    gdata->engaged = JNI_TRUE;
+    setTrackerEngaged(env, 1);
+    printf("[agent] engaged\n");
+}
+
+/**
+ * Waits for allocations that saw tracking engaged to be tagged. Their
+ * threads may be waiting for room in their rings, so rings keep being
+ * drained meanwhile. Drainer only.
+ * @param jvmti
+ */
+static void
+awaitAllocations(jvmtiEnv *jvmti) {
+    ThreadRing *ring;
+    jboolean busy;
+
+    do {
+        busy = JNI_FALSE;
+        // only drainer removes rings
+        ring = __atomic_load_n(&gdata->rings, __ATOMIC_SEQ_CST);
+        for (; ring != NULL && !busy; ring = ring->next) {
+            busy = __atomic_load_n(&ring->tracking, __ATOMIC_SEQ_CST) > 0;
+        }
+        if (busy && drainAll(jvmti) == 0) {
+            sched_yield();
+        }
+    } while (busy);
+}
+
+/**
+ * Turns tracking off until engaged again. The live tracked objects go out
+ * as a heap snapshot, then their tags are cleared, so that ObjectFree can
+ * go off along with the allocation events and a disengaged agent costs
+ * the VM nothing. A site snapshot takes them off the server's live counts.
+ * Drainer only.
  * @param jvmti
- * @param object
- * @param tinfo
+ * @param env
  */
 static void
-tagObjectWithId(jvmtiEnv *jvmti, jobject object, TraceInfo *tinfo) {
+disengageTracking(jvmtiEnv *jvmti, JNIEnv *env) {
+    jvmtiHeapCallbacks callbacks;
     jvmtiError error;
-    jlong tag;
-    tag = (jlong) (ptrdiff_t) (void*) tinfo;
-    error = (*jvmti)->SetTag(jvmti, object, tinfo->id);
-    check_jvmti_error(jvmti, error, "Cannot tag object");
+    jlong untagged;
+
+    setTrackerEngaged(env, 0);
+    __atomic_store_n(&gdata->engaged, JNI_FALSE, __ATOMIC_SEQ_CST);
+    setAllocationEvents(jvmti, JVMTI_DISABLE);
+    // an object tagged after the heap walk would never be freed
+    awaitAllocations(jvmti);
+    // creates of objects about to be untagged still refer to their slots
+    while (drainAll(jvmti) > 0) {
+    }
+    if (gdata->mode == MODE_EVENTS) {
+        (void) eventHeapSnapshot(jvmti);
+    }
+    untagged = 0;
+    (void) memset(&callbacks, 0, sizeof (callbacks));
+    callbacks.heap_iteration_callback = &untagObject;
+    error = (*jvmti)->IterateThroughHeap(jvmti, JVMTI_HEAP_FILTER_UNTAGGED, NULL, &callbacks, &untagged);
+    // events mode sends no periodic snapshots unless backpressure=aggregate
+    (void) eventSnapshot(jvmti);
+    if (error != JVMTI_ERROR_NONE) {
+        // tagged objects are left, their frees have to keep coming
+        printf("[agent] cannot untag objects: %d\n", error);
+        return;
+    }
+    setFreeEvents(jvmti, JVMTI_DISABLE);
+    printf("[agent] disengaged, stopped tracking %ld objects\n", untagged);
 }
 
 /**
- * Java Native Method for Object.<init>
+ * Asks drainer to turn tracking on or off, the latest request wins
+ * @param on
+ */
+static void
+requestEngage(jboolean on) {
+    gdata->engageRequest = on ? ENGAGE_ON : ENGAGE_OFF;
+}
+
+/**
+ * Applies the latest engage or disengage request, if any. Drainer only.
+ * @param jvmti
  * @param env
- * @param klass
- * @param thread
- * @param o
+ */
+static void
+applyEngageRequest(jvmtiEnv *jvmti, JNIEnv *env) {
+    EngageRequest request;
+
+    request = __atomic_exchange_n(&gdata->engageRequest, ENGAGE_NONE, __ATOMIC_ACQ_REL);
+    if (request == ENGAGE_ON && !gdata->engaged) {
+        engageTracking(jvmti, env);
+    } else if (request == ENGAGE_OFF && gdata->engaged) {
+        disengageTracking(jvmti, env);
+    }
+}
+
+/**
+ * Reads the control file once it changed, it holds engage or disengage.
+ * Drainer only.
+ */
+static void
+pollControlFile() {
+    struct stat status;
+    char command[32];
+    ssize_t n;
+    int fd;
+
+    if (gdata->controlPath == NULL
+            || getTime() - gdata->lastControlTime < CONTROL_POLL_MILLIS * NANOS_PER_MILLI) {
+        return;
+    }
+    gdata->lastControlTime = getTime();
+    if (stat(gdata->controlPath, &status) != 0
+            || (status.st_mtim.tv_sec == gdata->controlModified.tv_sec
+            && status.st_mtim.tv_nsec == gdata->controlModified.tv_nsec)) {
+        return;
+    }
+    gdata->controlModified = status.st_mtim;
+    fd = open(gdata->controlPath, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    n = read(fd, command, sizeof (command) - 1);
+    (void) close(fd);
+    if (n <= 0) {
+        return;
+    }
+    command[n] = 0;
+    command[strcspn(command, " \t\r\n")] = 0;
+    if (strcmp(command, "engage") == 0) {
+        requestEngage(JNI_TRUE);
+    } else if (strcmp(command, "disengage") == 0) {
+        requestEngage(JNI_FALSE);
+    } else {
+        printf("[agent] unknown control: %s\n", command);
+    }
+}
+
+/**
+ * Agent thread which drains all rings and writes them to socket
+ * @param jvmti
+ * @param env
+ * @param arg
  */
 static void JNICALL
-HEAP_TRACKER_native_newobj(JNIEnv *env, jclass klass, jthread thread, jobject o) {
-    TraceInfo *tinfo;
+drainerThread(jvmtiEnv *jvmti, JNIEnv *env, void *arg) {
+    jvmtiError error;
 
-    if (gdata->vmDead) {
+    while (!gdata->drainerStop) {
+        pollControlFile();
+        if (gdata->engageRequest != ENGAGE_NONE) {
+            applyEngageRequest(jvmti, env);
+        }
+        if (drainAll(jvmti) == 0) {
+            error = (*jvmti)->RawMonitorEnter(jvmti, gdata->drainLock);
+            check_jvmti_error(jvmti, error, "error getting drain lock");
+            if (!gdata->drainerStop) {
+                error = (*jvmti)->RawMonitorWait(jvmti, gdata->drainLock, DRAIN_INTERVAL_MILLIS);
+                check_jvmti_error(jvmti, error, "error waiting on drain lock");
+            }
+            error = (*jvmti)->RawMonitorExit(jvmti, gdata->drainLock);
+            check_jvmti_error(jvmti, error, "error releasing drain lock");
+        }
+    }
+    // whatever is left over
+    gdata->lastSnapshotTime = 0;
+    while (drainAll(jvmti) > 0) {
+    }
+
+    error = (*jvmti)->RawMonitorEnter(jvmti, gdata->drainLock);
+    check_jvmti_error(jvmti, error, "error getting drain lock");
+    gdata->drainerDone = JNI_TRUE;
+    error = (*jvmti)->RawMonitorNotifyAll(jvmti, gdata->drainLock);
+    check_jvmti_error(jvmti, error, "error notifying drain lock");
+    error = (*jvmti)->RawMonitorExit(jvmti, gdata->drainLock);
+    check_jvmti_error(jvmti, error, "error releasing drain lock");
+}
+
+/**
+ * Creates java.lang.Thread object for an agent thread
+ * @param env
+ * @return
+ */
+static jthread
+newAgentThread(JNIEnv *env) {
+    jclass klass;
+    jmethodID constructor;
+    jthread thread;
+
+    klass = (*env)->FindClass(env, "java/lang/Thread");
+    if (klass == NULL) {
+        fatal_error("ERROR: JNI: Cannot find java/lang/Thread with FindClass\n");
+    }
+    constructor = (*env)->GetMethodID(env, klass, "<init>", "()V");
+    if (constructor == NULL) {
+        fatal_error("ERROR: JNI: Cannot find Thread constructor\n");
+    }
+    thread = (*env)->NewObject(env, klass, constructor);
+    if (thread == NULL) {
+        fatal_error("ERROR: JNI: Cannot create agent thread\n");
+    }
+    return thread;
+}
+
+/**
+ * Starts the drainer as JVMTI agent thread
+ * @param jvmti
+ * @param env
+ */
+static void
+startDrainer(jvmtiEnv *jvmti, JNIEnv *env) {
+    jvmtiError error;
+
+    error = (*jvmti)->RunAgentThread(jvmti, newAgentThread(env), &drainerThread, NULL,
+            JVMTI_THREAD_MAX_PRIORITY);
+    check_jvmti_error(jvmti, error, "Cannot start drainer thread");
+    gdata->drainerStarted = JNI_TRUE;
+}
+
+/**
+ * Stops the drainer after it has drained everything
+ * @param jvmti
+ */
+static void
+stopDrainer(jvmtiEnv *jvmti) {
+    jvmtiError error;
+
+    if (!gdata->drainerStarted) {
         return;
     }
-    tinfo = getTraceInfo(gdata->jvmti, thread, TRACE_USER);
-    if (tinfo != NULL) {
-        tagObjectWithId(gdata->jvmti, o, tinfo);
-        (void) free((TraceInfo*) tinfo);
+    error = (*jvmti)->RawMonitorEnter(jvmti, gdata->drainLock);
+    check_jvmti_error(jvmti, error, "error getting drain lock");
+    gdata->drainerStop = JNI_TRUE;
+    (*jvmti)->RawMonitorNotifyAll(jvmti, gdata->drainLock);
+    while (!gdata->drainerDone) {
+        error = (*jvmti)->RawMonitorWait(jvmti, gdata->drainLock, 0);
+        check_jvmti_error(jvmti, error, "error waiting for drainer");
     }
+    error = (*jvmti)->RawMonitorExit(jvmti, gdata->drainLock);
+    check_jvmti_error(jvmti, error, "error releasing drain lock");
 }
 
 /**
- * Java Native Method for newarray
+ * Waits on sendLock unless sender is being stopped
+ * @param jvmti
+ * @param millis
+ */
+static void
+waitSender(jvmtiEnv *jvmti, jlong millis) {
+    (*jvmti)->RawMonitorEnter(jvmti, gdata->sendLock);
+    if (!gdata->senderStop) {
+        (*jvmti)->RawMonitorWait(jvmti, gdata->sendLock, millis);
+    }
+    (*jvmti)->RawMonitorExit(jvmti, gdata->sendLock);
+}
+
+/**
+ * Runs a newline terminated command from the server
+ * @param command
+ */
+static void
+runCommand(const char *command) {
+    if (strcmp(command, "snapshot") == 0) {
+        requestHeapSnapshot();
+    } else if (strcmp(command, "engage") == 0) {
+        requestEngage(JNI_TRUE);
+    } else if (strcmp(command, "disengage") == 0) {
+        requestEngage(JNI_FALSE);
+    } else if (strncmp(command, "codec ", 6) == 0) {
+        // answer to the compression offer
+        gdata->frameCodec = strcmp(command + 6, "lz4") == 0 ? CODEC_LZ4 : CODEC_NONE;
+        gdata->codecAnswered = JNI_TRUE;
+    } else if (command[0] != 0) {
+        printf("[agent] unknown command: %s\n", command);
+    }
+}
+
+/**
+ * Reads and runs whatever commands the server sent, without waiting.
+ * Sender thread only.
+ * @return false if the server closed the connection
+ */
+static jboolean
+readCommands() {
+    char *buffer;
+    char *end;
+    ssize_t received;
+    int offset;
+
+    buffer = gdata->commandBuffer;
+    for (;;) {
+        received = recv(gdata->socket_desc, buffer + gdata->commandLength,
+                (size_t) (COMMAND_BUFFER_SIZE - 1 - gdata->commandLength), MSG_DONTWAIT);
+        if (received == 0) {
+            return JNI_FALSE;
+        }
+        if (received < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        gdata->commandLength += (int) received;
+        buffer[gdata->commandLength] = 0;
+        offset = 0;
+        while ((end = strchr(buffer + offset, '\n')) != NULL) {
+            *end = 0;
+            if (end > buffer + offset && end[-1] == '\r') {
+                end[-1] = 0;
+            }
+            runCommand(buffer + offset);
+            offset = (int) (end + 1 - buffer);
+        }
+        if (offset == 0 && gdata->commandLength == COMMAND_BUFFER_SIZE - 1) {
+            // no command is that long, drop it
+            offset = gdata->commandLength;
+        }
+        gdata->commandLength -= offset;
+        (void) memmove(buffer, buffer + offset, (size_t) gdata->commandLength);
+    }
+}
+
+/**
+ * Offers compression right after connecting: FRAME_MAGIC, version and the
+ * codecs offered as a bit set. The server answers with a "codec name"
+ * command, from then on the connection carries frames in that codec.
+ * Sender thread only.
+ * @return false if the server did not answer in time
+ */
+static jboolean
+negotiateCodec() {
+    unsigned char offer[5];
+    struct pollfd pfd;
+    jlong waited;
+
+    (void) memcpy(offer, FRAME_MAGIC, 3);
+    offer[3] = FRAME_VERSION;
+    offer[4] = (unsigned char) (1 << gdata->compressCodec);
+    gdata->codecAnswered = JNI_FALSE;
+    gdata->framed = JNI_FALSE;
+    if (!sendToSocket(offer, (int) sizeof (offer))) {
+        return JNI_FALSE;
+    }
+    for (waited = 0; !gdata->codecAnswered; waited += SEND_POLL_MILLIS) {
+        if (waited >= SEND_CONNECT_TIMEOUT_MILLIS || gdata->senderAbort) {
+            printf("[agent] server did not answer the compression offer\n");
+            return JNI_FALSE;
+        }
+        pfd.fd = gdata->socket_desc;
+        pfd.events = POLLIN;
+        (void) poll(&pfd, 1, SEND_POLL_MILLIS);
+        if (!readCommands()) {
+            return JNI_FALSE;
+        }
+    }
+    gdata->framed = JNI_TRUE;
+    gdata->frameLength = 0;
+    gdata->frameEvents = 0;
+    return JNI_TRUE;
+}
+
+/**
+ * Agent thread which writes queued chunks to the server, reconnecting with
+ * backoff whenever the connection breaks. Chunks encoded for an earlier
+ * connection are discarded and counted.
+ * @param jvmti
  * @param env
- * @param klass
- * @param thread
- * @param a
+ * @param arg
  */
 static void JNICALL
-HEAP_TRACKER_native_newarr(JNIEnv *env, jclass klass, jthread thread, jobject a) {
-    TraceInfo *tinfo;
+senderThread(jvmtiEnv *jvmti, JNIEnv *env, void *arg) {
+    SendChunk *chunk;
+    jlong backoff;
+    jlong pending;
+    jlong tail;
 
-    if (gdata->vmDead) {
+    backoff = SEND_BACKOFF_MIN_MILLIS;
+    for (;;) {
+        if (gdata->socket_desc >= 0 && !readCommands()) {
+            puts("Server closed connection");
+            (void) close(gdata->socket_desc);
+            gdata->socket_desc = -1;
+            discardFrame();
+        }
+        tail = gdata->sendTail;
+        if (tail == __atomic_load_n(&gdata->sendHead, __ATOMIC_ACQUIRE)) {
+            if (gdata->frameLength > 0 && !gdata->senderStop) {
+                // a partial frame goes out once it is frameLatency old
+                pending = gdata->frameLatency - (getTime() - gdata->frameStart) / NANOS_PER_MILLI;
+                if (pending > 0) {
+                    waitSender(jvmti, pending < SEND_POLL_MILLIS ? pending : SEND_POLL_MILLIS);
+                    continue;
+                }
+            }
+            if (gdata->frameLength > 0 && !flushFrame()) {
+                (void) close(gdata->socket_desc);
+                gdata->socket_desc = -1;
+                discardFrame();
+            }
+            if (gdata->senderStop) {
+                break;
+            }
+            waitSender(jvmti, SEND_POLL_MILLIS);
+            continue;
+        }
+        if (gdata->socket_desc < 0) {
+            gdata->socket_desc = connectSocket();
+            if (gdata->socket_desc < 0) {
+                // no point in waiting for a server while the VM shuts down
+                if (gdata->senderStop || gdata->vmDead) {
+                    break;
+                }
+                waitSender(jvmti, backoff);
+                backoff = backoff * 2 > SEND_BACKOFF_MAX_MILLIS ? SEND_BACKOFF_MAX_MILLIS : backoff * 2;
+                continue;
+            }
+            backoff = SEND_BACKOFF_MIN_MILLIS;
+            gdata->commandLength = 0;
+            if (gdata->compressCodec != CODEC_NONE && !negotiateCodec()) {
+                (void) close(gdata->socket_desc);
+                gdata->socket_desc = -1;
+                waitSender(jvmti, backoff);
+                continue;
+            }
+            if (gdata->everConnected) {
+                // server state is per connection, drainer starts over
+                __atomic_store_n(&gdata->sendEpoch, gdata->sendEpoch + 1, __ATOMIC_RELEASE);
+            }
+            gdata->everConnected = JNI_TRUE;
+        }
+
+        chunk = &gdata->sendChunks[tail % SEND_QUEUE_CHUNKS];
+        if (chunk->epoch != gdata->sendEpoch) {
+            __sync_fetch_and_add(&gdata->discardedEvents, chunk->events);
+        } else if (!sendChunk(chunk)) {
+            // the chunk belongs to the broken connection now
+            (void) close(gdata->socket_desc);
+            gdata->socket_desc = -1;
+            discardFrame();
+            if (gdata->senderAbort) {
+                break;
+            }
+            continue;
+        }
+        (*jvmti)->RawMonitorEnter(jvmti, gdata->sendLock);
+        __atomic_store_n(&gdata->sendTail, tail + 1, __ATOMIC_RELEASE);
+        (*jvmti)->RawMonitorNotifyAll(jvmti, gdata->sendLock);
+        (*jvmti)->RawMonitorExit(jvmti, gdata->sendLock);
+    }
+    if (gdata->socket_desc >= 0) {
+        (void) close(gdata->socket_desc);
+        gdata->socket_desc = -1;
+    }
+
+    (*jvmti)->RawMonitorEnter(jvmti, gdata->sendLock);
+    gdata->senderDone = JNI_TRUE;
+    (*jvmti)->RawMonitorNotifyAll(jvmti, gdata->sendLock);
+    (*jvmti)->RawMonitorExit(jvmti, gdata->sendLock);
+}
+
+/**
+ * Starts the sender as JVMTI agent thread
+ * @param jvmti
+ * @param env
+ */
+static void
+startSender(jvmtiEnv *jvmti, JNIEnv *env) {
+    jvmtiError error;
+
+    error = (*jvmti)->RunAgentThread(jvmti, newAgentThread(env), &senderThread, NULL,
+            JVMTI_THREAD_NORM_PRIORITY);
+    check_jvmti_error(jvmti, error, "Cannot start sender thread");
+    gdata->senderStarted = JNI_TRUE;
+}
+
+/**
+ * Stops the sender once the queue is sent, giving up after
+ * SEND_SHUTDOWN_MILLIS when the server doesn't keep up
+ * @param jvmti
+ */
+static void
+stopSender(jvmtiEnv *jvmti) {
+    jlong waited;
+
+    if (!gdata->senderStarted) {
         return;
     }
-    tinfo = getTraceInfo(gdata->jvmti, thread, TRACE_USER);
-    if (tinfo != NULL) {
-        tagObjectWithId(gdata->jvmti, a, tinfo);
-        (void) free((TraceInfo*) tinfo);
+    (*jvmti)->RawMonitorEnter(jvmti, gdata->sendLock);
+    gdata->senderStop = JNI_TRUE;
+    (*jvmti)->RawMonitorNotifyAll(jvmti, gdata->sendLock);
+    for (waited = 0; !gdata->senderDone; waited += SEND_POLL_MILLIS) {
+        if (waited >= SEND_SHUTDOWN_MILLIS) {
+            gdata->senderAbort = JNI_TRUE;
+        }
+        (*jvmti)->RawMonitorWait(jvmti, gdata->sendLock, SEND_POLL_MILLIS);
     }
+    (*jvmti)->RawMonitorExit(jvmti, gdata->sendLock);
 }
 
 /**
@@ -490,7 +4830,6 @@ onVMStart(jvmtiEnv *jvmti, JNIEnv *env) {
     lock(jvmti);
     {
         jclass klass;
-        jfieldID field;
         jint rc;
         gdata->counter = 0;
         // Java Native Methods for class
@@ -513,13 +4852,8 @@ onVMStart(jvmtiEnv *jvmti, JNIEnv *env) {
                     STRING(HEAP_TRACKER_class));
         }
 
-        // Engage calls
-        field = (*env)->GetStaticFieldID(env, klass, STRING(HEAP_TRACKER_engaged), "I");
-        if (field == NULL) {
-            fatal_error("ERROR: JNI: Cannot get field from %s\n",
-                    STRING(HEAP_TRACKER_class));
-        }
-        (*env)->SetStaticIntField(env, klass, field, 1);
+        // Engage calls, unless started disengaged
+        setTrackerEngaged(env, gdata->engaged ? 1 : 0);
 
         /* Indicate VM has started */
         gdata->vmStarted = JNI_TRUE;
@@ -541,6 +4875,34 @@ onVMInit(jvmtiEnv *jvmti, JNIEnv *env, jthread thread) {
         gdata->vmInitialized = JNI_TRUE;
     }
     unlock(jvmti);
+    // after the VM installed its own handlers
+    installSnapshotSignal();
+    startDrainer(jvmti, env);
+    if (gdata->output == OUTPUT_SOCKET) {
+        startSender(jvmti, env);
+    }
+}
+
+/**
+ * Callback for JVMTI_EVENT_THREAD_END
+ * @param jvmti
+ * @param env
+ * @param thread
+ */
+static void JNICALL
+onThreadEnd(jvmtiEnv *jvmti, JNIEnv *env, jthread thread) {
+    jvmtiError error;
+    ThreadRing *ring;
+
+    ring = NULL;
+    error = (*jvmti)->GetThreadLocalStorage(jvmti, thread, (void**) &ring);
+    if (error == JVMTI_ERROR_NONE && ring != NULL) {
+        // threads are often renamed after they start, by pools in particular
+        resolveThreadIdentity(jvmti, env, thread, &ring->endName, &ring->endGroup);
+        // drainer releases it once drained
+        __atomic_store_n(&ring->retired, JNI_TRUE, __ATOMIC_RELEASE);
+        (*jvmti)->SetThreadLocalStorage(jvmti, thread, NULL);
+    }
 }
 
 /**
@@ -560,62 +4922,290 @@ onVMDeath(jvmtiEnv *jvmti, JNIEnv *env) {
     // Process VM Death
     lock(jvmti);
     {
-        jclass klass;
-        jfieldID field;
-
         // Disengage calls in HEAP_TRACKER_class
-        klass = (*env)->FindClass(env, STRING(HEAP_TRACKER_class));
-        if (klass == NULL) {
-            fatal_error("ERROR: JNI: Cannot find %s with FindClass\n",
-                    STRING(HEAP_TRACKER_class));
+        setTrackerEngaged(env, 0);
+        gdata->vmDead = JNI_TRUE;
+    }
+    unlock(jvmti);
+    // flush what is still sitting in the rings
+    stopDrainer(jvmti);
+    if (gdata->output == OUTPUT_FILE) {
+        closeSpoolSegment();
+    } else if (gdata->output == OUTPUT_SHM) {
+        closeShm();
+    } else {
+        stopSender(jvmti);
+    }
+    closeCapture();
+    if (gdata->droppedCreates + gdata->droppedFrees + gdata->discardedEvents > 0) {
+        printf("[agent] lost %ld creates, %ld frees and %ld events of broken connections\n",
+                gdata->droppedCreates, gdata->droppedFrees, gdata->discardedEvents);
+    }
+    printStats(jvmti);
+}
+
+/**
+ * Callback for JVMTI_EVENT_VM_OBJECT_ALLOC
+ * @param jvmti
+ * @param env
+ * @param thread
+ * @param object
+ * @param object_klass
+ * @param size
+ */
+static void JNICALL
+onVMObjectAlloc(jvmtiEnv *jvmti, JNIEnv *env, jthread thread,
+        jobject object, jclass object_klass, jlong size) {
+    // don't care if VM is already dead
+    if (gdata->vmDead) {
+        return;
+    }
+    trackAllocation(jvmti, env, thread, object, object_klass, TRACE_VM_OBJECT, size);
+}
+
+#ifdef HAVE_JVMTI_SAMPLED_ALLOC
+/**
+ * Callback for JVMTI_EVENT_SAMPLED_OBJECT_ALLOC
+ * @param jvmti
+ * @param env
+ * @param thread
+ * @param object
+ * @param object_klass
+ * @param size
+ */
+static void JNICALL
+onSampledObjectAlloc(jvmtiEnv *jvmti, JNIEnv *env, jthread thread,
+        jobject object, jclass object_klass, jlong size) {
+    if (gdata->vmDead) {
+        return;
+    }
+    trackAllocation(jvmti, env, thread, object, object_klass, TRACE_USER, size);
+}
+#endif
+
+/**
+ * Counts a freed object's lifetime on its site, in nanoseconds and in GC
+ * cycles survived
+ * @param site
+ * @param tinfo
+ */
+static void
+recordLifetime(TraceSite *site, TraceInfo *tinfo) {
+    jlong *histogram;
+    jlong *newHistogram;
+    jlong survived;
+
+    if (site->id >= MAX_SITES) {
+        return;
+    }
+    histogram = __atomic_load_n(&site->lifetimes, __ATOMIC_ACQUIRE);
+    if (histogram == NULL) {
+        newHistogram = (jlong*) allocateMemory((LIFETIME_BUCKETS + GC_CYCLE_BUCKETS) * sizeof (jlong));
+        if (__atomic_compare_exchange_n(&site->lifetimes, &histogram, newHistogram,
+                JNI_FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            histogram = newHistogram;
+        } else {
+            releaseMemory(newHistogram, (LIFETIME_BUCKETS + GC_CYCLE_BUCKETS) * sizeof (jlong));
+        }
+    }
+    tinfo->deallocationTime = getTime();
+    // the cycle collecting the object doesn't count as survived
+    survived = gdata->gcEpoch - tinfo->allocationEpoch - (gdata->gcActive ? 1 : 0);
+    __sync_fetch_and_add(&histogram[histogramBucket(tinfo->deallocationTime - tinfo->allocationTime,
+            LIFETIME_BUCKETS)], tinfo->weight);
+    __sync_fetch_and_add(&histogram[LIFETIME_BUCKETS + histogramBucket(survived, GC_CYCLE_BUCKETS)],
+            tinfo->weight);
+    if (!site->lifetimesDirty) {
+        __atomic_store_n(&site->lifetimesDirty, JNI_TRUE, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * Callback for JVMTI_EVENT_OBJECT_FREE
+ * @param jvmti
+ * @param tag
+ */
+static void JNICALL
+onObjectFree(jvmtiEnv *jvmti, jlong tag) {
+    FreeBatch *batch;
+    TraceInfo *tinfo;
+    TraceSite *site;
+    unsigned char *p;
+    jlong start;
+
+    if (gdata->vmDead) {
+        return;
+    }
+    tinfo = slabRecord(tag);
+    if (tinfo == NULL) {
+        return;
+    }
+    site = tinfo->site;
+    __sync_fetch_and_add(&gdata->stats.freed, 1);
+    recordLifetime(site, tinfo);
+    // aggregate mode, or the allocation itself was degraded to counters
+    if (gdata->mode == MODE_AGGREGATE || tinfo->id == 0) {
+        __sync_fetch_and_add(&site->freed, tinfo->weight);
+        __sync_fetch_and_sub(&site->liveBytes, tinfo->size * tinfo->weight);
+        if (gdata->mode != MODE_AGGREGATE) {
+            __sync_fetch_and_add(&gdata->degradedFrees, tinfo->weight);
         }
-        field = (*env)->GetStaticFieldID(env, klass, STRING(HEAP_TRACKER_engaged), "I");
-        if (field == NULL) {
-            fatal_error("ERROR: JNI: Cannot get field from %s\n",
-                    STRING(HEAP_TRACKER_class));
+        releaseSlot(tag);
+        return;
+    }
+    start = getTime();
+    (*jvmti)->RawMonitorEnter(jvmti, gdata->freeLock);
+    recordLatency(&gdata->stats.latency[STAT_LOCK_WAIT], start);
+    {
+        batch = openFreeBatch();
+        if (batch != NULL) {
+            p = batch->data + batch->length;
+            p += putVarint(p, zigzag(tinfo->id - batch->lastId));
+            p += putVarint(p, (unsigned long long) site->id);
+            p += putVarint(p, (unsigned long long) tinfo->size);
+            p += putVarint(p, zigzag(tinfo->allocationTime - batch->lastTime));
+            p += putVarint(p, (unsigned long long) tinfo->weight);
+            p += putVarint(p, (unsigned long long) classId(tinfo->klass));
+            p += putVarint(p, (unsigned long long) tinfo->thread);
+            batch->length = (int) (p - batch->data);
+            batch->lastId = tinfo->id;
+            batch->lastTime = tinfo->allocationTime;
+            batch->weight += tinfo->weight;
+            batch->count++;
         }
-        (*env)->SetStaticIntField(env, klass, field, 0);
-        gdata->vmDead = JNI_TRUE;
     }
-    unlock(jvmti);
+    (*jvmti)->RawMonitorExit(jvmti, gdata->freeLock);
+    if (batch == NULL) {
+        if (gdata->backpressure == BACKPRESSURE_AGGREGATE && site->id < MAX_SITES) {
+            __sync_fetch_and_add(&site->freed, tinfo->weight);
+            __sync_fetch_and_sub(&site->liveBytes, tinfo->size * tinfo->weight);
+            __sync_fetch_and_add(&gdata->degradedFrees, tinfo->weight);
+        } else {
+            __sync_fetch_and_add(&gdata->droppedFrees, tinfo->weight);
+        }
+    }
+    releaseSlot(tag);
 }
 
 /**
- * Callback for JVMTI_EVENT_VM_OBJECT_ALLOC
+ * Callback for JVMTI_EVENT_GARBAGE_COLLECTION_START
  * @param jvmti
- * @param env
- * @param thread
- * @param object
- * @param object_klass
- * @param size
  */
 static void JNICALL
-onVMObjectAlloc(jvmtiEnv *jvmti, JNIEnv *env, jthread thread,
-        jobject object, jclass object_klass, jlong size) {
-    TraceInfo *tinfo;
-    // don't care if VM is already dead
-    if (gdata->vmDead) {
-        return;
-    }
-    tinfo = getTraceInfo(jvmti, thread, TRACE_VM_OBJECT);
-    tagObjectWithId(jvmti, object, tinfo);
+onGarbageCollectionStart(jvmtiEnv *jvmti) {
+    gdata->gcEpoch++;
+    gdata->gcActive = JNI_TRUE;
 }
 
 /**
- * Callback for JVMTI_EVENT_OBJECT_FREE
+ * Callback for JVMTI_EVENT_GARBAGE_COLLECTION_FINISH
  * @param jvmti
- * @param tag
  */
 static void JNICALL
-onObjectFree(jvmtiEnv *jvmti, jlong tag) {
-    if (gdata->vmDead) {
-        return;
+onGarbageCollectionFinish(jvmtiEnv *jvmti) {
+    (*jvmti)->RawMonitorEnter(jvmti, gdata->freeLock);
+    {
+        gdata->gcActive = JNI_FALSE;
+        sealPendingFrees();
+    }
+    (*jvmti)->RawMonitorExit(jvmti, gdata->freeLock);
+}
+
+/**
+ * Decides whether a class gets instrumented, without locking or allocating
+ * @param classname internal name
+ * @return
+ */
+static jboolean
+shouldInstrument(const char *classname) {
+    // with JVMTI sampling the VM reports allocations itself
+    if (gdata->sampleMode == SAMPLE_JVMTI) {
+        return JNI_FALSE;
+    }
+    // the tracker class itself? --> ignore
+    if (strcmp(classname, STRING(HEAP_TRACKER_class)) == 0) {
+        return JNI_FALSE;
+    }
+    if (gdata->instrumentFilter == NULL) {
+        return strcmp(classname, STRING(OBJECT_class)) == 0;
+    }
+    return matchClassFilter(gdata->instrumentFilter, classname, strlen(classname));
+}
+
+/**
+ * Has java_crw_demo inject the tracker: Object.<init> calls newobj, and
+ * every newarray of the class is followed by a newarr call
+ * @param jvmti
+ * @param classname
+ * @param class_data_len
+ * @param class_data
+ * @param new_class_data_len
+ * @param new_class_data
+ */
+static void
+instrumentClass(jvmtiEnv *jvmti, const char *classname,
+        jint class_data_len, const unsigned char* class_data,
+        jint* new_class_data_len, unsigned char** new_class_data) {
+    jint cnum;
+    int systemClass;
+    unsigned char *newImage;
+    long newLength;
+
+    /*  Is it a system class? If the class load is before VmStart
+     *  then we will consider it a system class that should
+     *  be treated carefully. (See java_crw_demo)
+     */
+    systemClass = 0;
+    if (!gdata->vmStarted) {
+        systemClass = 1;
+    }
+    // only used by method entry and exit injection, which is off
+    cnum = 0;
+
+    newImage = NULL;
+    newLength = 0;
+
+    // instrumentation
+    java_crw_demo(cnum,
+            classname,
+            class_data,
+            class_data_len,
+            systemClass,
+            STRING(HEAP_TRACKER_class),
+            "L" STRING(HEAP_TRACKER_class) ";",
+            NULL, NULL,
+            NULL, NULL,
+            STRING(HEAP_TRACKER_newobj), "(Ljava/lang/Object;)V",
+            STRING(HEAP_TRACKER_newarr), "(Ljava/lang/Object;)V",
+            &newImage,
+            &newLength,
+            NULL,
+            NULL);
+
+    // If we got back a new class image, return it back as "the"
+    // new class image. This must be JVMTI Allocate space.
+
+    if (newLength > 0) {
+        unsigned char *jvmti_space;
+
+        jvmti_space = (unsigned char *) allocate(jvmti, (jint) newLength);
+        (void) memcpy((void*) jvmti_space, (void*) newImage, (int) newLength);
+        *new_class_data_len = (jint) newLength;
+        *new_class_data = jvmti_space; /* VM will deallocate */
+        if (gdata->instrumentFilter == NULL) {
+            printf("[agent] instrumented %s\n", classname);
+        }
+    }
+
+    // Always free up the space we get from java_crw_demo()
+    if (newImage != NULL) {
+        (void) free((void*) newImage);
     }
-    eventDeallocatation(tag);
 }
 
 /**
- * Callback for JVMTI_EVENT_CLASS_FILE_LOAD_HOOK
+ * Callback for JVMTI_EVENT_CLASS_FILE_LOAD_HOOK. Classes that don't get
+ * instrumented, nearly all of them, are turned away before the lock.
  * @param jvmti
  * @param env
  * @param class_being_redefined
@@ -633,87 +5223,134 @@ onClassFileLoadHook(jvmtiEnv *jvmti, JNIEnv* env,
         const char* name, jobject protection_domain,
         jint class_data_len, const unsigned char* class_data,
         jint* new_class_data_len, unsigned char** new_class_data) {
-    lock(jvmti);
-    {
-        // It's possible we get here right after VmDeath event, be careful
-        // if vm is dead, don't care as we only want to hook into bootstrap classes
-        if (!gdata->vmDead) {
-            const char * classname;
-            // name can be NULL
-            if (name == NULL) {
-                classname = java_crw_demo_classname(class_data, class_data_len,
-                        NULL);
-                if (classname == NULL) {
-                    fatal_error("ERROR: No classname in classfile\n");
-                }
-            } else {
-                classname = strdup(name);
-                if (classname == NULL) {
-                    fatal_error("ERROR: Ran out of malloc() space\n");
-                }
-            }
+    char *parsedName;
+    const char *classname;
 
-            *new_class_data_len = 0;
-            *new_class_data = NULL;
-
-            // The tracker class itself? --> ignore
-            if (strcmp(classname, STRING(OBJECT_class)) == 0) {
-                jint cnum;
-                int systemClass;
-                unsigned char *newImage;
-                long newLength;
-                printf("[agent] instrumented %s\n", classname);
-
-                /*  Is it a system class? If the class load is before VmStart
-                 *  then we will consider it a system class that should
-                 *  be treated carefully. (See java_crw_demo)
-                 */
-                systemClass = 0;
-                if (!gdata->vmStarted) {
-                    systemClass = 1;
-                }
+    *new_class_data_len = 0;
+    *new_class_data = NULL;
+    // It's possible we get here right after VmDeath event, be careful
+    if (gdata->vmDead) {
+        return;
+    }
+    // name can be NULL
+    parsedName = NULL;
+    classname = name;
+    if (classname == NULL) {
+        parsedName = java_crw_demo_classname(class_data, class_data_len, NULL);
+        if (parsedName == NULL) {
+            fatal_error("ERROR: No classname in classfile\n");
+        }
+        classname = parsedName;
+    }
 
-                newImage = NULL;
-                newLength = 0;
-
-                // instrumentation
-                java_crw_demo(cnum,
-                        classname,
-                        class_data,
-                        class_data_len,
-                        systemClass,
-                        STRING(HEAP_TRACKER_class),
-                        "L" STRING(HEAP_TRACKER_class) ";",
-                        NULL, NULL,
-                        NULL, NULL,
-                        STRING(HEAP_TRACKER_newobj), "(Ljava/lang/Object;)V",
-                        STRING(HEAP_TRACKER_newarr), "(Ljava/lang/Object;)V",
-                        &newImage,
-                        &newLength,
-                        NULL,
-                        NULL);
-
-                // If we got back a new class image, return it back as "the"
-                // new class image. This must be JVMTI Allocate space.
-
-                if (newLength > 0) {
-                    unsigned char *jvmti_space;
-
-                    jvmti_space = (unsigned char *) allocate(jvmti, (jint) newLength);
-                    (void) memcpy((void*) jvmti_space, (void*) newImage, (int) newLength);
-                    *new_class_data_len = (jint) newLength;
-                    *new_class_data = jvmti_space; /* VM will deallocate */
-                }
+    if (shouldInstrument(classname)) {
+        lock(jvmti);
+        {
+            // if vm is dead, don't care
+            if (!gdata->vmDead) {
+                instrumentClass(jvmti, classname, class_data_len, class_data,
+                        new_class_data_len, new_class_data);
+            }
+        }
+        unlock(jvmti);
+    }
+    if (parsedName != NULL) {
+        (void) free((void*) parsedName);
+    }
+}
 
-                // Always free up the space we get from java_crw_demo()
-                if (newImage != NULL) {
-                    (void) free((void*) newImage);
-                }
+/**
+ * Has the classes loaded before the agent attached go through the class
+ * file load hook again, to instrument those that would have been
+ * @param jvmti
+ */
+static void
+retransformLoadedClasses(jvmtiEnv *jvmti) {
+    jvmtiError error;
+    jclass *classes;
+    jclass *selected;
+    jboolean modifiable;
+    jint count;
+    jint chosen;
+    char *signature;
+    size_t length;
+    int i;
+
+    classes = NULL;
+    error = (*jvmti)->GetLoadedClasses(jvmti, &count, &classes);
+    check_jvmti_error(jvmti, error, "Cannot get loaded classes");
+    selected = (jclass*) allocateMemory((size_t) (count + 1) * sizeof (jclass));
+    chosen = 0;
+    for (i = 0; i < count; i++) {
+        signature = NULL;
+        error = (*jvmti)->GetClassSignature(jvmti, classes[i], &signature, NULL);
+        if (error != JVMTI_ERROR_NONE) {
+            continue;
+        }
+        // Ljava/lang/Object; to java/lang/Object, arrays and primitives never match
+        length = strlen(signature);
+        if (signature[0] == 'L' && length > 2) {
+            signature[length - 1] = 0;
+            modifiable = JNI_FALSE;
+            if (shouldInstrument(signature + 1)
+                    && (*jvmti)->IsModifiableClass(jvmti, classes[i], &modifiable) == JVMTI_ERROR_NONE
+                    && modifiable) {
+                selected[chosen++] = classes[i];
             }
-            (void) free((void*) classname);
         }
+        deallocate(jvmti, signature);
     }
-    unlock(jvmti);
+    if (chosen > 0) {
+        error = (*jvmti)->RetransformClasses(jvmti, chosen, selected);
+        check_jvmti_error(jvmti, error, "Cannot retransform loaded classes");
+    }
+    printf("[agent] retransformed %d of %d loaded classes\n", chosen, count);
+    releaseMemory(selected, (size_t) (count + 1) * sizeof (jclass));
+    deallocate(jvmti, classes);
+}
+
+/**
+ * Callback for HotSpot's ClassUnload extension event, parameters differ
+ * between JDK releases so none are used
+ * @param jvmti
+ */
+static void JNICALL
+onClassUnload(jvmtiEnv *jvmti, ...) {
+    gdata->methodCacheStale = JNI_TRUE;
+}
+
+/**
+ * Registers for the ClassUnload extension event when the VM offers it
+ * @param jvmti
+ */
+static void
+registerClassUnloadHook(jvmtiEnv *jvmti) {
+    jvmtiError error;
+    jvmtiExtensionEventInfo *events;
+    jint count;
+    int i;
+    int j;
+
+    events = NULL;
+    count = 0;
+    error = (*jvmti)->GetExtensionEvents(jvmti, &count, &events);
+    if (error != JVMTI_ERROR_NONE) {
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        if (strcmp(events[i].id, CLASS_UNLOAD_EVENT) == 0) {
+            error = (*jvmti)->SetExtensionEventCallback(jvmti,
+                    events[i].extension_event_index, (jvmtiExtensionEvent) &onClassUnload);
+            check_jvmti_error(jvmti, error, "Cannot set class unload callback");
+        }
+        for (j = 0; j < events[i].param_count; j++) {
+            deallocate(jvmti, events[i].params[j].name);
+        }
+        deallocate(jvmti, events[i].id);
+        deallocate(jvmti, events[i].short_description);
+        deallocate(jvmti, events[i].params);
+    }
+    deallocate(jvmti, events);
 }
 
 /**
@@ -747,6 +5384,38 @@ parse_agent_options(char *options) {
             stdout_message("\t maxDump=n\t\t\t How many TraceInfo's to dump\n");
             stdout_message("\t server=n\t\t\t server hostname/IP\n");
             stdout_message("\t port=n\t\t\t server's port\n");
+            stdout_message("\t output=socket|file:path\t send to server or spool to path.NNNNNN\n");
+            stdout_message("\t output=shm:name\t\t write to a ring in /dev/shm/name for a reader\n");
+            stdout_message("\t\t\t\t on the same host\n");
+            stdout_message("\t record=path\t\t also record the output to path, with its timing,\n");
+            stdout_message("\t\t\t\t for CaptureReplayer to play against a server\n");
+            stdout_message("\t format=binary|text\t wire format, binary by default\n");
+            stdout_message("\t mode=events|aggregate\t send every event or per site snapshots\n");
+            stdout_message("\t compress=lz4|none\t offer the server compressed frames, none by default\n");
+            stdout_message("\t frameSize=bytes\t\t compress this much at once, 131072 by default\n");
+            stdout_message("\t frameLatency=ms\t\t send a partial frame this late, 50 by default\n");
+            stdout_message("\t interval=ms\t\t snapshot, lifetime histogram and agent stats interval\n");
+            stdout_message("\t backpressure=block|drop|aggregate\t when output can't keep up, wait,\n");
+            stdout_message("\t\t\t\t drop or count events per site, block by default;\n");
+            stdout_message("\t\t\t\t frees never wait, GC would, block buffers them\n");
+            stdout_message("\t depth=n\t\t\t frames of allocation stack traces, 5 by default,\n");
+            stdout_message("\t\t\t\t up to " STRING(MAX_DEPTH) "\n");
+            stdout_message("\t sample=every:n\t\t track every n-th allocation of a thread\n");
+            stdout_message("\t sample=bytes:n\t\t track one allocation per ~n bytes allocated\n");
+            stdout_message("\t sample=jvmti:n\t\t same as bytes:n using SampledObjectAlloc\n");
+            stdout_message("\t instrument=p1:p2...\t instead of java.lang.Object, instrument the\n");
+            stdout_message("\t\t\t\t newarray sites of classes matching a pattern\n");
+            stdout_message("\t snapshotSignal=n\t walk the heap and send the live object ids on\n");
+            stdout_message("\t\t\t\t signal n, as on the server's snapshot command\n");
+            stdout_message("\t include=p1:p2...\t only track classes matching a pattern, e.g.\n");
+            stdout_message("\t\t\t\t com.acme.*:java.util.HashMap\n");
+            stdout_message("\t exclude=p1:p2...\t don't track classes matching a pattern, the\n");
+            stdout_message("\t\t\t\t longest pattern matching a class wins\n");
+            stdout_message("\t start=engaged|disengaged\t track from the start, or only after the\n");
+            stdout_message("\t\t\t\t engage command, engaged by default\n");
+            stdout_message("\t control=path\t\t file to write engage or disengage to, also\n");
+            stdout_message("\t\t\t\t commands on the socket or options of loading again\n");
+            stdout_message("\t bootclasspath=jar\t\t jar with HeapTracker, needed when attaching\n");
             stdout_message("\n");
             exit(0);
         } else if (strcmp(token, "maxDump") == 0) {
@@ -775,6 +5444,190 @@ parse_agent_options(char *options) {
             printf("%s", port);
 
             gdata->port = atoi(port);
+        } else if (strcmp(token, "output") == 0) {
+            char output[1024];
+            next = get_token(next, ",=", output, (int) sizeof (output));
+            if (next == NULL) {
+                fatal_error("ERROR: Cannot parse output=socket|file:path|shm:name: %s\n", options);
+            }
+            if (strcmp(output, "socket") == 0) {
+                gdata->output = OUTPUT_SOCKET;
+            } else if (strncmp(output, "file:", 5) == 0 && output[5] != 0) {
+                gdata->output = OUTPUT_FILE;
+                gdata->spoolPath = strdup(output + 5);
+            } else if (strncmp(output, "shm:", 4) == 0 && output[4] != 0
+                    && strchr(output + 4, '/') == NULL) {
+                gdata->output = OUTPUT_SHM;
+                gdata->shmName = strdup(output + 4);
+            } else {
+                fatal_error("ERROR: Unknown output: %s\n", output);
+            }
+        } else if (strcmp(token, "record") == 0) {
+            char record[1024];
+            next = get_token(next, ",=", record, (int) sizeof (record));
+            if (next == NULL || record[0] == 0) {
+                fatal_error("ERROR: Cannot parse record=path: %s\n", options);
+            }
+            gdata->capturePath = strdup(record);
+        } else if (strcmp(token, "sample") == 0) {
+            char sample[MAX_TOKEN_LENGTH];
+            char *interval;
+            next = get_token(next, ",=", sample, (int) sizeof (sample));
+            interval = next != NULL ? strchr(sample, ':') : NULL;
+            if (interval == NULL) {
+                fatal_error("ERROR: Cannot parse sample=mode:n: %s\n", options);
+            }
+            *interval++ = 0;
+            gdata->sampleInterval = atol(interval);
+            if (gdata->sampleInterval <= 0) {
+                fatal_error("ERROR: Invalid sample interval: %s\n", interval);
+            }
+            if (strcmp(sample, "every") == 0) {
+                gdata->sampleMode = SAMPLE_EVERY;
+            } else if (strcmp(sample, "bytes") == 0) {
+                gdata->sampleMode = SAMPLE_BYTES;
+            } else if (strcmp(sample, "jvmti") == 0) {
+                gdata->sampleMode = SAMPLE_JVMTI;
+            } else {
+                fatal_error("ERROR: Unknown sample mode: %s\n", sample);
+            }
+        } else if (strcmp(token, "backpressure") == 0) {
+            char policy[MAX_TOKEN_LENGTH];
+            next = get_token(next, ",=", policy, (int) sizeof (policy));
+            if (next == NULL) {
+                fatal_error("ERROR: Cannot parse backpressure=block|drop|aggregate: %s\n", options);
+            }
+            if (strcmp(policy, "block") == 0) {
+                gdata->backpressure = BACKPRESSURE_BLOCK;
+            } else if (strcmp(policy, "drop") == 0) {
+                gdata->backpressure = BACKPRESSURE_DROP;
+            } else if (strcmp(policy, "aggregate") == 0) {
+                gdata->backpressure = BACKPRESSURE_AGGREGATE;
+            } else {
+                fatal_error("ERROR: Unknown backpressure policy: %s\n", policy);
+            }
+        } else if (strcmp(token, "mode") == 0) {
+            char mode[MAX_TOKEN_LENGTH];
+            next = get_token(next, ",=", mode, (int) sizeof (mode));
+            if (next == NULL) {
+                fatal_error("ERROR: Cannot parse mode=events|aggregate: %s\n", options);
+            }
+            if (strcmp(mode, "events") == 0) {
+                gdata->mode = MODE_EVENTS;
+            } else if (strcmp(mode, "aggregate") == 0) {
+                gdata->mode = MODE_AGGREGATE;
+            } else {
+                fatal_error("ERROR: Unknown mode: %s\n", mode);
+            }
+        } else if (strcmp(token, "interval") == 0) {
+            char interval[MAX_TOKEN_LENGTH];
+            next = get_token(next, ",=", interval, (int) sizeof (interval));
+            if (next == NULL) {
+                fatal_error("ERROR: Cannot parse interval=ms: %s\n", options);
+            }
+            gdata->snapshotInterval = atol(interval);
+        } else if (strcmp(token, "compress") == 0) {
+            char codec[MAX_TOKEN_LENGTH];
+            next = get_token(next, ",=", codec, (int) sizeof (codec));
+            if (next == NULL) {
+                fatal_error("ERROR: Cannot parse compress=lz4|none: %s\n", options);
+            }
+            if (strcmp(codec, "lz4") == 0) {
+                gdata->compressCodec = CODEC_LZ4;
+            } else if (strcmp(codec, "none") == 0) {
+                gdata->compressCodec = CODEC_NONE;
+            } else {
+                fatal_error("ERROR: Unknown codec: %s\n", codec);
+            }
+        } else if (strcmp(token, "frameSize") == 0) {
+            char size[MAX_TOKEN_LENGTH];
+            next = get_token(next, ",=", size, (int) sizeof (size));
+            if (next == NULL) {
+                fatal_error("ERROR: Cannot parse frameSize=bytes: %s\n", options);
+            }
+            gdata->frameSize = atoi(size);
+            if (gdata->frameSize <= 0 || gdata->frameSize > FRAME_SIZE_MAX) {
+                fatal_error("ERROR: Invalid frame size, up to %d: %s\n", FRAME_SIZE_MAX, size);
+            }
+        } else if (strcmp(token, "frameLatency") == 0) {
+            char latency[MAX_TOKEN_LENGTH];
+            next = get_token(next, ",=", latency, (int) sizeof (latency));
+            if (next == NULL) {
+                fatal_error("ERROR: Cannot parse frameLatency=ms: %s\n", options);
+            }
+            gdata->frameLatency = atol(latency);
+        } else if (strcmp(token, "depth") == 0) {
+            char depth[MAX_TOKEN_LENGTH];
+            next = get_token(next, ",=", depth, (int) sizeof (depth));
+            if (next == NULL) {
+                fatal_error("ERROR: Cannot parse depth=n: %s\n", options);
+            }
+            gdata->depth = atoi(depth);
+            if (gdata->depth <= 0 || gdata->depth > MAX_DEPTH) {
+                fatal_error("ERROR: Invalid depth, 1 to %d: %s\n", MAX_DEPTH, depth);
+            }
+        } else if (strcmp(token, "snapshotSignal") == 0) {
+            char signal[MAX_TOKEN_LENGTH];
+            next = get_token(next, ",=", signal, (int) sizeof (signal));
+            if (next == NULL) {
+                fatal_error("ERROR: Cannot parse snapshotSignal=n: %s\n", options);
+            }
+            gdata->snapshotSignal = atoi(signal);
+            if (gdata->snapshotSignal <= 0 || gdata->snapshotSignal >= NSIG) {
+                fatal_error("ERROR: Invalid signal: %s\n", signal);
+            }
+        } else if (strcmp(token, "instrument") == 0) {
+            char patterns[1024];
+            next = get_token(next, ",=", patterns, (int) sizeof (patterns));
+            if (next == NULL) {
+                fatal_error("ERROR: Cannot parse instrument=pattern:pattern...: %s\n", options);
+            }
+            addClassFilter(&gdata->instrumentFilter, patterns, FILTER_INCLUDE);
+        } else if (strcmp(token, "include") == 0 || strcmp(token, "exclude") == 0) {
+            char patterns[1024];
+            next = get_token(next, ",=", patterns, (int) sizeof (patterns));
+            if (next == NULL) {
+                fatal_error("ERROR: Cannot parse %s=pattern:pattern...: %s\n", token, options);
+            }
+            addClassFilter(&gdata->classFilter, patterns,
+                    strcmp(token, "include") == 0 ? FILTER_INCLUDE : FILTER_EXCLUDE);
+        } else if (strcmp(token, "start") == 0) {
+            char start[MAX_TOKEN_LENGTH];
+            next = get_token(next, ",=", start, (int) sizeof (start));
+            if (next == NULL) {
+                fatal_error("ERROR: Cannot parse start=engaged|disengaged: %s\n", options);
+            }
+            if (strcmp(start, "engaged") == 0) {
+                gdata->engaged = JNI_TRUE;
+            } else if (strcmp(start, "disengaged") == 0) {
+                gdata->engaged = JNI_FALSE;
+            } else {
+                fatal_error("ERROR: Unknown start: %s\n", start);
+            }
+        } else if (strcmp(token, "control") == 0 || strcmp(token, "bootclasspath") == 0) {
+            char path[1024];
+            next = get_token(next, ",=", path, (int) sizeof (path));
+            if (next == NULL) {
+                fatal_error("ERROR: Cannot parse %s=path: %s\n", token, options);
+            }
+            if (strcmp(token, "control") == 0) {
+                gdata->controlPath = strdup(path);
+            } else {
+                gdata->bootClassPath = strdup(path);
+            }
+        } else if (strcmp(token, "format") == 0) {
+            char format[MAX_TOKEN_LENGTH];
+            next = get_token(next, ",=", format, (int) sizeof (format));
+            if (next == NULL) {
+                fatal_error("ERROR: Cannot parse format=binary|text: %s\n", options);
+            }
+            if (strcmp(format, "text") == 0) {
+                gdata->format = FORMAT_TEXT;
+            } else if (strcmp(format, "binary") == 0) {
+                gdata->format = FORMAT_BINARY;
+            } else {
+                fatal_error("ERROR: Unknown format: %s\n", format);
+            }
         } else if (token[0] != 0) {
             // unknown option supplied
             fatal_error("ERROR: Unknown option: %s\n", token);
@@ -785,14 +5638,59 @@ parse_agent_options(char *options) {
 }
 
 /**
- * Agent on load event first code to get executed
+ * Enables the events the agent runs on. Callbacks may fire on other threads
+ * right away once the VM is live, so this comes after every monitor and
+ * buffer they touch exists: last thing on load, and when attached, after
+ * the tracker's natives are registered and drainer runs.
+ * @param jvmti
+ */
+static void
+enableEvents(jvmtiEnv *jvmti) {
+    jvmtiError error;
+
+    // At first the only initial events we are interested in are VM
+    // initialization, VM death, and Class File Loads.
+    // Once the VM is initialized we will request more events.
+    if (!gdata->attached) {
+        error = (*jvmti)->SetEventNotificationMode(jvmti, JVMTI_ENABLE,
+                JVMTI_EVENT_VM_START, (jthread) NULL);
+        check_jvmti_error(jvmti, error, "Cannot set event notification");
+        error = (*jvmti)->SetEventNotificationMode(jvmti, JVMTI_ENABLE,
+                JVMTI_EVENT_VM_INIT, (jthread) NULL);
+        check_jvmti_error(jvmti, error, "Cannot set event notification");
+    }
+    error = (*jvmti)->SetEventNotificationMode(jvmti, JVMTI_ENABLE,
+            JVMTI_EVENT_VM_DEATH, (jthread) NULL);
+    check_jvmti_error(jvmti, error, "Cannot set event notification");
+    error = (*jvmti)->SetEventNotificationMode(jvmti, JVMTI_ENABLE,
+            JVMTI_EVENT_THREAD_END, (jthread) NULL);
+    check_jvmti_error(jvmti, error, "Cannot set event notification");
+#ifdef HAVE_JVMTI_SAMPLED_ALLOC
+    if (gdata->sampleMode == SAMPLE_JVMTI) {
+        error = (*jvmti)->SetHeapSamplingInterval(jvmti, (jint) gdata->sampleInterval);
+        check_jvmti_error(jvmti, error, "Cannot set heap sampling interval");
+    }
+#endif
+    // started disengaged, these stay off until the engage command
+    if (gdata->engaged) {
+        setFreeEvents(jvmti, JVMTI_ENABLE);
+        setAllocationEvents(jvmti, JVMTI_ENABLE);
+    }
+    error = (*jvmti)->SetEventNotificationMode(jvmti, JVMTI_ENABLE,
+            JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, (jthread) NULL);
+    check_jvmti_error(jvmti, error, "Cannot set event notification");
+    registerClassUnloadHook(jvmti);
+}
+
+/**
+ * Sets the agent up, at VM startup or when attaching to a running VM
  * @param vm
  * @param options
- * @param reserved
+ * @param attached true in the live phase, VM start and init already happened
  * @return
  */
-JNIEXPORT jint JNICALL
-Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
+static jint
+loadAgent(JavaVM *vm, char *options, jboolean attached) {
     static GlobalAgentData data;
     jvmtiEnv *jvmti;
     jvmtiError error;
@@ -801,12 +5699,20 @@ Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
     jvmtiCapabilities capabilities;
     jvmtiEventCallbacks callbacks;
     static Trace empty;
+    int i;
     printf("\n\nagent loaded \n\n");
     // allocation for global data
     (void) memset((void*) &data, 0, sizeof (data));
     gdata = &data;
     gdata->serverHostname = "127.0.0.1";
     gdata->port = 9000;
+    gdata->snapshotInterval = SNAPSHOT_INTERVAL_MILLIS;
+    gdata->depth = DEFAULT_DEPTH;
+    gdata->frameSize = FRAME_SIZE_DEFAULT;
+    gdata->frameLatency = FRAME_LATENCY_MILLIS;
+    gdata->attached = attached;
+    gdata->engaged = JNI_TRUE;
+    initClock();
     // First thing we need to do is get the jvmtiEnv* or JVMTI environment
     res = (*vm)->GetEnv(vm, (void **) &jvmti, JVMTI_VERSION_1);
     if (res != JNI_OK) {
@@ -821,15 +5727,42 @@ Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
     gdata->jvmti = jvmti;
     // options parsing
     parse_agent_options(options);
+    if (gdata->bootClassPath != NULL) {
+        error = (*jvmti)->AddToBootstrapClassLoaderSearch(jvmti, gdata->bootClassPath);
+        check_jvmti_error(jvmti, error, "Cannot add to boot class path");
+    }
 
     // ask VMs for the capabilities
     (void) memset(&capabilities, 0, sizeof (capabilities));
-    capabilities.can_generate_all_class_hook_events = 1;
+    if (attached) {
+        // classes loaded so far get instrumented again
+        capabilities.can_retransform_classes = 1;
+    } else {
+        capabilities.can_generate_all_class_hook_events = 1;
+    }
     capabilities.can_tag_objects = 1;
     capabilities.can_generate_object_free_events = 1;
     capabilities.can_get_source_file_name = 1;
     capabilities.can_get_line_numbers = 1;
     capabilities.can_generate_vm_object_alloc_events = 1;
+    capabilities.can_generate_garbage_collection_events = 1;
+    if (gdata->sampleMode == SAMPLE_JVMTI) {
+#ifdef HAVE_JVMTI_SAMPLED_ALLOC
+        jvmtiCapabilities potential;
+        (void) memset(&potential, 0, sizeof (potential));
+        error = (*jvmti)->GetPotentialCapabilities(jvmti, &potential);
+        check_jvmti_error(jvmti, error, "Unable to get potential JVMTI capabilities.");
+        if (potential.can_generate_sampled_object_alloc_events) {
+            capabilities.can_generate_sampled_object_alloc_events = 1;
+        } else {
+            stdout_message("SampledObjectAlloc is not supported, using sample=bytes\n");
+            gdata->sampleMode = SAMPLE_BYTES;
+        }
+#else
+        stdout_message("agent built without SampledObjectAlloc, using sample=bytes\n");
+        gdata->sampleMode = SAMPLE_BYTES;
+#endif
+    }
     error = (*jvmti)->AddCapabilities(jvmti, &capabilities);
     // did we really got capabilities from VM
     check_jvmti_error(jvmti, error, "Unable to get necessary JVMTI capabilities.");
@@ -842,53 +5775,143 @@ Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
     callbacks.VMInit = &onVMInit;
     // JVMTI_EVENT_VM_DEATH
     callbacks.VMDeath = &onVMDeath;
+    // JVMTI_EVENT_THREAD_END
+    callbacks.ThreadEnd = &onThreadEnd;
     // JVMTI_EVENT_OBJECT_FREE
     callbacks.ObjectFree = &onObjectFree;
+    // JVMTI_EVENT_GARBAGE_COLLECTION_START
+    callbacks.GarbageCollectionStart = &onGarbageCollectionStart;
+    // JVMTI_EVENT_GARBAGE_COLLECTION_FINISH
+    callbacks.GarbageCollectionFinish = &onGarbageCollectionFinish;
     // JVMTI_EVENT_VM_OBJECT_ALLOC
     callbacks.VMObjectAlloc = &onVMObjectAlloc;
+#ifdef HAVE_JVMTI_SAMPLED_ALLOC
+    // JVMTI_EVENT_SAMPLED_OBJECT_ALLOC
+    callbacks.SampledObjectAlloc = &onSampledObjectAlloc;
+#endif
     // JVMTI_EVENT_CLASS_FILE_LOAD_HOOK
     callbacks.ClassFileLoadHook = &onClassFileLoadHook;
     error = (*jvmti)->SetEventCallbacks(jvmti, &callbacks, (jint)sizeof (callbacks));
     check_jvmti_error(jvmti, error, "Cannot set jvmti callbacks");
 
-    // At first the only initial events we are interested in are VM
-    // initialization, VM death, and Class File Loads.
-    // Once the VM is initialized we will request more events.
-
-    error = (*jvmti)->SetEventNotificationMode(jvmti, JVMTI_ENABLE,
-            JVMTI_EVENT_VM_START, (jthread) NULL);
-    check_jvmti_error(jvmti, error, "Cannot set event notification");
-    error = (*jvmti)->SetEventNotificationMode(jvmti, JVMTI_ENABLE,
-            JVMTI_EVENT_VM_INIT, (jthread) NULL);
-    check_jvmti_error(jvmti, error, "Cannot set event notification");
-    error = (*jvmti)->SetEventNotificationMode(jvmti, JVMTI_ENABLE,
-            JVMTI_EVENT_VM_DEATH, (jthread) NULL);
-    check_jvmti_error(jvmti, error, "Cannot set event notification");
-    error = (*jvmti)->SetEventNotificationMode(jvmti, JVMTI_ENABLE,
-            JVMTI_EVENT_OBJECT_FREE, (jthread) NULL);
-    check_jvmti_error(jvmti, error, "Cannot set event notification");
-    error = (*jvmti)->SetEventNotificationMode(jvmti, JVMTI_ENABLE,
-            JVMTI_EVENT_VM_OBJECT_ALLOC, (jthread) NULL);
-    check_jvmti_error(jvmti, error, "Cannot set event notification");
-    error = (*jvmti)->SetEventNotificationMode(jvmti, JVMTI_ENABLE,
-            JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, (jthread) NULL);
-    check_jvmti_error(jvmti, error, "Cannot set event notification");
 
     // create monitor
     error = (*jvmti)->CreateRawMonitor(jvmti, "agent data", &(gdata->lock));
     check_jvmti_error(jvmti, error, "Cannot create raw monitor");
+    error = (*jvmti)->CreateRawMonitor(jvmti, "agent drain", &(gdata->drainLock));
+    check_jvmti_error(jvmti, error, "Cannot create raw monitor");
+    error = (*jvmti)->CreateRawMonitor(jvmti, "agent free", &(gdata->freeLock));
+    check_jvmti_error(jvmti, error, "Cannot create raw monitor");
+    error = (*jvmti)->CreateRawMonitor(jvmti, "agent send", &(gdata->sendLock));
+    check_jvmti_error(jvmti, error, "Cannot create raw monitor");
+
+    for (i = 0; i < FREE_BATCH_COUNT; i++) {
+        gdata->freeBatches[i].data = (unsigned char*) allocateMemory(FREE_BATCH_SIZE);
+        gdata->freeBatches[i].capacity = FREE_BATCH_SIZE;
+    }
+
+    gdata->sitesById = (TraceSite**) allocateMemory(MAX_SITES * sizeof (TraceSite*));
 
     // create the TraceInfo for various flavors of empty traces
     for (flavor = TRACE_FIRST; flavor <= TRACE_LAST; flavor++) {
-        gdata->emptyTrace[flavor] =
-                constructTraceInfo(&empty, flavor);
+        gdata->emptyTrace[flavor] = (TraceInfo*) allocateMemory(sizeof (TraceInfo));
+        empty.flavor = flavor;
+        constructTraceInfo(gdata->emptyTrace[flavor], internTrace(&empty), 0, 1, 0, 0, NULL, -1);
+    }
+    if (gdata->output != OUTPUT_SOCKET) {
+        gdata->outBuffer = (unsigned char*) allocateMemory(OUT_BUFFER_SIZE);
+    } else {
+        // drainer encodes right into the chunks it queues for the sender
+        gdata->sendChunks = (SendChunk*) allocateMemory(SEND_QUEUE_CHUNKS * sizeof (SendChunk));
+        for (i = 0; i < SEND_QUEUE_CHUNKS; i++) {
+            gdata->sendChunks[i].data = (unsigned char*) allocateMemory(OUT_BUFFER_SIZE);
+        }
+        gdata->outBuffer = gdata->sendChunks[0].data;
+        if (gdata->compressCodec != CODEC_NONE) {
+            // a frame overshoots frameSize by at most one chunk
+            gdata->frameBuffer = (unsigned char*) allocateMemory(gdata->frameSize + OUT_BUFFER_SIZE);
+            gdata->compressBuffer = (unsigned char*) allocateMemory(gdata->frameSize + OUT_BUFFER_SIZE);
+            gdata->lzTable = (jint*) allocateMemory(sizeof (jint) << LZ_HASH_BITS);
+        }
+    }
+    gdata->recordBuffer = (unsigned char*) allocateMemory(MAX_RECORD_LENGTH);
+
+    // the local spool and ring are opened right away, sender thread connects
+    // to the server once the VM is initialized
+    gdata->socket_desc = -1;
+    if (gdata->output == OUTPUT_FILE) {
+        openSpoolSegment();
+    } else if (gdata->output == OUTPUT_SHM) {
+        openShm();
+    }
+    if (gdata->capturePath != NULL) {
+        openCapture();
+    }
+    if (gdata->format == FORMAT_BINARY) {
+        writeHeader();
+    }
+    // attached to a live VM, Agent_OnAttach enables them once set up
+    if (!attached) {
+        enableEvents(jvmti);
     }
-    // setup socket connection to our server
-    initiateSocketConnection();
     // say all is well
     return JNI_OK;
 }
 
+/**
+ * Agent on load event first code to get executed
+ * @param vm
+ * @param options
+ * @param reserved
+ * @return
+ */
+JNIEXPORT jint JNICALL
+Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
+    return loadAgent(vm, options, JNI_FALSE);
+}
+
+/**
+ * Agent loaded into a running VM, e.g. with jcmd's JVMTI.agent_load. Does
+ * what VM start and init would have, and instruments classes already
+ * loaded. Loaded again once running, the options are commands instead:
+ * engage, disengage or snapshot.
+ * @param vm
+ * @param options
+ * @param reserved
+ * @return
+ */
+JNIEXPORT jint JNICALL
+Agent_OnAttach(JavaVM *vm, char *options, void *reserved) {
+    char command[MAX_TOKEN_LENGTH];
+    JNIEnv *env;
+    char *next;
+    jint res;
+
+    if (gdata != NULL) {
+        next = options == NULL ? NULL : get_token(options, ",", command, (int) sizeof (command));
+        while (next != NULL) {
+            runCommand(command);
+            next = get_token(next, ",", command, (int) sizeof (command));
+        }
+        return JNI_OK;
+    }
+    res = loadAgent(vm, options, JNI_TRUE);
+    if (res != JNI_OK) {
+        return res;
+    }
+    res = (*vm)->GetEnv(vm, (void **) &env, JNI_VERSION_1_2);
+    if (res != JNI_OK) {
+        fatal_error("ERROR: Unable to access JNI (%d)\n", res);
+    }
+    onVMStart(gdata->jvmti, env);
+    // drainer runs before any ring can fill up
+    onVMInit(gdata->jvmti, env, (jthread) NULL);
+    enableEvents(gdata->jvmti);
+    // needs the class file load hook enabled
+    retransformLoadedClasses(gdata->jvmti);
+    return JNI_OK;
+}
+
 /**
  * Agent is unloading
  * @param vm
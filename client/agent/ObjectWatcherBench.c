@@ -0,0 +1,882 @@
+/**
+ * Benchmark of the agent's hot path without a JVM: the agent is compiled in
+ * together with a fake jvmtiEnv and JNIEnv which hand out synthetic stack
+ * traces, method names and line tables. Worker threads allocate through the
+ * registered native newobj, free through ObjectFree and load classes through
+ * the ClassFileLoadHook, while the agent streams to a local sink socket. The
+ * sink asks for a heap snapshot every BENCH_SNAPSHOT_BYTES it reads.
+ *
+ *  ObjectWatcherBench [threads] [events per thread] [agent options]
+ *
+ * @author Jigar Joshi
+ */
+
+#include "ObjectWatcher.c"
+
+#include <pthread.h>
+#include <stdarg.h>
+
+// distinct synthetic methods, frames of a trace are consecutive ones
+#define BENCH_METHODS                           1024
+// distinct allocation sites per thread
+#define BENCH_SITES                             256
+// frames of a synthetic stack trace, the agent walks depth= of them
+#define BENCH_DEPTH                             96
+// top frames that differ between sites, the callers below are shared
+#define BENCH_SITE_FRAMES                       6
+// lines per synthetic method
+#define BENCH_LINES                             8
+// objects a thread keeps alive, the oldest one is freed on each allocation
+#define BENCH_LIVE_OBJECTS                      4096
+// classes each thread loads
+#define BENCH_CLASSES                           1000
+// classes of allocated objects, every fourth one is an array class
+#define BENCH_TYPES                             16
+// sink output between heap snapshot commands
+#define BENCH_SNAPSHOT_BYTES                    (4 * 1024 * 1024)
+#define BENCH_DEFAULT_THREADS                   4
+#define BENCH_DEFAULT_EVENTS                    1000000
+
+/**
+ * Fake java.lang.Thread, whatever the agent keeps in thread local storage
+ */
+typedef struct MockThread {
+    void *localStorage;
+    jvmtiStartFunction proc;
+    const void *arg;
+    pthread_t pthread;
+} MockThread;
+
+/**
+ * Fake Java object, the tag the agent sets lives right in it. Classes of
+ * allocated objects are objects too, the agent tags them as well.
+ */
+typedef struct MockObject {
+    jlong tag;
+    jlong size;
+    struct MockObject *klass;
+    // array length, if klass is an array class
+    jint length;
+} MockObject;
+
+/**
+ * Fake raw monitor, reentrant like JVMTI's
+ */
+typedef struct MockMonitor {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} MockMonitor;
+
+/**
+ * Latencies of one kind of event, in nanoseconds
+ */
+typedef struct BenchLatency {
+    jlong count;
+    jlong totalNanos;
+    jlong buckets[LATENCY_BUCKETS];
+} BenchLatency;
+
+/**
+ * State of one worker thread
+ */
+typedef struct BenchWorker {
+    int index;
+    // allocations to do, and done so far
+    jlong count;
+    jlong events;
+    MockThread thread;
+    MockObject *objects;
+    BenchLatency allocations;
+    BenchLatency frees;
+    BenchLatency classLoads;
+} BenchWorker;
+
+static struct {
+    jvmtiEventCallbacks callbacks;
+    void (JNICALL *newobj)(JNIEnv*, jclass, jthread, jobject);
+    char methodNames[BENCH_METHODS][32];
+    jvmtiLineNumberEntry lineTables[BENCH_METHODS][BENCH_LINES];
+    // class of method i is classes[i / 8]
+    int classes[BENCH_METHODS / 8];
+    MockObject types[BENCH_TYPES];
+    BenchWorker *workers;
+    int threads;
+    int sinkSocket;
+    volatile jlong sinkBytes;
+    volatile int sinkDone;
+    volatile int started;
+} bench;
+
+static __thread MockThread *currentThread;
+
+static JNIEnv mockEnv;
+static jvmtiEnv mockJvmti;
+
+/**
+ * Gets monotonic time in nanoseconds
+ * @return
+ */
+static jlong
+nanoTime() {
+    struct timespec now;
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+    return (jlong) now.tv_sec * NANOS_PER_SECOND + now.tv_nsec;
+}
+
+/**
+ * Counts one event which started at start
+ * @param latency
+ * @param start
+ */
+static void
+benchRecord(BenchLatency *latency, jlong start) {
+    jlong nanos;
+
+    nanos = nanoTime() - start;
+    latency->count++;
+    latency->totalNanos += nanos;
+    latency->buckets[histogramBucket(nanos, LATENCY_BUCKETS)]++;
+}
+
+/**
+ * Adds worker's latencies to the total
+ * @param total
+ * @param latency
+ */
+static void
+benchAdd(BenchLatency *total, BenchLatency *latency) {
+    int i;
+
+    total->count += latency->count;
+    total->totalNanos += latency->totalNanos;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        total->buckets[i] += latency->buckets[i];
+    }
+}
+
+/**
+ * Prints one kind of event's latency
+ * @param name
+ * @param latency
+ */
+static void
+benchPrint(const char *name, BenchLatency *latency) {
+    if (latency->count == 0) {
+        return;
+    }
+    printf("%-12s %10ld events, mean %6ld ns, p50 %6ld ns, p99 %8ld ns\n", name, latency->count,
+            latency->totalNanos / latency->count,
+            histogramPercentile(latency->buckets, LATENCY_BUCKETS, 50),
+            histogramPercentile(latency->buckets, LATENCY_BUCKETS, 99));
+}
+
+/**
+ * Returns the fake thread behind a jthread, the calling one for NULL
+ * @param thread
+ * @return
+ */
+static MockThread *
+mockThread(jthread thread) {
+    return thread == NULL ? currentThread : (MockThread*) thread;
+}
+
+/**
+ * Copies a string into JVMTI space
+ * @param str
+ * @return
+ */
+static char *
+mockString(const char *str) {
+    return strdup(str);
+}
+
+// jvmtiEnv
+
+static jvmtiError JNICALL
+mockSetEventNotificationMode(jvmtiEnv *jvmti, jvmtiEventMode mode, jvmtiEvent event, jthread thread, ...) {
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockRunAgentThread(jvmtiEnv *jvmti, jthread thread, jvmtiStartFunction proc, const void *arg, jint priority);
+
+static jvmtiError JNICALL
+mockSetThreadLocalStorage(jvmtiEnv *jvmti, jthread thread, const void *data) {
+    mockThread(thread)->localStorage = (void*) data;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockGetThreadLocalStorage(jvmtiEnv *jvmti, jthread thread, void **data) {
+    MockThread *mock;
+
+    mock = mockThread(thread);
+    if (mock == NULL) {
+        return JVMTI_ERROR_UNATTACHED_THREAD;
+    }
+    *data = mock->localStorage;
+    return JVMTI_ERROR_NONE;
+}
+
+/**
+ * Synthetic stack trace: BENCH_SITE_FRAMES consecutive methods starting at one
+ * picked by the worker's current site, called through a chain of methods
+ * shared by the worker's sites
+ */
+static jvmtiError JNICALL
+mockGetStackTrace(jvmtiEnv *jvmti, jthread thread, jint start, jint max, jvmtiFrameInfo *frames, jint *count) {
+    BenchWorker *worker;
+    int first;
+    int i;
+
+    worker = (BenchWorker*) mockThread(thread)->arg;
+    first = (int) ((worker->index * BENCH_SITES + worker->events % BENCH_SITES) * 7 % BENCH_METHODS);
+    for (i = 0; i < max && i < BENCH_DEPTH; i++) {
+        if (i < BENCH_SITE_FRAMES) {
+            frames[i].method = (jmethodID) &bench.methodNames[(first + i) % BENCH_METHODS];
+        } else {
+            frames[i].method = (jmethodID) &bench.methodNames[(worker->index * 31 + i) % BENCH_METHODS];
+        }
+        frames[i].location = (jlocation) (i * 4);
+    }
+    *count = i;
+    return JVMTI_ERROR_NONE;
+}
+
+/**
+ * Workers are named like the threads of an executor, all in group main
+ */
+static jvmtiError JNICALL
+mockGetThreadInfo(jvmtiEnv *jvmti, jthread thread, jvmtiThreadInfo *info) {
+    BenchWorker *worker;
+    char name[32];
+
+    worker = (BenchWorker*) mockThread(thread)->arg;
+    (void) snprintf(name, sizeof (name), "pool-1-thread-%d", worker == NULL ? 0 : worker->index + 1);
+    (void) memset(info, 0, sizeof (*info));
+    info->name = mockString(name);
+    info->thread_group = (jthreadGroup) &bench.classes[0];
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockGetThreadGroupInfo(jvmtiEnv *jvmti, jthreadGroup group, jvmtiThreadGroupInfo *info) {
+    (void) memset(info, 0, sizeof (*info));
+    info->name = mockString("main");
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockSetTag(jvmtiEnv *jvmti, jobject object, jlong tag) {
+    ((MockObject*) object)->tag = tag;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockGetTag(jvmtiEnv *jvmti, jobject object, jlong *tag) {
+    *tag = ((MockObject*) object)->tag;
+    return JVMTI_ERROR_NONE;
+}
+
+/**
+ * Walks the live objects of all workers and the classes, racing with the
+ * workers, where a JVM would stop them
+ */
+static jvmtiError JNICALL
+mockIterateThroughHeap(jvmtiEnv *jvmti, jint filter, jclass klass,
+        const jvmtiHeapCallbacks *callbacks, const void *userData) {
+    MockObject *object;
+    int i;
+    int j;
+
+    for (i = 0; i < BENCH_TYPES; i++) {
+        if (bench.types[i].tag != 0) {
+            callbacks->heap_iteration_callback(0, 0, &bench.types[i].tag, -1, (void*) userData);
+        }
+    }
+    for (i = 0; i < bench.threads && bench.started; i++) {
+        for (j = 0; j < BENCH_LIVE_OBJECTS; j++) {
+            object = &bench.workers[i].objects[j];
+            if (object->tag != 0) {
+                callbacks->heap_iteration_callback(object->klass->tag, object->size, &object->tag,
+                        object->length, (void*) userData);
+            }
+        }
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockForceGarbageCollection(jvmtiEnv *jvmti) {
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockGetObjectSize(jvmtiEnv *jvmti, jobject object, jlong *size) {
+    *size = ((MockObject*) object)->size;
+    return JVMTI_ERROR_NONE;
+}
+
+/**
+ * Returns index of a synthetic method
+ */
+static int
+mockMethodIndex(jmethodID method) {
+    return (int) (((char (*)[32]) method) - bench.methodNames);
+}
+
+static jvmtiError JNICALL
+mockGetMethodDeclaringClass(jvmtiEnv *jvmti, jmethodID method, jclass *klass) {
+    *klass = (jclass) &bench.classes[mockMethodIndex(method) / 8];
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockGetClassSignature(jvmtiEnv *jvmti, jclass klass, char **signature, char **generic) {
+    char buf[64];
+    int type;
+
+    type = (int) (((MockObject*) klass) - bench.types);
+    if (type >= 0 && type < BENCH_TYPES) {
+        (void) snprintf(buf, sizeof (buf), "%sLbench/Type%d;", type % 4 == 3 ? "[" : "", type);
+    } else {
+        (void) snprintf(buf, sizeof (buf), "Lbench/Class%d;", (int) (((int*) klass) - bench.classes));
+    }
+    *signature = mockString(buf);
+    if (generic != NULL) {
+        *generic = NULL;
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockGetSourceFileName(jvmtiEnv *jvmti, jclass klass, char **name) {
+    char buf[64];
+
+    (void) snprintf(buf, sizeof (buf), "Class%d.java", (int) (((int*) klass) - bench.classes));
+    *name = mockString(buf);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockGetMethodName(jvmtiEnv *jvmti, jmethodID method, char **name, char **signature, char **generic) {
+    *name = mockString(bench.methodNames[mockMethodIndex(method)]);
+    if (signature != NULL) {
+        *signature = mockString("()V");
+    }
+    if (generic != NULL) {
+        *generic = NULL;
+    }
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockIsMethodNative(jvmtiEnv *jvmti, jmethodID method, jboolean *isNative) {
+    *isNative = JNI_FALSE;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockGetLineNumberTable(jvmtiEnv *jvmti, jmethodID method, jint *count, jvmtiLineNumberEntry **table) {
+    *table = (jvmtiLineNumberEntry*) malloc(sizeof (bench.lineTables[0]));
+    (void) memcpy(*table, bench.lineTables[mockMethodIndex(method)], sizeof (bench.lineTables[0]));
+    *count = BENCH_LINES;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockCreateRawMonitor(jvmtiEnv *jvmti, const char *name, jrawMonitorID *monitor) {
+    pthread_mutexattr_t attr;
+    MockMonitor *mock;
+
+    mock = (MockMonitor*) calloc(1, sizeof (MockMonitor));
+    (void) pthread_mutexattr_init(&attr);
+    (void) pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    (void) pthread_mutex_init(&mock->mutex, &attr);
+    (void) pthread_cond_init(&mock->cond, NULL);
+    *monitor = (jrawMonitorID) mock;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockRawMonitorEnter(jvmtiEnv *jvmti, jrawMonitorID monitor) {
+    (void) pthread_mutex_lock(&((MockMonitor*) monitor)->mutex);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockRawMonitorExit(jvmtiEnv *jvmti, jrawMonitorID monitor) {
+    (void) pthread_mutex_unlock(&((MockMonitor*) monitor)->mutex);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockRawMonitorWait(jvmtiEnv *jvmti, jrawMonitorID monitor, jlong millis) {
+    MockMonitor *mock;
+    struct timespec deadline;
+
+    mock = (MockMonitor*) monitor;
+    if (millis <= 0) {
+        (void) pthread_cond_wait(&mock->cond, &mock->mutex);
+        return JVMTI_ERROR_NONE;
+    }
+    (void) clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += millis / 1000;
+    deadline.tv_nsec += (millis % 1000) * NANOS_PER_MILLI;
+    if (deadline.tv_nsec >= NANOS_PER_SECOND) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= NANOS_PER_SECOND;
+    }
+    (void) pthread_cond_timedwait(&mock->cond, &mock->mutex, &deadline);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockRawMonitorNotify(jvmtiEnv *jvmti, jrawMonitorID monitor) {
+    (void) pthread_cond_signal(&((MockMonitor*) monitor)->cond);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockRawMonitorNotifyAll(jvmtiEnv *jvmti, jrawMonitorID monitor) {
+    (void) pthread_cond_broadcast(&((MockMonitor*) monitor)->cond);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockSetEventCallbacks(jvmtiEnv *jvmti, const jvmtiEventCallbacks *callbacks, jint size) {
+    (void) memcpy(&bench.callbacks, callbacks, (size_t) size);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockGetExtensionEvents(jvmtiEnv *jvmti, jint *count, jvmtiExtensionEventInfo **events) {
+    *count = 0;
+    *events = NULL;
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockAllocate(jvmtiEnv *jvmti, jlong size, unsigned char **mem) {
+    *mem = (unsigned char*) malloc((size_t) size);
+    return *mem == NULL ? JVMTI_ERROR_OUT_OF_MEMORY : JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockDeallocate(jvmtiEnv *jvmti, unsigned char *mem) {
+    free(mem);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockGetErrorName(jvmtiEnv *jvmti, jvmtiError error, char **name) {
+    char buf[32];
+
+    (void) snprintf(buf, sizeof (buf), "error %d", (int) error);
+    *name = mockString(buf);
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockAddCapabilities(jvmtiEnv *jvmti, const jvmtiCapabilities *capabilities) {
+    return JVMTI_ERROR_NONE;
+}
+
+static jvmtiError JNICALL
+mockGetPotentialCapabilities(jvmtiEnv *jvmti, jvmtiCapabilities *capabilities) {
+    (void) memset(capabilities, 0, sizeof (*capabilities));
+    return JVMTI_ERROR_NONE;
+}
+
+// JNIEnv
+
+static jclass JNICALL
+mockFindClass(JNIEnv *env, const char *name) {
+    return (jclass) &bench.classes[0];
+}
+
+static jmethodID JNICALL
+mockGetMethodID(JNIEnv *env, jclass klass, const char *name, const char *signature) {
+    return (jmethodID) &bench.methodNames[0];
+}
+
+static jobject JNICALL
+mockNewObject(JNIEnv *env, jclass klass, jmethodID constructor, ...) {
+    return (jobject) calloc(1, sizeof (MockThread));
+}
+
+static jint JNICALL
+mockRegisterNatives(JNIEnv *env, jclass klass, const JNINativeMethod *methods, jint count) {
+    jint i;
+
+    for (i = 0; i < count; i++) {
+        if (strcmp(methods[i].name, STRING(HEAP_TRACKER_native_newobj)) == 0) {
+            bench.newobj = (void (JNICALL *)(JNIEnv*, jclass, jthread, jobject)) methods[i].fnPtr;
+        }
+    }
+    return 0;
+}
+
+static jclass JNICALL
+mockGetObjectClass(JNIEnv *env, jobject object) {
+    return (jclass) ((MockObject*) object)->klass;
+}
+
+static void JNICALL
+mockDeleteLocalRef(JNIEnv *env, jobject object) {
+}
+
+static jsize JNICALL
+mockGetArrayLength(JNIEnv *env, jarray array) {
+    return ((MockObject*) array)->length;
+}
+
+static jfieldID JNICALL
+mockGetStaticFieldID(JNIEnv *env, jclass klass, const char *name, const char *signature) {
+    return (jfieldID) &bench.classes[0];
+}
+
+static void JNICALL
+mockSetStaticIntField(JNIEnv *env, jclass klass, jfieldID field, jint value) {
+}
+
+// JavaVM
+
+static jint JNICALL
+mockGetEnv(JavaVM *vm, void **env, jint version) {
+    *env = (void*) &mockJvmti;
+    return JNI_OK;
+}
+
+static const struct jvmtiInterface_1_ mockJvmtiInterface = {
+    .SetEventNotificationMode = &mockSetEventNotificationMode,
+    .RunAgentThread = &mockRunAgentThread,
+    .SetThreadLocalStorage = &mockSetThreadLocalStorage,
+    .GetThreadLocalStorage = &mockGetThreadLocalStorage,
+    .GetStackTrace = &mockGetStackTrace,
+    .GetThreadInfo = &mockGetThreadInfo,
+    .GetThreadGroupInfo = &mockGetThreadGroupInfo,
+    .GetTag = &mockGetTag,
+    .SetTag = &mockSetTag,
+    .ForceGarbageCollection = &mockForceGarbageCollection,
+    .IterateThroughHeap = &mockIterateThroughHeap,
+    .GetObjectSize = &mockGetObjectSize,
+    .GetClassSignature = &mockGetClassSignature,
+    .GetSourceFileName = &mockGetSourceFileName,
+    .GetMethodName = &mockGetMethodName,
+    .GetMethodDeclaringClass = &mockGetMethodDeclaringClass,
+    .GetLineNumberTable = &mockGetLineNumberTable,
+    .IsMethodNative = &mockIsMethodNative,
+    .CreateRawMonitor = &mockCreateRawMonitor,
+    .RawMonitorEnter = &mockRawMonitorEnter,
+    .RawMonitorExit = &mockRawMonitorExit,
+    .RawMonitorWait = &mockRawMonitorWait,
+    .RawMonitorNotify = &mockRawMonitorNotify,
+    .RawMonitorNotifyAll = &mockRawMonitorNotifyAll,
+    .SetEventCallbacks = &mockSetEventCallbacks,
+    .GetExtensionEvents = &mockGetExtensionEvents,
+    .Allocate = &mockAllocate,
+    .Deallocate = &mockDeallocate,
+    .GetErrorName = &mockGetErrorName,
+    .AddCapabilities = &mockAddCapabilities,
+    .GetPotentialCapabilities = &mockGetPotentialCapabilities
+};
+
+static const struct JNINativeInterface_ mockEnvInterface = {
+    .FindClass = &mockFindClass,
+    .GetObjectClass = &mockGetObjectClass,
+    .DeleteLocalRef = &mockDeleteLocalRef,
+    .GetArrayLength = &mockGetArrayLength,
+    .GetMethodID = &mockGetMethodID,
+    .NewObject = &mockNewObject,
+    .RegisterNatives = &mockRegisterNatives,
+    .GetStaticFieldID = &mockGetStaticFieldID,
+    .SetStaticIntField = &mockSetStaticIntField
+};
+
+static const struct JNIInvokeInterface_ mockVmInterface = {
+    .GetEnv = &mockGetEnv
+};
+
+/**
+ * Body of an agent thread
+ * @param arg its MockThread
+ * @return
+ */
+static void *
+mockAgentThread(void *arg) {
+    MockThread *thread;
+
+    thread = (MockThread*) arg;
+    currentThread = thread;
+    thread->proc(&mockJvmti, &mockEnv, (void*) thread->arg);
+    return NULL;
+}
+
+static jvmtiError JNICALL
+mockRunAgentThread(jvmtiEnv *jvmti, jthread thread, jvmtiStartFunction proc, const void *arg, jint priority) {
+    MockThread *mock;
+
+    mock = (MockThread*) thread;
+    mock->proc = proc;
+    mock->arg = arg;
+    if (pthread_create(&mock->pthread, NULL, &mockAgentThread, mock) != 0) {
+        return JVMTI_ERROR_OUT_OF_MEMORY;
+    }
+    (void) pthread_detach(mock->pthread);
+    return JVMTI_ERROR_NONE;
+}
+
+/**
+ * Minimal class file of class bench/Loaded<n>, without members
+ * @param buf
+ * @param n
+ * @return length
+ */
+static int
+mockClassFile(unsigned char *buf, int n) {
+    char name[64];
+    int length;
+    int nameLength;
+    static const unsigned char prefix[] = {
+        0xca, 0xfe, 0xba, 0xbe, 0x00, 0x00, 0x00, 0x34, 0x00, 0x05
+    };
+    static const unsigned char superClass[] = {
+        0x07, 0x00, 0x01
+    };
+    static const unsigned char suffix[] = {
+        0x07, 0x00, 0x03, 0x00, 0x21, 0x00, 0x04, 0x00, 0x02,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+
+    // #1 java/lang/Object, #2 its class, #3 own name, #4 own class
+    nameLength = snprintf(name, sizeof (name), "bench/Loaded%d", n);
+    length = 0;
+    (void) memcpy(buf, prefix, sizeof (prefix));
+    length += (int) sizeof (prefix);
+    buf[length++] = 0x01;
+    buf[length++] = 0x00;
+    buf[length++] = 0x10;
+    (void) memcpy(buf + length, "java/lang/Object", 16);
+    length += 16;
+    (void) memcpy(buf + length, superClass, sizeof (superClass));
+    length += (int) sizeof (superClass);
+    buf[length++] = 0x01;
+    buf[length++] = (unsigned char) (nameLength >> 8);
+    buf[length++] = (unsigned char) nameLength;
+    (void) memcpy(buf + length, name, (size_t) nameLength);
+    length += nameLength;
+    (void) memcpy(buf + length, suffix, sizeof (suffix));
+    length += (int) sizeof (suffix);
+    return length;
+}
+
+/**
+ * Worker thread: loads its classes, then allocates events objects, each
+ * allocation once it wraps around freeing the object allocated
+ * BENCH_LIVE_OBJECTS earlier
+ * @param arg its BenchWorker
+ * @return
+ */
+static void *
+benchWorker(void *arg) {
+    BenchWorker *worker;
+    MockObject *object;
+    unsigned char classFile[256];
+    unsigned char *newClassFile;
+    char name[64];
+    jint newClassFileLength;
+    jint classFileLength;
+    jlong start;
+    jlong i;
+
+    worker = (BenchWorker*) arg;
+    worker->thread.arg = worker;
+    currentThread = &worker->thread;
+    while (!bench.started) {
+        sched_yield();
+    }
+
+    for (i = 0; i < BENCH_CLASSES; i++) {
+        classFileLength = mockClassFile(classFile, (int) (worker->index * BENCH_CLASSES + i));
+        (void) snprintf(name, sizeof (name), "bench/Loaded%d", (int) (worker->index * BENCH_CLASSES + i));
+        newClassFile = NULL;
+        newClassFileLength = 0;
+        start = nanoTime();
+        bench.callbacks.ClassFileLoadHook(&mockJvmti, &mockEnv, NULL, NULL, name, NULL,
+                classFileLength, classFile, &newClassFileLength, &newClassFile);
+        benchRecord(&worker->classLoads, start);
+        free(newClassFile);
+    }
+
+    for (worker->events = 0; worker->events < worker->count; worker->events++) {
+        object = &worker->objects[worker->events % BENCH_LIVE_OBJECTS];
+        if (object->tag != 0) {
+            start = nanoTime();
+            bench.callbacks.ObjectFree(&mockJvmti, object->tag);
+            benchRecord(&worker->frees, start);
+            object->tag = 0;
+        }
+        object->size = 16 + (worker->events % 8) * 8;
+        object->klass = &bench.types[worker->events % BENCH_TYPES];
+        object->length = (jint) (worker->events % 64);
+        start = nanoTime();
+        bench.newobj(&mockEnv, NULL, (jthread) &worker->thread, (jobject) object);
+        benchRecord(&worker->allocations, start);
+    }
+    bench.callbacks.ThreadEnd(&mockJvmti, &mockEnv, (jthread) &worker->thread);
+    return NULL;
+}
+
+/**
+ * Sink the agent streams to, reads and counts until the agent disconnects.
+ * Takes whatever codec the agent offers.
+ * @param arg
+ * @return
+ */
+static void *
+benchSink(void *arg) {
+    unsigned char buf[65536];
+    const char *answer;
+    jlong untilSnapshot;
+    ssize_t n;
+    int fd;
+
+    for (;;) {
+        fd = accept(bench.sinkSocket, NULL, NULL);
+        if (fd < 0) {
+            return NULL;
+        }
+        untilSnapshot = BENCH_SNAPSHOT_BYTES;
+        // the offer comes alone, the agent waits for the answer
+        n = read(fd, buf, sizeof (buf));
+        if (n >= 5 && memcmp(buf, FRAME_MAGIC, 3) == 0) {
+            answer = (buf[4] & (1 << CODEC_LZ4)) ? "codec lz4\n" : "codec none\n";
+            (void) write(fd, answer, strlen(answer));
+        }
+        for (; n > 0; n = read(fd, buf, sizeof (buf))) {
+            __sync_fetch_and_add(&bench.sinkBytes, n);
+            untilSnapshot -= n;
+            if (untilSnapshot <= 0) {
+                untilSnapshot = BENCH_SNAPSHOT_BYTES;
+                (void) write(fd, "snapshot\n", 9);
+            }
+        }
+        (void) close(fd);
+        bench.sinkDone = 1;
+    }
+}
+
+/**
+ * Opens the sink socket on an ephemeral local port
+ * @return port
+ */
+static int
+openSink() {
+    struct sockaddr_in address;
+    socklen_t length;
+    pthread_t sink;
+
+    bench.sinkSocket = socket(AF_INET, SOCK_STREAM, 0);
+    (void) memset(&address, 0, sizeof (address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = inet_addr("127.0.0.1");
+    address.sin_port = 0;
+    length = sizeof (address);
+    if (bench.sinkSocket < 0
+            || bind(bench.sinkSocket, (struct sockaddr*) &address, sizeof (address)) != 0
+            || listen(bench.sinkSocket, 4) != 0
+            || getsockname(bench.sinkSocket, (struct sockaddr*) &address, &length) != 0) {
+        fatal_error("ERROR: Cannot open sink socket\n");
+    }
+    (void) pthread_create(&sink, NULL, &benchSink, NULL);
+    (void) pthread_detach(sink);
+    return ntohs(address.sin_port);
+}
+
+int
+main(int argc, char **argv) {
+    BenchWorker *workers;
+    BenchLatency allocations;
+    BenchLatency frees;
+    BenchLatency classLoads;
+    JavaVM vm;
+    MockThread mainThread;
+    char options[1024];
+    jlong events;
+    jlong elapsed;
+    jlong start;
+    int threads;
+    int i;
+    int j;
+
+    threads = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_THREADS;
+    events = argc > 2 ? atol(argv[2]) : BENCH_DEFAULT_EVENTS;
+    if (threads <= 0 || events <= 0) {
+        fatal_error("usage: %s [threads] [events per thread] [agent options]\n", argv[0]);
+    }
+
+    for (i = 0; i < BENCH_METHODS; i++) {
+        (void) snprintf(bench.methodNames[i], sizeof (bench.methodNames[i]), "method%d", i);
+        for (j = 0; j < BENCH_LINES; j++) {
+            bench.lineTables[i][j].start_location = j * 8;
+            bench.lineTables[i][j].line_number = 10 * i + j;
+        }
+    }
+    mockEnv = &mockEnvInterface;
+    mockJvmti = &mockJvmtiInterface;
+    vm = &mockVmInterface;
+    (void) memset(&mainThread, 0, sizeof (mainThread));
+    currentThread = &mainThread;
+
+    (void) snprintf(options, sizeof (options), "server=127.0.0.1,port=%d%s%s", openSink(),
+            argc > 3 ? "," : "", argc > 3 ? argv[3] : "");
+    if (Agent_OnLoad(&vm, options, NULL) != JNI_OK) {
+        fatal_error("ERROR: Agent_OnLoad failed\n");
+    }
+    bench.callbacks.VMStart(&mockJvmti, &mockEnv);
+    bench.callbacks.VMInit(&mockJvmti, &mockEnv, (jthread) &mainThread);
+    if (bench.newobj == NULL) {
+        fatal_error("ERROR: agent registered no newobj native\n");
+    }
+
+    workers = (BenchWorker*) calloc((size_t) threads, sizeof (BenchWorker));
+    bench.workers = workers;
+    bench.threads = threads;
+    for (i = 0; i < threads; i++) {
+        workers[i].index = i;
+        workers[i].count = events;
+        workers[i].objects = (MockObject*) calloc(BENCH_LIVE_OBJECTS, sizeof (MockObject));
+        (void) pthread_create(&workers[i].thread.pthread, NULL, &benchWorker, &workers[i]);
+    }
+    start = nanoTime();
+    bench.started = 1;
+    for (i = 0; i < threads; i++) {
+        (void) pthread_join(workers[i].thread.pthread, NULL);
+    }
+    elapsed = nanoTime() - start;
+    bench.callbacks.VMDeath(&mockJvmti, &mockEnv);
+    // the sender is gone, give the sink a moment to read the rest
+    for (i = 0; i < 1000 && !bench.sinkDone && gdata->output == OUTPUT_SOCKET; i++) {
+        (void) usleep(1000);
+    }
+
+    (void) memset(&allocations, 0, sizeof (allocations));
+    (void) memset(&frees, 0, sizeof (frees));
+    (void) memset(&classLoads, 0, sizeof (classLoads));
+    for (i = 0; i < threads; i++) {
+        benchAdd(&allocations, &workers[i].allocations);
+        benchAdd(&frees, &workers[i].frees);
+        benchAdd(&classLoads, &workers[i].classLoads);
+    }
+    events = allocations.count + frees.count + classLoads.count;
+    printf("\n%d threads, %ld events in %ld ms\n", threads, events, (jlong) (elapsed / NANOS_PER_MILLI));
+    printf("throughput   %10.0f events/sec\n", events * (double) NANOS_PER_SECOND / elapsed);
+    printf("cost         %10.1f ns/event per thread\n",
+            (double) (allocations.totalNanos + frees.totalNanos + classLoads.totalNanos) / events);
+    benchPrint("allocation", &allocations);
+    benchPrint("free", &frees);
+    benchPrint("classLoad", &classLoads);
+    printf("sink         %10ld bytes\n", bench.sinkBytes);
+    return 0;
+}
@@ -14,6 +14,7 @@ import java.net.Socket;
 import org.slf4j.Logger;
 
 import jj.jvminspector.jvmheapsearcher.handler.RequestHandler;
+import jj.jvminspector.jvmheapsearcher.handler.ShmHandler;
 
 
 public class SocketServer extends Thread {
@@ -56,6 +57,11 @@ public class SocketServer extends Thread {
 		SocketServer server = new SocketServer(appConfig);
 		server.startServer();
 		log.info("server started");
+		String shmName = appConfig.getString("shm.name", "");
+		if (!shmName.isEmpty()) {
+			log.info("reading shared memory ring /dev/shm/{}", shmName);
+			new ShmHandler(shmName, appConfig).start();
+		}
 	}
 }
 
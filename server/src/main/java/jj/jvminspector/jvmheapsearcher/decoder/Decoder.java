@@ -0,0 +1,15 @@
+package jj.jvminspector.jvmheapsearcher.decoder;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import java.io.IOException;
+
+import jj.jvminspector.jvmheapsearcher.model.Event;
+
+public interface Decoder {
+	/**
+	 * @return next line or snapshot of the stream, null at end of stream
+	 */
+	Event next() throws IOException;
+}
@@ -0,0 +1,41 @@
+package jj.jvminspector.jvmheapsearcher.decoder;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import java.io.BufferedInputStream;
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.PushbackInputStream;
+import java.util.Arrays;
+
+import jj.jvminspector.jvmheapsearcher.decoder.impl.BinaryDecoder;
+import jj.jvminspector.jvmheapsearcher.decoder.impl.TextDecoder;
+
+public class DecoderFactory {
+	/**
+	 * Binary streams start with {@link BinaryDecoder#MAGIC}, anything else is the text format
+	 */
+	public static Decoder getDecoder(InputStream inputStream) throws IOException {
+		PushbackInputStream in = new PushbackInputStream(new BufferedInputStream(inputStream),
+				BinaryDecoder.MAGIC.length);
+		byte[] header = new byte[BinaryDecoder.MAGIC.length];
+		int length = 0;
+		while (length < header.length) {
+			int read = in.read(header, length, header.length - length);
+			if (read < 0) {
+				break;
+			}
+			length += read;
+		}
+		if (length == header.length && Arrays.equals(header, BinaryDecoder.MAGIC)) {
+			int version = in.read();
+			if (version < 1 || version > BinaryDecoder.VERSION) {
+				throw new IOException("unsupported wire version " + version);
+			}
+			return new BinaryDecoder(in, version);
+		}
+		in.unread(header, 0, length);
+		return new TextDecoder(in);
+	}
+}
@@ -0,0 +1,230 @@
+package jj.jvminspector.jvmheapsearcher.decoder;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import java.io.BufferedInputStream;
+import java.io.EOFException;
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.PrintWriter;
+import java.io.PushbackInputStream;
+import java.util.Arrays;
+
+/**
+ * Unwraps the frames of an agent started with compress=, handing out the stream the
+ * agent encoded. Each frame is a codec byte, varint length of the encoded bytes, varint
+ * length of the payload and the payload, either those bytes as they are or an LZ4 block.
+ * <p>
+ * The agent offers compression with {@link #MAGIC}, a version byte and a bitmask of the
+ * codecs it has, ahead of everything else on the connection, and waits for a
+ * "codec &lt;name&gt;" command naming the one to use.
+ */
+public class FrameInputStream extends InputStream {
+	public static final byte[] MAGIC = {'J', 'O', 'Z'};
+	public static final int VERSION = 1;
+	public static final int CODEC_NONE = 0;
+	public static final int CODEC_LZ4 = 1;
+	private static final int MAX_FRAME = 64 * 1024 * 1024;
+	private static final int MIN_MATCH = 4;
+
+	private final InputStream in;
+	private byte[] frame = new byte[0];
+	private byte[] payload = new byte[0];
+	private int position;
+	private int limit;
+
+	public FrameInputStream(InputStream inputStream) {
+		this.in = inputStream;
+	}
+
+	/**
+	 * Answers the agent's compression offer, if it made one
+	 * @param answers where commands to the agent go, shared with others writing to it
+	 * @param compression false to have the agent send frames as they are
+	 * @return stream of what the agent encoded
+	 */
+	public static InputStream negotiate(InputStream inputStream, PrintWriter answers, boolean compression)
+			throws IOException {
+		PushbackInputStream in = new PushbackInputStream(new BufferedInputStream(inputStream), MAGIC.length);
+		byte[] header = new byte[MAGIC.length];
+		int length = 0;
+		while (length < header.length) {
+			int read = in.read(header, length, header.length - length);
+			if (read < 0) {
+				break;
+			}
+			length += read;
+		}
+		if (length < header.length || !Arrays.equals(header, MAGIC)) {
+			in.unread(header, 0, length);
+			return in;
+		}
+		int version = in.read();
+		int codecs = in.read();
+		if (version != VERSION || codecs < 0) {
+			throw new IOException("unsupported frame version " + version);
+		}
+		boolean lz4 = compression && (codecs & (1 << CODEC_LZ4)) != 0;
+		synchronized (answers) {
+			answers.print(lz4 ? "codec lz4\n" : "codec none\n");
+			answers.flush();
+		}
+		return new FrameInputStream(in);
+	}
+
+	@Override
+	public int read() throws IOException {
+		if (position == limit && !nextFrame()) {
+			return -1;
+		}
+		return frame[position++] & 0xff;
+	}
+
+	@Override
+	public int read(byte[] b, int off, int len) throws IOException {
+		if (len == 0) {
+			return 0;
+		}
+		if (position == limit && !nextFrame()) {
+			return -1;
+		}
+		int n = Math.min(len, limit - position);
+		System.arraycopy(frame, position, b, off, n);
+		position += n;
+		return n;
+	}
+
+	@Override
+	public int available() {
+		return limit - position;
+	}
+
+	@Override
+	public void close() throws IOException {
+		in.close();
+	}
+
+	/**
+	 * Reads and decodes the next frame into {@link #frame}
+	 * @return false at end of stream
+	 */
+	private boolean nextFrame() throws IOException {
+		int codec = in.read();
+		if (codec < 0) {
+			return false;
+		}
+		int rawLength = readLength();
+		int payloadLength = readLength();
+		if (payload.length < payloadLength) {
+			payload = new byte[payloadLength];
+		}
+		readFully(payload, payloadLength);
+		if (frame.length < rawLength) {
+			frame = new byte[rawLength];
+		}
+		if (codec == CODEC_NONE) {
+			if (payloadLength != rawLength) {
+				throw new IOException("frame of " + payloadLength + " bytes, expected " + rawLength);
+			}
+			System.arraycopy(payload, 0, frame, 0, rawLength);
+		} else if (codec == CODEC_LZ4) {
+			decompress(payloadLength, rawLength);
+		} else {
+			throw new IOException("unknown frame codec " + codec);
+		}
+		position = 0;
+		limit = rawLength;
+		return true;
+	}
+
+	/**
+	 * Decodes an LZ4 block of sequences, each literals then a match copied from the
+	 * bytes decoded so far, into exactly rawLength bytes of {@link #frame}
+	 */
+	private void decompress(int payloadLength, int rawLength) throws IOException {
+		int src = 0;
+		int dst = 0;
+		while (true) {
+			int token = payloadByte(src++, payloadLength);
+			int literals = token >>> 4;
+			// lengths stop adding up past the frame, before they overflow
+			if (literals == 15) {
+				int b;
+				do {
+					b = payloadByte(src++, payloadLength);
+					literals += b;
+				} while (b == 255 && literals <= rawLength);
+			}
+			if (literals > payloadLength - src || literals > rawLength - dst) {
+				throw new IOException("corrupt LZ4 frame");
+			}
+			System.arraycopy(payload, src, frame, dst, literals);
+			src += literals;
+			dst += literals;
+			if (src == payloadLength) {
+				break;
+			}
+			int offset = payloadByte(src, payloadLength) | payloadByte(src + 1, payloadLength) << 8;
+			src += 2;
+			int match = token & 0x0f;
+			if (match == 15) {
+				int b;
+				do {
+					b = payloadByte(src++, payloadLength);
+					match += b;
+				} while (b == 255 && match <= rawLength);
+			}
+			match += MIN_MATCH;
+			if (offset == 0 || offset > dst || match > rawLength - dst) {
+				throw new IOException("corrupt LZ4 frame");
+			}
+			// may overlap what it copies
+			for (int from = dst - offset, end = dst + match; dst < end; ) {
+				frame[dst++] = frame[from++];
+			}
+		}
+		if (dst != rawLength) {
+			throw new IOException("LZ4 frame of " + dst + " bytes, expected " + rawLength);
+		}
+	}
+
+	/**
+	 * @return byte of the payload, which is reused and holds stale bytes past the frame
+	 */
+	private int payloadByte(int index, int payloadLength) throws IOException {
+		if (index >= payloadLength) {
+			throw new IOException("corrupt LZ4 frame");
+		}
+		return payload[index] & 0xff;
+	}
+
+	private int readLength() throws IOException {
+		long value = 0;
+		int shift = 0;
+		int b;
+		do {
+			b = in.read();
+			if (b < 0) {
+				throw new EOFException("truncated frame header");
+			}
+			value |= (long) (b & 0x7f) << shift;
+			shift += 7;
+		} while ((b & 0x80) != 0 && shift < 64);
+		if (value > MAX_FRAME) {
+			throw new IOException("frame of " + value + " bytes");
+		}
+		return (int) value;
+	}
+
+	private void readFully(byte[] buffer, int length) throws IOException {
+		int read = 0;
+		while (read < length) {
+			int n = in.read(buffer, read, length - read);
+			if (n < 0) {
+				throw new EOFException("truncated frame");
+			}
+			read += n;
+		}
+	}
+}
@@ -0,0 +1,231 @@
+package jj.jvminspector.jvmheapsearcher.decoder;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import com.lithium.flow.util.Logs;
+
+import java.util.ArrayList;
+import java.util.Collections;
+import java.util.HashMap;
+import java.util.List;
+import java.util.Map;
+
+import org.slf4j.Logger;
+
+import jj.jvminspector.jvmheapsearcher.model.HeapSnapshot;
+import jj.jvminspector.jvmheapsearcher.model.IdRanges;
+import jj.jvminspector.jvmheapsearcher.model.Line;
+import jj.jvminspector.jvmheapsearcher.model.SiteLifetimes;
+import jj.jvminspector.jvmheapsearcher.model.SiteSnapshot;
+import jj.jvminspector.jvmheapsearcher.model.StackTraceElement;
+import jj.jvminspector.jvmheapsearcher.model.ThreadSnapshot;
+
+/**
+ * Frame, trace, class and thread definitions an agent has sent on one connection, along with
+ * running totals of aggregate snapshots and lifetime histograms per site and of allocations per
+ * thread, and the last heap snapshot
+ */
+public class TraceTable {
+	private static final Logger log = Logs.getLogger();
+	private final Map<Long, List<StackTraceElement>> traces = new HashMap<>();
+	private final Map<Long, FrameNode> frames = new HashMap<>();
+	// live count, live bytes
+	private final Map<Long, long[]> totals = new HashMap<>();
+	private final Map<Long, SiteLifetimes> lifetimes = new HashMap<>();
+	private final Map<Long, String> classes = new HashMap<>();
+	private final Map<Long, ThreadIdentity> threads = new HashMap<>();
+	// allocated, allocated bytes
+	private final Map<Long, long[]> threadTotals = new HashMap<>();
+	private HeapSnapshot pendingHeapSnapshot;
+	private HeapSnapshot lastHeapSnapshot;
+
+	public void define(long traceId, List<StackTraceElement> trace) {
+		traces.put(traceId, trace);
+	}
+
+	/**
+	 * Defines a node of the agent's frame trie, called from the parent node, 0 for none
+	 */
+	public void defineFrame(long nodeId, long parentId, StackTraceElement frame) {
+		frames.put(nodeId, new FrameNode(parentId, frame));
+	}
+
+	/**
+	 * Defines a trace as the frames from the node up through its callers, node 0 for an
+	 * empty trace
+	 */
+	public void defineNode(long traceId, long nodeId) {
+		List<StackTraceElement> trace = new ArrayList<>();
+		while (nodeId != 0) {
+			FrameNode node = frames.get(nodeId);
+			if (node == null) {
+				log.warn("unknown frame id {} in trace {}", nodeId, traceId);
+				break;
+			}
+			trace.add(node.frame);
+			nodeId = node.parentId;
+		}
+		traces.put(traceId, trace);
+	}
+
+	public void defineClass(long classId, String signature) {
+		classes.put(classId, signature);
+	}
+
+	/**
+	 * @return JVM signature of the class, null if the agent could not resolve it
+	 */
+	public String resolveClass(long classId) {
+		if (classId == 0) {
+			return null;
+		}
+		String signature = classes.get(classId);
+		if (signature == null) {
+			log.warn("unknown class id {}", classId);
+		}
+		return signature;
+	}
+
+	/**
+	 * Defines a thread, again if it was renamed before it ended. The agent sends empty
+	 * names for what it could not resolve.
+	 */
+	public void defineThread(long threadId, String name, String group) {
+		threads.put(threadId, new ThreadIdentity(name.isEmpty() ? null : name, group.isEmpty() ? null : group));
+	}
+
+	/**
+	 * Sets the allocating thread of the line, thread 0 for unknown
+	 */
+	public void attributeThread(Line line, long threadId) {
+		line.setThreadId(threadId);
+		if (threadId == 0) {
+			return;
+		}
+		ThreadIdentity thread = threads.get(threadId);
+		if (thread == null) {
+			log.warn("unknown thread id {}", threadId);
+			return;
+		}
+		line.setThreadName(thread.name);
+		line.setThreadGroup(thread.group);
+	}
+
+	/**
+	 * Adds a thread's allocations since its previous snapshot
+	 * @return the interval's allocations along with the thread's running totals
+	 */
+	public ThreadSnapshot threadSnapshot(long time, long threadId, long allocated, long allocatedBytes) {
+		long[] total = threadTotals.computeIfAbsent(threadId, id -> new long[2]);
+		total[0] += allocated;
+		total[1] += allocatedBytes;
+
+		ThreadSnapshot snapshot = new ThreadSnapshot();
+		snapshot.setTime(time);
+		snapshot.setThreadId(threadId);
+		ThreadIdentity thread = threads.get(threadId);
+		if (thread != null) {
+			snapshot.setThreadName(thread.name);
+			snapshot.setThreadGroup(thread.group);
+		}
+		snapshot.setAllocated(allocated);
+		snapshot.setAllocatedBytes(allocatedBytes);
+		snapshot.setTotalAllocated(total[0]);
+		snapshot.setTotalBytes(total[1]);
+		return snapshot;
+	}
+
+	public List<StackTraceElement> resolve(long traceId) {
+		List<StackTraceElement> trace = traces.get(traceId);
+		if (trace == null) {
+			log.warn("unknown trace id {}", traceId);
+			return Collections.emptyList();
+		}
+		return trace;
+	}
+
+	public SiteSnapshot snapshot(long time, long traceId, long allocated, long freed, long liveBytesDelta) {
+		long[] total = totals.computeIfAbsent(traceId, id -> new long[2]);
+		total[0] += allocated - freed;
+		total[1] += liveBytesDelta;
+
+		SiteSnapshot snapshot = new SiteSnapshot();
+		snapshot.setTime(time);
+		snapshot.setTraceId(traceId);
+		snapshot.setAllocated(allocated);
+		snapshot.setFreed(freed);
+		snapshot.setLiveCount(total[0]);
+		snapshot.setLiveBytes(total[1]);
+		snapshot.setStackTraceElementList(resolve(traceId));
+		return snapshot;
+	}
+
+	/**
+	 * Adds bucket counts reported since the previous report
+	 * @return running histograms of the site
+	 */
+	public SiteLifetimes lifetimes(long time, long traceId, long[] nanosDelta, long[] gcCyclesDelta) {
+		SiteLifetimes total = lifetimes.computeIfAbsent(traceId, id -> {
+			SiteLifetimes siteLifetimes = new SiteLifetimes();
+			siteLifetimes.setTraceId(id);
+			siteLifetimes.setStackTraceElementList(resolve(id));
+			return siteLifetimes;
+		});
+		total.setTime(time);
+		for (int i = 0; i < nanosDelta.length; i++) {
+			total.getNanos()[i] += nanosDelta[i];
+		}
+		for (int i = 0; i < gcCyclesDelta.length; i++) {
+			total.getGcCycles()[i] += gcCyclesDelta[i];
+		}
+		return total;
+	}
+
+	/**
+	 * Adds one part of a heap snapshot
+	 * @return the snapshot diffed against the previous one once its last part is in, null before
+	 */
+	public HeapSnapshot heapSnapshot(long time, long sequence, long count, IdRanges part, boolean last) {
+		if (pendingHeapSnapshot == null || pendingHeapSnapshot.getSequence() != sequence) {
+			if (pendingHeapSnapshot != null) {
+				log.warn("heap snapshot {} is missing parts", pendingHeapSnapshot.getSequence());
+			}
+			pendingHeapSnapshot = new HeapSnapshot();
+			pendingHeapSnapshot.setTime(time);
+			pendingHeapSnapshot.setSequence(sequence);
+		}
+		pendingHeapSnapshot.getLive().addAll(part);
+		if (!last) {
+			return null;
+		}
+		HeapSnapshot snapshot = pendingHeapSnapshot;
+		pendingHeapSnapshot = null;
+		if (snapshot.getLive().getCount() != count) {
+			log.warn("heap snapshot {} has {} ids instead of {}", sequence, snapshot.getLive().getCount(), count);
+		}
+		snapshot.diff(lastHeapSnapshot);
+		lastHeapSnapshot = snapshot;
+		return snapshot;
+	}
+
+	private static class ThreadIdentity {
+		final String name;
+		final String group;
+
+		ThreadIdentity(String name, String group) {
+			this.name = name;
+			this.group = group;
+		}
+	}
+
+	private static class FrameNode {
+		final long parentId;
+		final StackTraceElement frame;
+
+		FrameNode(long parentId, StackTraceElement frame) {
+			this.parentId = parentId;
+			this.frame = frame;
+		}
+	}
+}
@@ -0,0 +1,385 @@
+package jj.jvminspector.jvmheapsearcher.decoder.impl;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import com.lithium.flow.util.Logs;
+
+import java.io.EOFException;
+import java.io.IOException;
+import java.io.InputStream;
+import java.nio.charset.StandardCharsets;
+import java.util.ArrayDeque;
+import java.util.ArrayList;
+import java.util.List;
+
+import org.slf4j.Logger;
+
+import jj.jvminspector.jvmheapsearcher.decoder.Decoder;
+import jj.jvminspector.jvmheapsearcher.decoder.TraceTable;
+import jj.jvminspector.jvmheapsearcher.model.AgentStats;
+import jj.jvminspector.jvmheapsearcher.model.Event;
+import jj.jvminspector.jvmheapsearcher.model.HeapSnapshot;
+import jj.jvminspector.jvmheapsearcher.model.IdRanges;
+import jj.jvminspector.jvmheapsearcher.model.Line;
+import jj.jvminspector.jvmheapsearcher.model.ObjectType;
+import jj.jvminspector.jvmheapsearcher.model.SiteLifetimes;
+import jj.jvminspector.jvmheapsearcher.model.StackTraceElement;
+
+/**
+ * Decodes the agent's binary format: a {@link #MAGIC} + version header followed by
+ * varint length prefixed records. Ids are varints, times are zigzag encoded deltas
+ * against the previous time on the stream. Unknown record types are skipped.
+ * <p>
+ * Version 2 appends the sampling weight to create records, version 3 reports frees
+ * in batches per GC cycle, version 4 adds aggregate mode snapshots, version 5 adds the
+ * object size to creates and site, size, allocation time and weight to batched frees,
+ * version 6 adds reports of events the agent dropped, version 7 switches times from
+ * milliseconds to nanoseconds and adds lifetime histograms. Times are handed out in
+ * nanoseconds regardless of version. Version 8 adds the agent's overhead stats,
+ * version 9 adds class definitions, the class and array length to creates and the class
+ * to batched frees, version 10 adds heap snapshots, version 11 sends frames as nodes of a
+ * trie of callers and traces as the node of their top frame, version 12 adds the bytes
+ * encoded before compression to the overhead stats, version 13 adds thread definitions,
+ * the allocating thread to creates and batched frees, and per thread snapshots.
+ */
+public class BinaryDecoder implements Decoder {
+	public static final byte[] MAGIC = {'J', 'O', 'I'};
+	public static final int VERSION = 13;
+
+	private static final int RECORD_TRACE = 1;
+	private static final int RECORD_CREATE = 2;
+	private static final int RECORD_FREE = 3;
+	private static final int RECORD_FREE_BATCH = 4;
+	private static final int RECORD_SNAPSHOT = 5;
+	private static final int RECORD_DROPS = 6;
+	private static final int RECORD_LIFETIMES = 7;
+	private static final int RECORD_STATS = 8;
+	private static final int RECORD_CLASS = 9;
+	private static final int RECORD_HEAP_SNAPSHOT = 10;
+	private static final int RECORD_FRAME = 11;
+	private static final int RECORD_THREAD = 12;
+	private static final int RECORD_THREAD_SNAPSHOT = 13;
+	private static final long NANOS_PER_MILLI = 1000000L;
+
+	private static final Logger log = Logs.getLogger();
+	private final InputStream in;
+	private final int version;
+	private final TraceTable traces = new TraceTable();
+	private final ArrayDeque<Event> pending = new ArrayDeque<>();
+	private long lastTime;
+	private byte[] record = new byte[256];
+	private int position;
+	private int limit;
+
+	public BinaryDecoder(InputStream inputStream, int version) {
+		this.in = inputStream;
+		this.version = version;
+	}
+
+	@Override
+	public Event next() throws IOException {
+		if (!pending.isEmpty()) {
+			return pending.poll();
+		}
+		while (readRecord()) {
+			int type = record[position++] & 0xff;
+			switch (type) {
+				case RECORD_TRACE:
+					readTrace();
+					break;
+				case RECORD_FRAME:
+					traces.defineFrame(readVarint(), readVarint(), readStackTraceElement());
+					break;
+				case RECORD_CLASS:
+					traces.defineClass(readVarint(), readString());
+					break;
+				case RECORD_THREAD:
+					traces.defineThread(readVarint(), readString(), readString());
+					break;
+				case RECORD_THREAD_SNAPSHOT:
+					return traces.threadSnapshot(readTime(), readVarint(), readVarint(), readVarint());
+				case RECORD_HEAP_SNAPSHOT:
+					HeapSnapshot heapSnapshot = readHeapSnapshot();
+					if (heapSnapshot != null) {
+						return heapSnapshot;
+					}
+					break;
+				case RECORD_CREATE:
+					return readCreate();
+				case RECORD_FREE:
+					return readFree();
+				case RECORD_FREE_BATCH:
+					readFreeBatch();
+					if (!pending.isEmpty()) {
+						return pending.poll();
+					}
+					break;
+				case RECORD_SNAPSHOT:
+					readSnapshot();
+					if (!pending.isEmpty()) {
+						return pending.poll();
+					}
+					break;
+				case RECORD_DROPS:
+					readDrops();
+					break;
+				case RECORD_STATS:
+					log.info("{}", readStats());
+					break;
+				case RECORD_LIFETIMES:
+					readLifetimes();
+					if (!pending.isEmpty()) {
+						return pending.poll();
+					}
+					break;
+				default:
+					log.warn("skipping unknown record type {}", type);
+			}
+		}
+		return null;
+	}
+
+	private void readTrace() {
+		long traceId = readVarint();
+		if (version >= 11) {
+			traces.defineNode(traceId, readVarint());
+			return;
+		}
+		int frameCount = (int) readVarint();
+		List<StackTraceElement> trace = new ArrayList<>(frameCount);
+		for (int i = 0; i < frameCount; i++) {
+			trace.add(readStackTraceElement());
+		}
+		traces.define(traceId, trace);
+	}
+
+	private StackTraceElement readStackTraceElement() {
+		StackTraceElement stackTraceElement = new StackTraceElement();
+		stackTraceElement.setClassSignature(readString());
+		stackTraceElement.setMethodName(readString());
+		stackTraceElement.setMethodLineNumber((int) readVarint());
+		stackTraceElement.setFileName(readString());
+		stackTraceElement.setLineNumber((int) readVarint());
+		return stackTraceElement;
+	}
+
+	private Line readCreate() {
+		Line line = new Line();
+		line.setCreated(true);
+		line.setId(readVarint());
+		line.setObjectType(ObjectType.fromFlavor(record[position++]));
+		line.setCreateTime(readTime());
+		line.setTraceId(readVarint());
+		if (version >= 2) {
+			line.setWeight(readVarint());
+		}
+		if (version >= 5) {
+			line.setSize(readVarint());
+		}
+		if (version >= 9) {
+			line.setClassName(traces.resolveClass(readVarint()));
+			// sent plus one, 0 for plain objects
+			line.setArrayLength((int) readVarint() - 1);
+		}
+		if (version >= 13) {
+			traces.attributeThread(line, readVarint());
+		}
+		line.setStackTraceElementList(traces.resolve(line.getTraceId()));
+		return line;
+	}
+
+	private Line readFree() {
+		Line line = new Line();
+		line.setCreated(false);
+		line.setId(readVarint());
+		line.setDestroyTime(readTime());
+		return line;
+	}
+
+	private void readFreeBatch() {
+		long gcEpoch = readVarint();
+		long time = readTime();
+		long count = readVarint();
+		long id = 0;
+		long createTime = 0;
+		for (long i = 0; i < count; i++) {
+			long zigzag = readVarint();
+			id += (zigzag >>> 1) ^ -(zigzag & 1);
+			Line line = new Line();
+			line.setCreated(false);
+			line.setId(id);
+			line.setDestroyTime(time);
+			line.setGcEpoch(gcEpoch);
+			if (version >= 5) {
+				line.setTraceId(readVarint());
+				line.setSize(readVarint());
+				zigzag = readVarint();
+				createTime += (zigzag >>> 1) ^ -(zigzag & 1);
+				line.setCreateTime(toNanos(createTime));
+				line.setWeight(readVarint());
+				line.setStackTraceElementList(traces.resolve(line.getTraceId()));
+			}
+			if (version >= 9) {
+				line.setClassName(traces.resolveClass(readVarint()));
+			}
+			if (version >= 13) {
+				traces.attributeThread(line, readVarint());
+			}
+			pending.add(line);
+		}
+	}
+
+	private void readSnapshot() {
+		long time = readTime();
+		while (position < limit) {
+			long traceId = readVarint();
+			long allocated = readVarint();
+			long freed = readVarint();
+			long zigzag = readVarint();
+			long liveBytesDelta = (zigzag >>> 1) ^ -(zigzag & 1);
+			pending.add(traces.snapshot(time, traceId, allocated, freed, liveBytesDelta));
+		}
+	}
+
+	private void readLifetimes() {
+		long time = readTime();
+		while (position < limit) {
+			long traceId = readVarint();
+			long[] nanos = readHistogram(SiteLifetimes.LIFETIME_BUCKETS);
+			long[] gcCycles = readHistogram(SiteLifetimes.GC_CYCLE_BUCKETS);
+			pending.add(traces.lifetimes(time, traceId, nanos, gcCycles));
+		}
+	}
+
+	/**
+	 * Reads a part of a heap snapshot: runs of consecutive ids as gap since the end of the
+	 * previous run, and length
+	 * @return the snapshot once its last part is read, null before
+	 */
+	private HeapSnapshot readHeapSnapshot() {
+		long sequence = readVarint();
+		long time = readTime();
+		long count = readVarint();
+		boolean last = record[position++] != 0;
+		IdRanges part = new IdRanges();
+		long end = 0;
+		while (position < limit) {
+			long start = end + readVarint();
+			long length = readVarint();
+			part.add(start, length);
+			end = start + length;
+		}
+		return traces.heapSnapshot(time, sequence, count, part, last);
+	}
+
+	private long[] readHistogram(int bucketCount) {
+		long[] buckets = new long[bucketCount];
+		long nonEmpty = readVarint();
+		int bucket = 0;
+		for (long i = 0; i < nonEmpty; i++) {
+			bucket += (int) readVarint();
+			long count = readVarint();
+			if (bucket < bucketCount) {
+				buckets[bucket] += count;
+			}
+		}
+		return buckets;
+	}
+
+	private AgentStats readStats() {
+		AgentStats stats = new AgentStats();
+		stats.setTime(readTime());
+		stats.setCreated(readVarint());
+		stats.setFreed(readVarint());
+		stats.setBytesOut(readVarint());
+		stats.setLost(readVarint());
+		stats.setMemory(readVarint());
+		if (version >= 12) {
+			stats.setBytesEncoded(readVarint());
+		}
+		long operationCount = readVarint();
+		for (long i = 0; i < operationCount; i++) {
+			stats.addOperation(readVarint(), readVarint(), readHistogram(AgentStats.LATENCY_BUCKETS));
+		}
+		return stats;
+	}
+
+	private void readDrops() {
+		long time = readTime();
+		log.warn("agent at {} dropped {} creates, {} frees, counted {} creates, {} frees per site only, "
+						+ "lost {} events with broken connections", time, readVarint(), readVarint(), readVarint(),
+				readVarint(), readVarint());
+	}
+
+	/**
+	 * Reads next length prefixed record into {@link #record}
+	 * @return false at end of stream
+	 */
+	private boolean readRecord() throws IOException {
+		long length = 0;
+		int shift = 0;
+		int b;
+		do {
+			b = in.read();
+			if (b < 0) {
+				if (shift == 0) {
+					return false;
+				}
+				throw new EOFException("truncated record length");
+			}
+			length |= (long) (b & 0x7f) << shift;
+			shift += 7;
+		} while ((b & 0x80) != 0);
+
+		if (length <= 0 || length > Integer.MAX_VALUE) {
+			throw new IOException("invalid record length " + length);
+		}
+		if (record.length < length) {
+			record = new byte[(int) length];
+		}
+		int read = 0;
+		while (read < length) {
+			int n = in.read(record, read, (int) length - read);
+			if (n < 0) {
+				throw new EOFException("truncated record");
+			}
+			read += n;
+		}
+		position = 0;
+		limit = (int) length;
+		return true;
+	}
+
+	private long readVarint() {
+		long value = 0;
+		int shift = 0;
+		byte b;
+		do {
+			if (position >= limit) {
+				throw new IllegalStateException("varint runs past record");
+			}
+			b = record[position++];
+			value |= (long) (b & 0x7f) << shift;
+			shift += 7;
+		} while ((b & 0x80) != 0);
+		return value;
+	}
+
+	private long readTime() {
+		long zigzag = readVarint();
+		lastTime += (zigzag >>> 1) ^ -(zigzag & 1);
+		return toNanos(lastTime);
+	}
+
+	private long toNanos(long time) {
+		return version >= 7 ? time : time * NANOS_PER_MILLI;
+	}
+
+	private String readString() {
+		int length = (int) readVarint();
+		String value = new String(record, position, length, StandardCharsets.UTF_8);
+		position += length;
+		return value;
+	}
+}
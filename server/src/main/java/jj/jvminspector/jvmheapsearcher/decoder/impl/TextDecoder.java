@@ -0,0 +1,237 @@
+package jj.jvminspector.jvmheapsearcher.decoder.impl;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import com.lithium.flow.util.Logs;
+
+import java.io.BufferedReader;
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.InputStreamReader;
+import java.util.ArrayList;
+import java.util.List;
+
+import org.slf4j.Logger;
+
+import jj.jvminspector.jvmheapsearcher.decoder.Decoder;
+import jj.jvminspector.jvmheapsearcher.decoder.TraceTable;
+import jj.jvminspector.jvmheapsearcher.model.AgentStats;
+import jj.jvminspector.jvmheapsearcher.model.Event;
+import jj.jvminspector.jvmheapsearcher.model.IdRanges;
+import jj.jvminspector.jvmheapsearcher.model.Line;
+import jj.jvminspector.jvmheapsearcher.model.ObjectType;
+import jj.jvminspector.jvmheapsearcher.model.SiteLifetimes;
+import jj.jvminspector.jvmheapsearcher.model.StackTraceElement;
+
+/**
+ * Decodes the underscore delimited text format
+ */
+public class TextDecoder implements Decoder {
+	private static final Logger log = Logs.getLogger();
+	private final BufferedReader reader;
+	private final TraceTable traces = new TraceTable();
+
+	public TextDecoder(InputStream inputStream) {
+		this.reader = new BufferedReader(new InputStreamReader(inputStream));
+	}
+
+	@Override
+	public Event next() throws IOException {
+		String lineStr;
+		while ((lineStr = reader.readLine()) != null) {
+			try {
+				Event line = parseLine(lineStr);
+				if (line != null) {
+					return line;
+				}
+			} catch (RuntimeException ex) {
+				log.warn("failed to parse line " + lineStr, ex);
+			}
+		}
+		return null;
+	}
+
+	private Event parseLine(String lineStr) {
+		Line line = new Line();
+		String[] data = lineStr.split("_");
+		if (data == null || data.length == 0) {
+			throw new IllegalArgumentException("Could not parse line ");
+		}
+		if ("f".equals(data[0])) {
+			// frames may hold underscores
+			String[] frame = lineStr.split("_", 4);
+			List<StackTraceElement> element = parseStackTraceElement(frame[3]);
+			if (!element.isEmpty()) {
+				traces.defineFrame(Long.parseLong(frame[1]), Long.parseLong(frame[2]), element.get(0));
+			}
+			return null;
+		}
+		if ("t".equals(data[0])) {
+			if (data.length == 3 && data[2].chars().allMatch(Character::isDigit)) {
+				// top frame's node
+				traces.defineNode(Long.parseLong(data[1]), Long.parseLong(data[2]));
+			} else {
+				traces.define(Long.parseLong(data[1]), parseStackTraceElement(data[2]));
+			}
+			return null;
+		}
+		if ("k".equals(data[0])) {
+			// signatures may hold underscores
+			String[] klass = lineStr.split("_", 3);
+			traces.defineClass(Long.parseLong(klass[1]), klass[2]);
+			return null;
+		}
+		if ("r".equals(data[0])) {
+			// names may hold underscores, groups have them escaped
+			String[] thread = lineStr.split("_", 4);
+			traces.defineThread(Long.parseLong(thread[1]), thread.length > 3 ? thread[3] : "",
+					thread[2].replace("%5F", "_").replace("%25", "%"));
+			return null;
+		}
+		if ("u".equals(data[0])) {
+			return traces.threadSnapshot(Long.parseLong(data[1]), Long.parseLong(data[2]),
+					Long.parseLong(data[3]), Long.parseLong(data[4]));
+		}
+		if ("x".equals(data[0])) {
+			log.warn("agent at {} dropped {} creates, {} frees, counted {} creates, {} frees per site only, "
+							+ "lost {} events with broken connections", data[1], data[2], data[3], data[4], data[5],
+					data[6]);
+			return null;
+		}
+		if ("a".equals(data[0])) {
+			log.info("{}", parseStats(data));
+			return null;
+		}
+		if ("l".equals(data[0])) {
+			return traces.lifetimes(Long.parseLong(data[1]), Long.parseLong(data[2]),
+					parseHistogram(data[3], SiteLifetimes.LIFETIME_BUCKETS),
+					parseHistogram(data[4], SiteLifetimes.GC_CYCLE_BUCKETS));
+		}
+		if ("h".equals(data[0])) {
+			return traces.heapSnapshot(Long.parseLong(data[1]), Long.parseLong(data[2]),
+					Long.parseLong(data[3]), parseIdRanges(data[5]), "1".equals(data[4]));
+		}
+		if ("s".equals(data[0])) {
+			return traces.snapshot(Long.parseLong(data[1]), Long.parseLong(data[2]),
+					Long.parseLong(data[3]), Long.parseLong(data[4]), Long.parseLong(data[5]));
+		}
+		line.setCreated("c".equals(data[0]));
+		line.setId(Long.parseLong(data[1]));
+		if (line.isCreated()) {
+			line.setObjectType(ObjectType.get(data[2]));
+			line.setCreateTime(Long.parseLong(data[3]));
+			line.setTraceId(Long.parseLong(data[4]));
+			if (data.length > 5) {
+				line.setWeight(Long.parseLong(data[5]));
+			}
+			if (data.length > 6) {
+				line.setSize(Long.parseLong(data[6]));
+			}
+			if (data.length > 8) {
+				line.setClassName(traces.resolveClass(Long.parseLong(data[7])));
+				line.setArrayLength(Integer.parseInt(data[8]));
+			}
+			if (data.length > 9) {
+				traces.attributeThread(line, Long.parseLong(data[9]));
+			}
+			line.setStackTraceElementList(traces.resolve(line.getTraceId()));
+		} else {
+			if (data.length > 2) {
+				line.setDestroyTime(Long.parseLong(data[2]));
+			}
+			if (data.length > 6) {
+				line.setTraceId(Long.parseLong(data[3]));
+				line.setSize(Long.parseLong(data[4]));
+				line.setCreateTime(Long.parseLong(data[5]));
+				line.setWeight(Long.parseLong(data[6]));
+				line.setStackTraceElementList(traces.resolve(line.getTraceId()));
+			}
+			if (data.length > 7) {
+				line.setClassName(traces.resolveClass(Long.parseLong(data[7])));
+			}
+			if (data.length > 8) {
+				traces.attributeThread(line, Long.parseLong(data[8]));
+			}
+		}
+		return line;
+	}
+
+	private AgentStats parseStats(String[] data) {
+		AgentStats stats = new AgentStats();
+		stats.setTime(Long.parseLong(data[1]));
+		stats.setCreated(Long.parseLong(data[2]));
+		stats.setFreed(Long.parseLong(data[3]));
+		stats.setBytesOut(Long.parseLong(data[4]));
+		stats.setLost(Long.parseLong(data[5]));
+		stats.setMemory(Long.parseLong(data[6]));
+		stats.setBytesEncoded(Long.parseLong(data[7]));
+		for (int op = 0; 8 + op * 3 + 2 < data.length; op++) {
+			stats.addOperation(Long.parseLong(data[8 + op * 3]), Long.parseLong(data[9 + op * 3]),
+					parseHistogram(data[10 + op * 3], AgentStats.LATENCY_BUCKETS));
+		}
+		return stats;
+	}
+
+	private IdRanges parseIdRanges(String str) {
+		IdRanges ranges = new IdRanges();
+		if ("-".equals(str)) {
+			return ranges;
+		}
+		for (String rangeStr : str.split(",")) {
+			int separator = rangeStr.indexOf(':');
+			ranges.add(Long.parseLong(rangeStr.substring(0, separator)),
+					Long.parseLong(rangeStr.substring(separator + 1)));
+		}
+		return ranges;
+	}
+
+	private long[] parseHistogram(String str, int bucketCount) {
+		long[] buckets = new long[bucketCount];
+		if ("-".equals(str)) {
+			return buckets;
+		}
+		for (String bucketStr : str.split(",")) {
+			int separator = bucketStr.indexOf(':');
+			int bucket = Integer.parseInt(bucketStr.substring(0, separator));
+			if (bucket < bucketCount) {
+				buckets[bucket] += Long.parseLong(bucketStr.substring(separator + 1));
+			}
+		}
+		return buckets;
+	}
+
+	private List<StackTraceElement> parseStackTraceElement(String str) {
+		List<StackTraceElement> result = new ArrayList<>();
+		String[] stackTraceElementsStr = str.split(",");
+
+		for (String stackTraceElementStr : stackTraceElementsStr) {
+			try {
+				StackTraceElement stackTraceElement = new StackTraceElement();
+				int start = 0;
+				int end = stackTraceElementStr.indexOf('.');
+				stackTraceElement.setClassSignature(stackTraceElementStr.substring(0, end));
+				start = end + 1;
+				end = stackTraceElementStr.indexOf('@', start);
+				stackTraceElement.setMethodName(stackTraceElementStr.substring(start, end));
+				start = end + 1;
+				end = stackTraceElementStr.indexOf('[');
+				stackTraceElement.setMethodLineNumber(Integer.parseInt(stackTraceElementStr
+						.substring(start, end)));
+
+				start = end + 1;
+				end = stackTraceElementStr.indexOf(':');
+				stackTraceElement.setFileName(stackTraceElementStr.substring(start, end));
+
+				start = end + 1;
+				end = stackTraceElementStr.indexOf(']');
+				stackTraceElement.setLineNumber(Integer.parseInt(stackTraceElementStr
+						.substring(start, end)));
+				result.add(stackTraceElement);
+			} catch (Exception ex) {
+				log.warn("failed to parse " + stackTraceElementStr);
+			}
+		}
+		return result;
+	}
+}
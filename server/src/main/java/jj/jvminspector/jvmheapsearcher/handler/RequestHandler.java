@@ -5,23 +5,30 @@ package jj.jvminspector.jvmheapsearcher.handler;
 
 import com.lithium.flow.config.Config;
 import com.lithium.flow.util.Logs;
+import com.lithium.flow.util.Sleep;
 import com.lithium.flow.util.Threader;
 
-import java.io.BufferedReader;
 import java.io.IOException;
-import java.io.InputStreamReader;
+import java.io.InputStream;
 import java.io.PrintWriter;
 import java.net.Socket;
+import java.util.concurrent.Executors;
 import java.util.concurrent.LinkedBlockingQueue;
+import java.util.concurrent.ScheduledExecutorService;
+import java.util.concurrent.TimeUnit;
 
 import org.slf4j.Logger;
 
+import jj.jvminspector.jvmheapsearcher.decoder.Decoder;
+import jj.jvminspector.jvmheapsearcher.decoder.DecoderFactory;
+import jj.jvminspector.jvmheapsearcher.decoder.FrameInputStream;
+import jj.jvminspector.jvmheapsearcher.model.Event;
 import jj.jvminspector.jvmheapsearcher.processor.Processor;
 import jj.jvminspector.jvmheapsearcher.processor.ProcessorFactory;
 
 public class RequestHandler extends Thread {
 	private final Socket socket;
-	private final LinkedBlockingQueue<String> queue;
+	private final LinkedBlockingQueue<Event> queue;
 	private final Processor processor;
 	private final Config config;
 	private static final Logger log = Logs.getLogger();
@@ -38,32 +45,71 @@ public class RequestHandler extends Thread {
 
 	@Override
 	public void run() {
-		BufferedReader reader = null;
+		Decoder reader = null;
 		PrintWriter writter = null;
+		ScheduledExecutorService snapshots = null;
 		try {
 			log.info("ready for request to handle");
 			// Get input and output streams
-			reader = new BufferedReader(new InputStreamReader(socket.getInputStream()));
 			writter = new PrintWriter(socket.getOutputStream());
-			String line;
-			while ((line = reader.readLine()) != null) {
-				queueLine(line);
+			InputStream in = FrameInputStream.negotiate(socket.getInputStream(), writter,
+					config.getBoolean("compression.enabled", true));
+			snapshots = scheduleHeapSnapshots(writter);
+			reader = DecoderFactory.getDecoder(in);
+			Event event;
+			while ((event = reader.next()) != null) {
+				queueLine(event);
 			}
+			awaitProcessing();
 			log.info("closing connection");
 			socket.close();
 		} catch (Exception e) {
 			log.error("Failed to read incoming data");
 		} finally {
+			if (snapshots != null) {
+				snapshots.shutdownNow();
+			}
 			try {
-				reader.close();
-			} catch (Exception ignore) {log.warn("failed to close reader", ignore);}
+				socket.close();
+			} catch (Exception ignore) {log.warn("failed to close socket", ignore);}
 			try {
 				writter.close();
 			} catch (Exception ignore) {log.warn("failed to close writter", ignore);}
 		}
 	}
 
-	private void queueLine(String line) {
-		queue.add(line);
+	/**
+	 * Asks the agent for a heap snapshot every heap.snapshot.interval.seconds, if set
+	 */
+	private ScheduledExecutorService scheduleHeapSnapshots(PrintWriter writter) {
+		long interval = config.getLong("heap.snapshot.interval.seconds", 0);
+		if (interval <= 0) {
+			return null;
+		}
+		ScheduledExecutorService snapshots = Executors.newSingleThreadScheduledExecutor();
+		snapshots.scheduleAtFixedRate(() -> {
+			synchronized (writter) {
+				writter.print("snapshot\n");
+				writter.flush();
+			}
+		}, interval, interval, TimeUnit.SECONDS);
+		return snapshots;
+	}
+
+	/**
+	 * Waits up to request.drain.timeout.seconds for the processor to take everything queued,
+	 * so whoever waits for the connection to close, like CaptureReplayer, knows when the
+	 * server is done with it
+	 */
+	private void awaitProcessing() {
+		long deadline = System.currentTimeMillis()
+				+ TimeUnit.SECONDS.toMillis(config.getLong("request.drain.timeout.seconds", 30));
+		while (!queue.isEmpty() && System.currentTimeMillis() < deadline) {
+			Sleep.softly(10L);
+		}
+	}
+
+	private void queueLine(Event event) {
+		queue.add(event);
 	}
 }
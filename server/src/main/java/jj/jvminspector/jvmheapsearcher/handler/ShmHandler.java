@@ -0,0 +1,104 @@
+package jj.jvminspector.jvmheapsearcher.handler;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import com.lithium.flow.config.Config;
+import com.lithium.flow.util.Logs;
+import com.lithium.flow.util.Threader;
+
+import java.io.IOException;
+import java.util.concurrent.Executors;
+import java.util.concurrent.LinkedBlockingQueue;
+import java.util.concurrent.ScheduledExecutorService;
+import java.util.concurrent.TimeUnit;
+
+import org.slf4j.Logger;
+
+import jj.jvminspector.jvmheapsearcher.decoder.Decoder;
+import jj.jvminspector.jvmheapsearcher.decoder.DecoderFactory;
+import jj.jvminspector.jvmheapsearcher.model.Event;
+import jj.jvminspector.jvmheapsearcher.processor.Processor;
+import jj.jvminspector.jvmheapsearcher.processor.ProcessorFactory;
+import jj.jvminspector.jvmheapsearcher.shm.ShmRing;
+
+/**
+ * Reads agents writing to the shared memory ring named shm.name on this host, one agent
+ * after the other, waiting for the next one whenever an agent is done
+ */
+public class ShmHandler extends Thread {
+	private static final long RETRY_MILLIS = 100;
+	private final String name;
+	private final LinkedBlockingQueue<Event> queue;
+	private final Processor processor;
+	private final Config config;
+	private static final Logger log = Logs.getLogger();
+
+	public ShmHandler(String name, Config config) throws IOException {
+		this.name = name;
+		this.config = config;
+		this.queue = new LinkedBlockingQueue<>();
+		this.processor = ProcessorFactory.getProcessor(queue, config);
+		int requestHandlerConcurrency = config.getInt("request.handler.concurrency", 2);
+		new Threader(requestHandlerConcurrency).submit(this.processor.getClass().getName(), processor);
+	}
+
+	@Override
+	public void run() {
+		while (true) {
+			ShmRing ring;
+			try {
+				ring = new ShmRing(name);
+			} catch (IOException e) {
+				// no agent yet
+				sleepQuietly();
+				continue;
+			}
+			ScheduledExecutorService snapshots = null;
+			try {
+				if (!ring.attach()) {
+					// left behind by an agent that died
+					sleepQuietly();
+					continue;
+				}
+				log.info("attached to shared memory ring {}", name);
+				snapshots = scheduleHeapSnapshots(ring);
+				Decoder reader = DecoderFactory.getDecoder(ring);
+				Event event;
+				while ((event = reader.next()) != null) {
+					queue.add(event);
+				}
+				log.info("agent closed shared memory ring {}", name);
+			} catch (Exception e) {
+				log.error("Failed to read shared memory ring " + name, e);
+			} finally {
+				if (snapshots != null) {
+					snapshots.shutdownNow();
+				}
+				ring.close();
+			}
+			sleepQuietly();
+		}
+	}
+
+	/**
+	 * Asks the agent for a heap snapshot every heap.snapshot.interval.seconds, if set
+	 */
+	private ScheduledExecutorService scheduleHeapSnapshots(ShmRing ring) {
+		long interval = config.getLong("heap.snapshot.interval.seconds", 0);
+		if (interval <= 0) {
+			return null;
+		}
+		ScheduledExecutorService snapshots = Executors.newSingleThreadScheduledExecutor();
+		snapshots.scheduleAtFixedRate(ring::requestHeapSnapshot, interval, interval, TimeUnit.SECONDS);
+		return snapshots;
+	}
+
+	private void sleepQuietly() {
+		try {
+			Thread.sleep(RETRY_MILLIS);
+		} catch (InterruptedException e) {
+			Thread.currentThread().interrupt();
+		}
+	}
+}
@@ -0,0 +1,144 @@
+package jj.jvminspector.jvmheapsearcher.model;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import java.util.ArrayList;
+import java.util.List;
+
+/**
+ * Agent's own cumulative overhead: counters, plus count, total and latency histogram of
+ * its operations. Histograms use the same buckets as {@link SiteLifetimes}.
+ */
+public class AgentStats {
+	public static final int LATENCY_BUCKETS = 160;
+	/**
+	 * Operations in the order the agent reports them
+	 */
+	public static final String[] OPERATIONS = {
+			"stackTrace", "resolve", "send", "backpressure", "queueWait", "lockWait", "heapSnapshot", "compress"
+	};
+
+	long time;
+	long created;
+	long freed;
+	long bytesOut;
+	long lost;
+	long memory;
+	long bytesEncoded;
+	List<Long> counts = new ArrayList<>();
+	List<Long> totalNanos = new ArrayList<>();
+	List<long[]> latencies = new ArrayList<>();
+
+	public void addOperation(long count, long total, long[] latency) {
+		counts.add(count);
+		totalNanos.add(total);
+		latencies.add(latency);
+	}
+
+	public int getOperationCount() {
+		return counts.size();
+	}
+
+	public String getOperationName(int operation) {
+		return operation < OPERATIONS.length ? OPERATIONS[operation] : "operation" + operation;
+	}
+
+	public long getCount(int operation) {
+		return counts.get(operation);
+	}
+
+	public long getTotalNanos(int operation) {
+		return totalNanos.get(operation);
+	}
+
+	/**
+	 * @return lower bound of the bucket holding the given percentile of the operation's latency
+	 */
+	public long percentileNanos(int operation, double percentile) {
+		return SiteLifetimes.percentile(latencies.get(operation), percentile);
+	}
+
+	public long getTime() {
+		return time;
+	}
+
+	public void setTime(long timeParam) {
+		this.time = timeParam;
+	}
+
+	public long getCreated() {
+		return created;
+	}
+
+	public void setCreated(long createdParam) {
+		this.created = createdParam;
+	}
+
+	public long getFreed() {
+		return freed;
+	}
+
+	public void setFreed(long freedParam) {
+		this.freed = freedParam;
+	}
+
+	public long getBytesOut() {
+		return bytesOut;
+	}
+
+	public void setBytesOut(long bytesOutParam) {
+		this.bytesOut = bytesOutParam;
+	}
+
+	public long getLost() {
+		return lost;
+	}
+
+	public void setLost(long lostParam) {
+		this.lost = lostParam;
+	}
+
+	public long getMemory() {
+		return memory;
+	}
+
+	public void setMemory(long memoryParam) {
+		this.memory = memoryParam;
+	}
+
+	/**
+	 * @return bytes the agent encoded, before compression; bytesOut is what it wrote
+	 */
+	public long getBytesEncoded() {
+		return bytesEncoded;
+	}
+
+	public void setBytesEncoded(long bytesEncodedParam) {
+		this.bytesEncoded = bytesEncodedParam;
+	}
+
+	@Override
+	public String toString() {
+		StringBuilder sb = new StringBuilder("AgentStats{" +
+				"time=" + time +
+				", created=" + created +
+				", freed=" + freed +
+				", bytesOut=" + bytesOut +
+				", lost=" + lost +
+				", memory=" + memory +
+				", bytesEncoded=" + bytesEncoded);
+		for (int i = 0; i < getOperationCount(); i++) {
+			long count = getCount(i);
+			if (count == 0) {
+				continue;
+			}
+			sb.append(", ").append(getOperationName(i)).append("={count=").append(count)
+					.append(", meanNanos=").append(getTotalNanos(i) / count)
+					.append(", p50Nanos=").append(percentileNanos(i, 50))
+					.append(", p99Nanos=").append(percentileNanos(i, 99))
+					.append('}');
+		}
+		return sb.append('}').toString();
+	}
+}
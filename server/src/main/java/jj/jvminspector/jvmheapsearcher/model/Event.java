@@ -0,0 +1,10 @@
+package jj.jvminspector.jvmheapsearcher.model;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+/**
+ * Anything a decoder hands to a processor
+ */
+public interface Event {
+}
@@ -0,0 +1,84 @@
+package jj.jvminspector.jvmheapsearcher.model;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+/**
+ * Ids of all tracked objects alive at the time of a heap walk, diffed against the previous
+ * heap snapshot of the same connection. An object alive now but not then was created in
+ * between, as an object never comes back to life.
+ */
+public class HeapSnapshot implements Event {
+	long time;
+	long sequence;
+	IdRanges live = new IdRanges();
+	// 0 if this is the connection's first snapshot
+	long previousTime;
+	IdRanges created = new IdRanges();
+	IdRanges freed = new IdRanges();
+
+	/**
+	 * Computes {@link #getCreated()} and {@link #getFreed()}
+	 * @param previous null for the connection's first snapshot
+	 */
+	public void diff(HeapSnapshot previous) {
+		if (previous == null) {
+			created = live;
+			return;
+		}
+		previousTime = previous.time;
+		created = live.minus(previous.live);
+		freed = previous.live.minus(live);
+	}
+
+	public long getTime() {
+		return time;
+	}
+
+	public void setTime(long timeParam) {
+		this.time = timeParam;
+	}
+
+	public long getSequence() {
+		return sequence;
+	}
+
+	public void setSequence(long sequenceParam) {
+		this.sequence = sequenceParam;
+	}
+
+	public IdRanges getLive() {
+		return live;
+	}
+
+	public long getPreviousTime() {
+		return previousTime;
+	}
+
+	/**
+	 * @return ids created since the previous snapshot and still alive, all of live for the first one
+	 */
+	public IdRanges getCreated() {
+		return created;
+	}
+
+	/**
+	 * @return ids alive at the previous snapshot and freed since
+	 */
+	public IdRanges getFreed() {
+		return freed;
+	}
+
+	@Override
+	public String toString() {
+		return "HeapSnapshot{" +
+				"time=" + time +
+				", sequence=" + sequence +
+				", live=" + live.getCount() +
+				", previousTime=" + previousTime +
+				", created=" + created.getCount() +
+				", freed=" + freed.getCount() +
+				", createdIds=" + created +
+				'}';
+	}
+}
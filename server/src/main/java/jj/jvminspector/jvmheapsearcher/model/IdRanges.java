@@ -0,0 +1,123 @@
+package jj.jvminspector.jvmheapsearcher.model;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import java.util.Arrays;
+
+/**
+ * Sorted, disjoint ranges of object ids, as heap snapshots send them. Ranges are added in
+ * ascending order; set operations merge two range lists in linear time.
+ */
+public class IdRanges {
+	// start inclusive, end exclusive, pairwise
+	private long[] bounds = new long[16];
+	private int size;
+	private long count;
+
+	/**
+	 * Appends ids start to start + length - 1, which must lie past all ids added so far
+	 */
+	public void add(long start, long length) {
+		if (length <= 0) {
+			return;
+		}
+		if (size > 0 && start < bounds[size - 1]) {
+			throw new IllegalArgumentException("range " + start + " is not past " + bounds[size - 1]);
+		}
+		count += length;
+		if (size > 0 && start == bounds[size - 1]) {
+			bounds[size - 1] = start + length;
+			return;
+		}
+		if (size == bounds.length) {
+			bounds = Arrays.copyOf(bounds, size * 2);
+		}
+		bounds[size++] = start;
+		bounds[size++] = start + length;
+	}
+
+	public void addAll(IdRanges other) {
+		for (int i = 0; i < other.size; i += 2) {
+			add(other.bounds[i], other.bounds[i + 1] - other.bounds[i]);
+		}
+	}
+
+	/**
+	 * @return ids in this but not in other
+	 */
+	public IdRanges minus(IdRanges other) {
+		IdRanges result = new IdRanges();
+		int j = 0;
+		for (int i = 0; i < size; i += 2) {
+			long start = bounds[i];
+			long end = bounds[i + 1];
+			// skip other's ranges that end before this one starts
+			while (j < other.size && other.bounds[j + 1] <= start) {
+				j += 2;
+			}
+			int k = j;
+			while (start < end && k < other.size && other.bounds[k] < end) {
+				if (other.bounds[k] > start) {
+					result.add(start, other.bounds[k] - start);
+				}
+				start = Math.max(start, other.bounds[k + 1]);
+				k += 2;
+			}
+			if (start < end) {
+				result.add(start, end - start);
+			}
+		}
+		return result;
+	}
+
+	public boolean contains(long id) {
+		int low = 0;
+		int high = size / 2 - 1;
+		while (low <= high) {
+			int middle = (low + high) >>> 1;
+			if (bounds[middle * 2 + 1] <= id) {
+				low = middle + 1;
+			} else if (bounds[middle * 2] > id) {
+				high = middle - 1;
+			} else {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * @return number of ids
+	 */
+	public long getCount() {
+		return count;
+	}
+
+	public int getRangeCount() {
+		return size / 2;
+	}
+
+	public long getStart(int range) {
+		return bounds[range * 2];
+	}
+
+	/**
+	 * @return first id past the range
+	 */
+	public long getEnd(int range) {
+		return bounds[range * 2 + 1];
+	}
+
+	@Override
+	public String toString() {
+		StringBuilder sb = new StringBuilder("[");
+		for (int i = 0; i < size; i += 2) {
+			if (i > 0) {
+				sb.append(", ");
+			}
+			sb.append(bounds[i]).append('-').append(bounds[i + 1] - 1);
+		}
+		return sb.append(']').toString();
+	}
+}
@@ -6,12 +6,24 @@ package jj.jvminspector.jvmheapsearcher.model;
 import java.util.ArrayList;
 import java.util.List;
 
-public class Line {
+public class Line implements Event {
 	long id;
 	ObjectType objectType;
 	boolean created;
 	long createTime;
 	long destroyTime;
+	long traceId;
+	long weight = 1;
+	long size;
+	long gcEpoch;
+	// JVM signature of the object's class, null if unknown
+	String className;
+	// -1 unless the object is an array
+	int arrayLength = -1;
+	// allocating thread, 0 if unknown; name and group null if unknown
+	long threadId;
+	String threadName;
+	String threadGroup;
 	List<StackTraceElement> stackTraceElementList = new ArrayList<>();
 
 	public ObjectType getObjectType() {
@@ -54,6 +66,85 @@ public class Line {
 		this.destroyTime = destroyTimeParam;
 	}
 
+	public long getTraceId() {
+		return traceId;
+	}
+
+	public void setTraceId(long traceIdParam) {
+		this.traceId = traceIdParam;
+	}
+
+	public long getWeight() {
+		return weight;
+	}
+
+	public void setWeight(long weightParam) {
+		this.weight = weightParam;
+	}
+
+	public long getSize() {
+		return size;
+	}
+
+	public void setSize(long sizeParam) {
+		this.size = sizeParam;
+	}
+
+	public long getGcEpoch() {
+		return gcEpoch;
+	}
+
+	public void setGcEpoch(long gcEpochParam) {
+		this.gcEpoch = gcEpochParam;
+	}
+
+	public String getClassName() {
+		return className;
+	}
+
+	public void setClassName(String classNameParam) {
+		this.className = classNameParam;
+	}
+
+	/**
+	 * @return signature of the array's element type, null unless the object is an array
+	 */
+	public String getElementType() {
+		return className != null && className.startsWith("[") ? className.substring(1) : null;
+	}
+
+	public int getArrayLength() {
+		return arrayLength;
+	}
+
+	public void setArrayLength(int arrayLengthParam) {
+		this.arrayLength = arrayLengthParam;
+	}
+
+	public long getThreadId() {
+		return threadId;
+	}
+
+	public void setThreadId(long threadIdParam) {
+		this.threadId = threadIdParam;
+	}
+
+	public String getThreadName() {
+		return threadName;
+	}
+
+	public void setThreadName(String threadNameParam) {
+		this.threadName = threadNameParam;
+	}
+
+	public String getThreadGroup() {
+		return threadGroup;
+	}
+
+	public void setThreadGroup(String threadGroupParam) {
+		this.threadGroup = threadGroupParam;
+	}
+
 	public List<StackTraceElement> getStackTraceElementList() {
 		return stackTraceElementList;
 	}
@@ -74,6 +165,13 @@ public class Line {
 		if (created != line.created) return false;
 		if (createTime != line.createTime) return false;
 		if (destroyTime != line.destroyTime) return false;
+		if (traceId != line.traceId) return false;
+		if (weight != line.weight) return false;
+		if (size != line.size) return false;
+		if (gcEpoch != line.gcEpoch) return false;
+		if (arrayLength != line.arrayLength) return false;
+		if (threadId != line.threadId) return false;
+		if (className != null ? !className.equals(line.className) : line.className != null) return false;
 		if (objectType != line.objectType) return false;
 		return !(stackTraceElementList != null ? !stackTraceElementList.equals(line.stackTraceElementList) : line.stackTraceElementList != null);
 
@@ -86,7 +184,35 @@ public class Line {
 		result = 31 * result + (created ? 1 : 0);
 		result = 31 * result + (int) (createTime ^ (createTime >>> 32));
 		result = 31 * result + (int) (destroyTime ^ (destroyTime >>> 32));
+		result = 31 * result + (int) (traceId ^ (traceId >>> 32));
+		result = 31 * result + (int) (weight ^ (weight >>> 32));
+		result = 31 * result + (int) (size ^ (size >>> 32));
+		result = 31 * result + (int) (gcEpoch ^ (gcEpoch >>> 32));
+		result = 31 * result + (className != null ? className.hashCode() : 0);
+		result = 31 * result + arrayLength;
+		result = 31 * result + (int) (threadId ^ (threadId >>> 32));
 		result = 31 * result + (stackTraceElementList != null ? stackTraceElementList.hashCode() : 0);
 		return result;
 	}
+
+	@Override
+	public String toString() {
+		return "Line{" +
+				"id=" + id +
+				", objectType=" + objectType +
+				", created=" + created +
+				", createTime=" + createTime +
+				", destroyTime=" + destroyTime +
+				", traceId=" + traceId +
+				", weight=" + weight +
+				", size=" + size +
+				", gcEpoch=" + gcEpoch +
+				", className=" + className +
+				", arrayLength=" + arrayLength +
+				", threadId=" + threadId +
+				", threadName=" + threadName +
+				", threadGroup=" + threadGroup +
+				", stackTraceElementList=" + stackTraceElementList +
+				'}';
+	}
 }
@@ -13,8 +13,16 @@ public enum ObjectType {
 		put("U", USER);
 		put("V", VM_OBJECT);
 	}};
+	private static Map<Integer, ObjectType> flavorMap = new HashMap<Integer, ObjectType>() {{
+		put(0, USER);
+		put(3, VM_OBJECT);
+	}};
 
 	public static ObjectType get(String code) {
 		return codeMap.get(code);
 	}
+
+	public static ObjectType fromFlavor(int flavor) {
+		return flavorMap.get(flavor);
+	}
 }
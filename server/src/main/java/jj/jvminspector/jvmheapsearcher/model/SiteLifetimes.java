@@ -0,0 +1,149 @@
+package jj.jvminspector.jvmheapsearcher.model;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.List;
+
+/**
+ * Lifetime histograms of objects freed from one allocation site, in nanoseconds and in
+ * GC cycles survived. Buckets are log-linear: exact below 2^{@link #SUB_BITS}, then
+ * 2^{@link #SUB_BITS} buckets per power of two, same as the agent's.
+ */
+public class SiteLifetimes implements Event {
+	public static final int SUB_BITS = 2;
+	public static final int LIFETIME_BUCKETS = 248;
+	public static final int GC_CYCLE_BUCKETS = 64;
+
+	long time;
+	long traceId;
+	long[] nanos = new long[LIFETIME_BUCKETS];
+	long[] gcCycles = new long[GC_CYCLE_BUCKETS];
+	List<StackTraceElement> stackTraceElementList = new ArrayList<>();
+
+	/**
+	 * @return smallest value counted in the bucket
+	 */
+	public static long lowerBound(int bucket) {
+		if (bucket < (1 << SUB_BITS)) {
+			return bucket;
+		}
+		int msb = (bucket >> SUB_BITS) + SUB_BITS - 1;
+		long sub = bucket & ((1 << SUB_BITS) - 1);
+		return ((1L << SUB_BITS) | sub) << (msb - SUB_BITS);
+	}
+
+	/**
+	 * @return bucket counting the value, the last one for values beyond it
+	 */
+	public static int bucket(long value, int bucketCount) {
+		if (value < (1 << SUB_BITS)) {
+			return value < 0 ? 0 : (int) value;
+		}
+		int msb = 63 - Long.numberOfLeadingZeros(value);
+		int index = ((msb - SUB_BITS + 1) << SUB_BITS) | (int) ((value >> (msb - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+		return index < bucketCount ? index : bucketCount - 1;
+	}
+
+	/**
+	 * @return lower bound of the bucket holding the given percentile of counts
+	 */
+	public static long percentile(long[] buckets, double percentile) {
+		long total = 0;
+		for (long count : buckets) {
+			total += count;
+		}
+		if (total == 0) {
+			return 0;
+		}
+		long rank = (long) Math.ceil(total * percentile / 100.0);
+		long seen = 0;
+		for (int i = 0; i < buckets.length; i++) {
+			seen += buckets[i];
+			if (seen >= rank) {
+				return lowerBound(i);
+			}
+		}
+		return lowerBound(buckets.length - 1);
+	}
+
+	public long getCount() {
+		long total = 0;
+		for (long count : nanos) {
+			total += count;
+		}
+		return total;
+	}
+
+	/**
+	 * @return lower bound of the bucket holding the given percentile of lifetimes
+	 */
+	public long percentileNanos(double percentile) {
+		return percentile(nanos, percentile);
+	}
+
+	/**
+	 * @return lower bound of the bucket holding the given percentile of GC cycles survived
+	 */
+	public long percentileGcCycles(double percentile) {
+		return percentile(gcCycles, percentile);
+	}
+
+	public long getTime() {
+		return time;
+	}
+
+	public void setTime(long timeParam) {
+		this.time = timeParam;
+	}
+
+	public long getTraceId() {
+		return traceId;
+	}
+
+	public void setTraceId(long traceIdParam) {
+		this.traceId = traceIdParam;
+	}
+
+	public long[] getNanos() {
+		return nanos;
+	}
+
+	public void setNanos(long[] nanosParam) {
+		this.nanos = nanosParam;
+	}
+
+	public long[] getGcCycles() {
+		return gcCycles;
+	}
+
+	public void setGcCycles(long[] gcCyclesParam) {
+		this.gcCycles = gcCyclesParam;
+	}
+
+	public List<StackTraceElement> getStackTraceElementList() {
+		return stackTraceElementList;
+	}
+
+	public void setStackTraceElementList(List<StackTraceElement> stackTraceElementListParam) {
+		this.stackTraceElementList = stackTraceElementListParam;
+	}
+
+	@Override
+	public String toString() {
+		return "SiteLifetimes{" +
+				"time=" + time +
+				", traceId=" + traceId +
+				", count=" + getCount() +
+				", p50Nanos=" + percentileNanos(50) +
+				", p99Nanos=" + percentileNanos(99) +
+				", p50GcCycles=" + percentileGcCycles(50) +
+				", p99GcCycles=" + percentileGcCycles(99) +
+				", nanos=" + Arrays.toString(nanos) +
+				", gcCycles=" + Arrays.toString(gcCycles) +
+				", stackTraceElementList=" + stackTraceElementList +
+				'}';
+	}
+}
@@ -0,0 +1,90 @@
+package jj.jvminspector.jvmheapsearcher.model;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import java.util.ArrayList;
+import java.util.List;
+
+/**
+ * Counters of one allocation site for one aggregate snapshot interval, along with the
+ * site's running totals
+ */
+public class SiteSnapshot implements Event {
+	long time;
+	long traceId;
+	long allocated;
+	long freed;
+	long liveCount;
+	long liveBytes;
+	List<StackTraceElement> stackTraceElementList = new ArrayList<>();
+
+	public long getTime() {
+		return time;
+	}
+
+	public void setTime(long timeParam) {
+		this.time = timeParam;
+	}
+
+	public long getTraceId() {
+		return traceId;
+	}
+
+	public void setTraceId(long traceIdParam) {
+		this.traceId = traceIdParam;
+	}
+
+	public long getAllocated() {
+		return allocated;
+	}
+
+	public void setAllocated(long allocatedParam) {
+		this.allocated = allocatedParam;
+	}
+
+	public long getFreed() {
+		return freed;
+	}
+
+	public void setFreed(long freedParam) {
+		this.freed = freedParam;
+	}
+
+	public long getLiveCount() {
+		return liveCount;
+	}
+
+	public void setLiveCount(long liveCountParam) {
+		this.liveCount = liveCountParam;
+	}
+
+	public long getLiveBytes() {
+		return liveBytes;
+	}
+
+	public void setLiveBytes(long liveBytesParam) {
+		this.liveBytes = liveBytesParam;
+	}
+
+	public List<StackTraceElement> getStackTraceElementList() {
+		return stackTraceElementList;
+	}
+
+	public void setStackTraceElementList(List<StackTraceElement> stackTraceElementListParam) {
+		this.stackTraceElementList = stackTraceElementListParam;
+	}
+
+	@Override
+	public String toString() {
+		return "SiteSnapshot{" +
+				"time=" + time +
+				", traceId=" + traceId +
+				", allocated=" + allocated +
+				", freed=" + freed +
+				", liveCount=" + liveCount +
+				", liveBytes=" + liveBytes +
+				", stackTraceElementList=" + stackTraceElementList +
+				'}';
+	}
+}
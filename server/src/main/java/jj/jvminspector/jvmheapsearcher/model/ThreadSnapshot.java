@@ -0,0 +1,98 @@
+package jj.jvminspector.jvmheapsearcher.model;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+/**
+ * Tracked allocations of one thread for one aggregate snapshot interval, along with the
+ * thread's running totals
+ */
+public class ThreadSnapshot implements Event {
+	long time;
+	long threadId;
+	// null if the agent could not resolve them
+	String threadName;
+	String threadGroup;
+	long allocated;
+	long allocatedBytes;
+	long totalAllocated;
+	long totalBytes;
+
+	public long getTime() {
+		return time;
+	}
+
+	public void setTime(long timeParam) {
+		this.time = timeParam;
+	}
+
+	public long getThreadId() {
+		return threadId;
+	}
+
+	public void setThreadId(long threadIdParam) {
+		this.threadId = threadIdParam;
+	}
+
+	public String getThreadName() {
+		return threadName;
+	}
+
+	public void setThreadName(String threadNameParam) {
+		this.threadName = threadNameParam;
+	}
+
+	public String getThreadGroup() {
+		return threadGroup;
+	}
+
+	public void setThreadGroup(String threadGroupParam) {
+		this.threadGroup = threadGroupParam;
+	}
+
+	public long getAllocated() {
+		return allocated;
+	}
+
+	public void setAllocated(long allocatedParam) {
+		this.allocated = allocatedParam;
+	}
+
+	public long getAllocatedBytes() {
+		return allocatedBytes;
+	}
+
+	public void setAllocatedBytes(long allocatedBytesParam) {
+		this.allocatedBytes = allocatedBytesParam;
+	}
+
+	public long getTotalAllocated() {
+		return totalAllocated;
+	}
+
+	public void setTotalAllocated(long totalAllocatedParam) {
+		this.totalAllocated = totalAllocatedParam;
+	}
+
+	public long getTotalBytes() {
+		return totalBytes;
+	}
+
+	public void setTotalBytes(long totalBytesParam) {
+		this.totalBytes = totalBytesParam;
+	}
+
+	@Override
+	public String toString() {
+		return "ThreadSnapshot{" +
+				"time=" + time +
+				", threadId=" + threadId +
+				", threadName=" + threadName +
+				", threadGroup=" + threadGroup +
+				", allocated=" + allocated +
+				", allocatedBytes=" + allocatedBytes +
+				", totalAllocated=" + totalAllocated +
+				", totalBytes=" + totalBytes +
+				'}';
+	}
+}
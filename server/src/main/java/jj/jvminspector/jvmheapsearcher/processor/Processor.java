@@ -2,10 +2,39 @@ package jj.jvminspector.jvmheapsearcher.processor;
 
 import java.util.concurrent.Callable;
 
+import jj.jvminspector.jvmheapsearcher.model.Event;
+import jj.jvminspector.jvmheapsearcher.model.HeapSnapshot;
+import jj.jvminspector.jvmheapsearcher.model.Line;
+import jj.jvminspector.jvmheapsearcher.model.SiteLifetimes;
+import jj.jvminspector.jvmheapsearcher.model.SiteSnapshot;
+import jj.jvminspector.jvmheapsearcher.model.ThreadSnapshot;
+
 /**
  * Created by jigar.joshi on 4/8/16.
  */
 
 public interface Processor extends Callable {
-	void processLine(String line);
+	void processLine(Line line);
+
+	void processSnapshot(SiteSnapshot snapshot);
+
+	void processLifetimes(SiteLifetimes lifetimes);
+
+	void processHeapSnapshot(HeapSnapshot heapSnapshot);
+
+	void processThreadSnapshot(ThreadSnapshot snapshot);
+
+	default void process(Event event) {
+		if (event instanceof Line) {
+			processLine((Line) event);
+		} else if (event instanceof SiteSnapshot) {
+			processSnapshot((SiteSnapshot) event);
+		} else if (event instanceof SiteLifetimes) {
+			processLifetimes((SiteLifetimes) event);
+		} else if (event instanceof HeapSnapshot) {
+			processHeapSnapshot((HeapSnapshot) event);
+		} else if (event instanceof ThreadSnapshot) {
+			processThreadSnapshot((ThreadSnapshot) event);
+		}
+	}
 }
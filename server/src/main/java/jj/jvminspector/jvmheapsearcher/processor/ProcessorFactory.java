@@ -8,20 +8,39 @@ import com.lithium.flow.config.Config;
 import java.io.IOException;
 import java.util.concurrent.BlockingQueue;
 
+import jj.jvminspector.jvmheapsearcher.model.Event;
 import jj.jvminspector.jvmheapsearcher.processor.impl.ElasticsearchProcessor;
+import jj.jvminspector.jvmheapsearcher.processor.impl.MemoryProcessor;
 import jj.jvminspector.jvmheapsearcher.processor.impl.NullProcessor;
 import jj.jvminspector.jvmheapsearcher.processor.impl.StdoutProcessor;
+import jj.jvminspector.jvmheapsearcher.store.EventStore;
+import jj.jvminspector.jvmheapsearcher.store.QueryServer;
 
 public class ProcessorFactory {
-	public static Processor getProcessor(BlockingQueue<String> queue, Config config) throws IOException {
+	private static EventStore eventStore;
+
+	public static Processor getProcessor(BlockingQueue<Event> queue, Config config) throws IOException {
 		switch (config.getString("processor.type", "null")) {
 			case "elasticsearch":
 				return new ElasticsearchProcessor(queue);
 			case "stdout":
 				return new StdoutProcessor(queue);
+			case "memory":
+				return new MemoryProcessor(queue, getEventStore(config));
 			case "default":
 				return new NullProcessor(queue);
 		}
 		return new NullProcessor(queue);
 	}
+
+	/**
+	 * Connections share one store, its query interface starts along with it
+	 */
+	private static synchronized EventStore getEventStore(Config config) throws IOException {
+		if (eventStore == null) {
+			eventStore = new EventStore();
+			new QueryServer(eventStore, config.getInt("memory.query.port", 9001)).startServer();
+		}
+		return eventStore;
+	}
 }
@@ -24,21 +24,25 @@ import org.slf4j.LoggerFactory;
 import com.google.gson.Gson;
 import com.google.gson.GsonBuilder;
 
+import jj.jvminspector.jvmheapsearcher.model.Event;
+import jj.jvminspector.jvmheapsearcher.model.HeapSnapshot;
+import jj.jvminspector.jvmheapsearcher.model.IdRanges;
 import jj.jvminspector.jvmheapsearcher.model.Line;
-import jj.jvminspector.jvmheapsearcher.model.ObjectType;
-import jj.jvminspector.jvmheapsearcher.model.StackTraceElement;
+import jj.jvminspector.jvmheapsearcher.model.SiteLifetimes;
+import jj.jvminspector.jvmheapsearcher.model.SiteSnapshot;
+import jj.jvminspector.jvmheapsearcher.model.ThreadSnapshot;
 import jj.jvminspector.jvmheapsearcher.processor.Processor;
 
 
 public class ElasticsearchProcessor implements Processor {
 	private final static Logger log = Logs.getLogger();
-	private BlockingQueue<String> inputQueue;
+	private BlockingQueue<Event> inputQueue;
 	private Gson gson;
 	private Client client;
 	private String index;
 	private ElasticTable table;
 
-	public ElasticsearchProcessor(BlockingQueue<String> inputQueueParam) throws IOException {
+	public ElasticsearchProcessor(BlockingQueue<Event> inputQueueParam) throws IOException {
 		this.inputQueue = inputQueueParam;
 		this.gson = new GsonBuilder().setPrettyPrinting().create();
 		Config config = Main.config();
@@ -49,8 +53,73 @@ public class ElasticsearchProcessor implements Processor {
 	}
 
 	@Override
-	public void processLine(String lineStr) {
-		Line line = parseLine(lineStr);
+	public void processLine(Line line) {
+		table.putRow(createRow(line));
+	}
+
+	@Override
+	public void processSnapshot(SiteSnapshot snapshot) {
+		Row row = new Row(Key.of(snapshot.getTraceId() + "_" + snapshot.getTime()));
+		row.putCell("traceId", snapshot.getTraceId());
+		row.putCell("time", snapshot.getTime());
+		row.putCell("allocated", snapshot.getAllocated());
+		row.putCell("freed", snapshot.getFreed());
+		row.putCell("liveCount", snapshot.getLiveCount());
+		row.putCell("liveBytes", snapshot.getLiveBytes());
+		row.putCell("stackTraceElementList", snapshot.getStackTraceElementList());
+		table.putRow(row);
+	}
+
+	@Override
+	public void processLifetimes(SiteLifetimes lifetimes) {
+		Row row = new Row(Key.of("lifetimes_" + lifetimes.getTraceId()));
+		row.putCell("traceId", lifetimes.getTraceId());
+		row.putCell("time", lifetimes.getTime());
+		row.putCell("freed", lifetimes.getCount());
+		row.putCell("p50Nanos", lifetimes.percentileNanos(50));
+		row.putCell("p90Nanos", lifetimes.percentileNanos(90));
+		row.putCell("p99Nanos", lifetimes.percentileNanos(99));
+		row.putCell("p50GcCycles", lifetimes.percentileGcCycles(50));
+		row.putCell("p90GcCycles", lifetimes.percentileGcCycles(90));
+		row.putCell("p99GcCycles", lifetimes.percentileGcCycles(99));
+		row.putCell("stackTraceElementList", lifetimes.getStackTraceElementList());
+		table.putRow(row);
+	}
+
+	@Override
+	public void processHeapSnapshot(HeapSnapshot heapSnapshot) {
+		Row row = new Row(Key.of("heapSnapshot_" + heapSnapshot.getTime()));
+		row.putCell("time", heapSnapshot.getTime());
+		row.putCell("sequence", heapSnapshot.getSequence());
+		row.putCell("liveCount", heapSnapshot.getLive().getCount());
+		row.putCell("previousTime", heapSnapshot.getPreviousTime());
+		row.putCell("createdCount", heapSnapshot.getCreated().getCount());
+		row.putCell("freedCount", heapSnapshot.getFreed().getCount());
+		// object rows are keyed by id, these lead to the objects created since and still alive
+		row.putCell("createdRanges", rangeList(heapSnapshot.getCreated()));
+		table.putRow(row);
+	}
+
+	@Override
+	public void processThreadSnapshot(ThreadSnapshot snapshot) {
+		Row row = new Row(Key.of("thread_" + snapshot.getThreadId() + "_" + snapshot.getTime()));
+		row.putCell("threadId", snapshot.getThreadId());
+		row.putCell("threadName", snapshot.getThreadName() != null ? snapshot.getThreadName() : "");
+		row.putCell("threadGroup", snapshot.getThreadGroup() != null ? snapshot.getThreadGroup() : "");
+		row.putCell("time", snapshot.getTime());
+		row.putCell("allocated", snapshot.getAllocated());
+		row.putCell("allocatedBytes", snapshot.getAllocatedBytes());
+		row.putCell("totalAllocated", snapshot.getTotalAllocated());
+		row.putCell("totalBytes", snapshot.getTotalBytes());
+		table.putRow(row);
+	}
+
+	private List<String> rangeList(IdRanges ranges) {
+		List<String> result = new ArrayList<>(ranges.getRangeCount());
+		for (int i = 0; i < ranges.getRangeCount(); i++) {
+			result.add(ranges.getStart(i) + "-" + (ranges.getEnd(i) - 1));
+		}
+		return result;
 	}
 
 	@Override
@@ -60,9 +129,7 @@ public class ElasticsearchProcessor implements Processor {
 				Sleep.softly(100L);
 				continue;
 			}
-			Line line = parseLine(inputQueue.take());
-			Row row = createRow(line);
-			table.putRow(row);
+			process(inputQueue.take());
 		}
 	}
 
@@ -74,61 +141,17 @@ public class ElasticsearchProcessor implements Processor {
 		row.putCell("created", line.isCreated());
 		row.putCell("createdTime", line.getCreateTime());
 		row.putCell("destroyTime", line.getDestroyTime());
+		row.putCell("traceId", line.getTraceId());
+		row.putCell("weight", line.getWeight());
+		row.putCell("size", line.getSize());
+		row.putCell("gcEpoch", line.getGcEpoch());
+		row.putCell("className", line.getClassName() != null ? line.getClassName() : "");
+		row.putCell("elementType", line.getElementType() != null ? line.getElementType() : "");
+		row.putCell("arrayLength", line.getArrayLength());
+		row.putCell("threadId", line.getThreadId());
+		row.putCell("threadName", line.getThreadName() != null ? line.getThreadName() : "");
+		row.putCell("threadGroup", line.getThreadGroup() != null ? line.getThreadGroup() : "");
 		row.putCell("stackTraceElementList", line.getStackTraceElementList());
 		return row;
 	}
-
-	private Line parseLine(String lineStr) {
-		Line line = new Line();
-		String[] data = lineStr.split("_");
-		if (data == null || data.length == 0) {
-			throw new IllegalArgumentException("Could not parse line ");
-		}
-		line.setCreated("c".equals(data[0]));
-		line.setId(Long.parseLong(data[1]));
-		if (line.isCreated()) {
-			line.setObjectType(ObjectType.get(data[2]));
-			line.setCreateTime(Long.parseLong(data[3]));
-			line.setStackTraceElementList(parseStackTraceElement(data[4]));
-		} else {
-			if (data.length > 2) {
-				line.setDestroyTime(Long.parseLong(data[2]));
-			}
-		}
-		return line;
-	}
-
-	private List<StackTraceElement> parseStackTraceElement(String str) {
-		List<StackTraceElement> result = new ArrayList<>();
-		String[] stackTraceElementsStr = str.split(",");
-
-		for (String stackTraceElementStr : stackTraceElementsStr) {
-			try {
-				StackTraceElement stackTraceElement = new StackTraceElement();
-				int start = 0;
-				int end = stackTraceElementStr.indexOf('.');
-				stackTraceElement.setClassSignature(stackTraceElementStr.substring(0, end));
-				start = end + 1;
-				end = stackTraceElementStr.indexOf('@', start);
-				stackTraceElement.setMethodName(stackTraceElementStr.substring(start, end));
-				start = end + 1;
-				end = stackTraceElementStr.indexOf('[');
-				stackTraceElement.setMethodLineNumber(Integer.parseInt(stackTraceElementStr
-						.substring(start, end)));
-
-				start = end + 1;
-				end = stackTraceElementStr.indexOf(':');
-				stackTraceElement.setFileName(stackTraceElementStr.substring(start, end));
-
-				start = end + 1;
-				end = stackTraceElementStr.indexOf(']');
-				stackTraceElement.setLineNumber(Integer.parseInt(stackTraceElementStr
-						.substring(start, end)));
-				result.add(stackTraceElement);
-			} catch (Exception ex) {
-				log.warn("failed to parse " + stackTraceElementsStr);
-			}
-		}
-		return result;
-	}
 }
\ No newline at end of file
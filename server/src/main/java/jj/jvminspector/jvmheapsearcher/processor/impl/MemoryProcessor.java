@@ -0,0 +1,131 @@
+package jj.jvminspector.jvmheapsearcher.processor.impl;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import com.lithium.flow.util.Logs;
+import com.lithium.flow.util.Sleep;
+
+import java.util.Arrays;
+import java.util.HashMap;
+import java.util.List;
+import java.util.Map;
+import java.util.concurrent.BlockingQueue;
+
+import org.slf4j.Logger;
+
+import jj.jvminspector.jvmheapsearcher.model.Event;
+import jj.jvminspector.jvmheapsearcher.model.HeapSnapshot;
+import jj.jvminspector.jvmheapsearcher.model.Line;
+import jj.jvminspector.jvmheapsearcher.model.SiteLifetimes;
+import jj.jvminspector.jvmheapsearcher.model.SiteSnapshot;
+import jj.jvminspector.jvmheapsearcher.model.StackTraceElement;
+import jj.jvminspector.jvmheapsearcher.model.ThreadSnapshot;
+import jj.jvminspector.jvmheapsearcher.processor.Processor;
+import jj.jvminspector.jvmheapsearcher.store.EventStore;
+
+/**
+ * Keeps the events of one connection in an {@link EventStore} shared by all of them. Creates
+ * and frees, and the per site snapshots of aggregate mode, or of objects an agent stopped
+ * tracking when it disengaged, become changes in live count and bytes of their site;
+ * lifetimes of freed objects go to the site's histogram. Heap and thread snapshots are not
+ * kept.
+ */
+public class MemoryProcessor implements Processor {
+	// trace ids are dense, larger ones are looked up every time
+	private static final int MAX_CACHED_TRACE = 1 << 20;
+
+	private static final Logger log = Logs.getLogger();
+	private final BlockingQueue<Event> inputQueue;
+	private final EventStore store;
+	// site codes by trace id of this connection, plus one, 0 if not looked up yet
+	private int[] siteCodes = new int[1024];
+	// running totals the agent last reported per trace id, the store takes their changes
+	private final Map<Long, Long> liveBytes = new HashMap<>();
+	private final Map<Long, long[]> lifetimes = new HashMap<>();
+
+	public MemoryProcessor(BlockingQueue<Event> inputQueue, EventStore store) {
+		this.inputQueue = inputQueue;
+		this.store = store;
+		log.info("initialized MemoryProcessor");
+	}
+
+	@Override
+	public void processLine(Line line) {
+		int site = site(line.getTraceId(), line.getStackTraceElementList());
+		long weight = line.getWeight();
+		if (line.isCreated()) {
+			store.append(line.getCreateTime(), site, weight, line.getSize() * weight);
+			return;
+		}
+		store.append(line.getDestroyTime(), site, -weight, -line.getSize() * weight);
+		// frees of agents before batched frees know nothing of their creation
+		if (line.getCreateTime() > 0) {
+			store.addLifetime(site, line.getDestroyTime() - line.getCreateTime(), weight);
+		}
+	}
+
+	@Override
+	public void processSnapshot(SiteSnapshot snapshot) {
+		int site = site(snapshot.getTraceId(), snapshot.getStackTraceElementList());
+		Long previous = liveBytes.put(snapshot.getTraceId(), snapshot.getLiveBytes());
+		store.append(snapshot.getTime(), site, snapshot.getAllocated() - snapshot.getFreed(),
+				snapshot.getLiveBytes() - (previous != null ? previous : 0));
+	}
+
+	@Override
+	public void processLifetimes(SiteLifetimes siteLifetimes) {
+		int site = site(siteLifetimes.getTraceId(), siteLifetimes.getStackTraceElementList());
+		long[] nanos = siteLifetimes.getNanos();
+		long[] previous = lifetimes.computeIfAbsent(siteLifetimes.getTraceId(), id -> new long[nanos.length]);
+		long[] delta = new long[nanos.length];
+		for (int i = 0; i < nanos.length; i++) {
+			delta[i] = nanos[i] - previous[i];
+			previous[i] = nanos[i];
+		}
+		store.addLifetimes(site, delta);
+	}
+
+	@Override
+	public void processHeapSnapshot(HeapSnapshot heapSnapshot) {
+
+	}
+
+	@Override
+	public void processThreadSnapshot(ThreadSnapshot snapshot) {
+
+	}
+
+	/**
+	 * @return code of the site in the store
+	 */
+	private int site(long traceId, List<StackTraceElement> stack) {
+		if (traceId < 0 || traceId >= MAX_CACHED_TRACE) {
+			return store.getSites().encode(stack);
+		}
+		int trace = (int) traceId;
+		if (trace >= siteCodes.length) {
+			siteCodes = Arrays.copyOf(siteCodes, Math.max(trace + 1, siteCodes.length * 2));
+		}
+		if (siteCodes[trace] == 0) {
+			int code = store.getSites().encode(stack);
+			// a trace not defined yet may still get its stack
+			if (stack == null || stack.isEmpty()) {
+				return code;
+			}
+			siteCodes[trace] = code + 1;
+		}
+		return siteCodes[trace] - 1;
+	}
+
+	@Override
+	public Object call() throws Exception {
+		while (true) {
+			if (inputQueue.isEmpty()) {
+				Sleep.softly(100L);
+				continue;
+			}
+			process(inputQueue.take());
+		}
+	}
+}
@@ -10,19 +10,45 @@ import java.util.concurrent.BlockingQueue;
 
 import org.slf4j.Logger;
 
+import jj.jvminspector.jvmheapsearcher.model.Event;
+import jj.jvminspector.jvmheapsearcher.model.HeapSnapshot;
+import jj.jvminspector.jvmheapsearcher.model.Line;
+import jj.jvminspector.jvmheapsearcher.model.SiteLifetimes;
+import jj.jvminspector.jvmheapsearcher.model.SiteSnapshot;
+import jj.jvminspector.jvmheapsearcher.model.ThreadSnapshot;
 import jj.jvminspector.jvmheapsearcher.processor.Processor;
 
 public class NullProcessor implements Processor {
 	private static final Logger log = Logs.getLogger();
-	private BlockingQueue<String> inputQueue;
+	private BlockingQueue<Event> inputQueue;
 
-	public NullProcessor(BlockingQueue<String> inputQueue) {
+	public NullProcessor(BlockingQueue<Event> inputQueue) {
 		this.inputQueue = inputQueue;
 		log.info("initialized NullProcessor");
 	}
 
 	@Override
-	public void processLine(String line) {
+	public void processLine(Line line) {
+
+	}
+
+	@Override
+	public void processSnapshot(SiteSnapshot snapshot) {
+
+	}
+
+	@Override
+	public void processLifetimes(SiteLifetimes lifetimes) {
+
+	}
+
+	@Override
+	public void processHeapSnapshot(HeapSnapshot heapSnapshot) {
+
+	}
+
+	@Override
+	public void processThreadSnapshot(ThreadSnapshot snapshot) {
 
 	}
 
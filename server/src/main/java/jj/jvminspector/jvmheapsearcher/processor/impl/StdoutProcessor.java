@@ -10,14 +10,20 @@ import java.util.concurrent.BlockingQueue;
 
 import org.slf4j.Logger;
 
+import jj.jvminspector.jvmheapsearcher.model.Event;
+import jj.jvminspector.jvmheapsearcher.model.HeapSnapshot;
+import jj.jvminspector.jvmheapsearcher.model.Line;
+import jj.jvminspector.jvmheapsearcher.model.SiteLifetimes;
+import jj.jvminspector.jvmheapsearcher.model.SiteSnapshot;
+import jj.jvminspector.jvmheapsearcher.model.ThreadSnapshot;
 import jj.jvminspector.jvmheapsearcher.processor.Processor;
 
 
 public class StdoutProcessor implements Processor {
-	private final BlockingQueue<String> inputQueue;
+	private final BlockingQueue<Event> inputQueue;
 	private final static Logger log = Logs.getLogger();
 
-	public StdoutProcessor(BlockingQueue<String> inputQueueParam) {
+	public StdoutProcessor(BlockingQueue<Event> inputQueueParam) {
 		this.inputQueue = inputQueueParam;
 		log.info("initialized StdoutProcessor");
 	}
@@ -29,12 +35,32 @@ public class StdoutProcessor implements Processor {
 				Sleep.softly(100L);
 				continue;
 			}
-			processLine(inputQueue.take());
+			process(inputQueue.take());
 		}
 	}
 
 	@Override
-	public void processLine(String line) {
+	public void processLine(Line line) {
 		System.out.println(line);
 	}
+
+	@Override
+	public void processSnapshot(SiteSnapshot snapshot) {
+		System.out.println(snapshot);
+	}
+
+	@Override
+	public void processLifetimes(SiteLifetimes lifetimes) {
+		System.out.println(lifetimes);
+	}
+
+	@Override
+	public void processHeapSnapshot(HeapSnapshot heapSnapshot) {
+		System.out.println(heapSnapshot);
+	}
+
+	@Override
+	public void processThreadSnapshot(ThreadSnapshot snapshot) {
+		System.out.println(snapshot);
+	}
 }
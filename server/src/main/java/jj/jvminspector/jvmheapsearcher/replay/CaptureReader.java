@@ -0,0 +1,134 @@
+package jj.jvminspector.jvmheapsearcher.replay;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import java.io.Closeable;
+import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.channels.FileChannel;
+import java.nio.file.Path;
+import java.nio.file.StandardOpenOption;
+
+/**
+ * Reads a capture written by the agent's record=&lt;path&gt; option: what the agent encoded,
+ * before compression, in the blocks it flushed them in and with the time of each flush.
+ * <p>
+ * The capture starts with a 16 byte header: {@link #MAGIC}, version, wire format and the
+ * wall clock nanoseconds recording started at. Each block has a 24 byte header of its wall
+ * clock nanoseconds, length, flags and weighted event count, followed by its bytes. Numbers
+ * are in the agent's native byte order. A block flagged {@link #NEW_STREAM} starts what the
+ * agent sent on a new connection, after a reconnect or shared memory reader attach. A
+ * capture left behind by a crashed agent may end in the middle of a block, it is not read.
+ */
+public class CaptureReader implements Closeable {
+	public static final byte[] MAGIC = {'J', 'O', 'R'};
+	public static final int VERSION = 1;
+	public static final int FORMAT_BINARY = 0;
+	public static final int FORMAT_TEXT = 1;
+	public static final int NEW_STREAM = 1;
+	private static final int HEADER_SIZE = 16;
+	private static final int BLOCK_HEADER_SIZE = 24;
+
+	private final Path path;
+	private final FileChannel channel;
+	private final ByteBuffer header = ByteBuffer.allocate(BLOCK_HEADER_SIZE).order(ByteOrder.nativeOrder());
+	private final int format;
+	private final long startTime;
+
+	public CaptureReader(Path path) throws IOException {
+		this.path = path;
+		this.channel = FileChannel.open(path, StandardOpenOption.READ);
+		ByteBuffer buffer = ByteBuffer.allocate(HEADER_SIZE).order(ByteOrder.nativeOrder());
+		if (!readFully(buffer) || buffer.get(0) != MAGIC[0] || buffer.get(1) != MAGIC[1]
+				|| buffer.get(2) != MAGIC[2]) {
+			channel.close();
+			throw new IOException(path + " is not a capture");
+		}
+		if (buffer.get(3) != VERSION) {
+			channel.close();
+			throw new IOException(path + " has unsupported capture version " + buffer.get(3));
+		}
+		this.format = buffer.getInt(4);
+		this.startTime = buffer.getLong(8);
+	}
+
+	/**
+	 * @return next block, null at the end of the capture
+	 */
+	public Block next() throws IOException {
+		header.clear();
+		if (!readFully(header)) {
+			return null;
+		}
+		Block block = new Block();
+		block.time = header.getLong(0);
+		int length = header.getInt(8);
+		block.flags = header.getInt(12);
+		block.events = header.getLong(16);
+		if (length < 0) {
+			throw new IOException(path + " has a block of invalid length " + length);
+		}
+		block.data = new byte[length];
+		if (!readFully(ByteBuffer.wrap(block.data))) {
+			return null;
+		}
+		return block;
+	}
+
+	/**
+	 * @return false if the capture ended before the buffer was full
+	 */
+	private boolean readFully(ByteBuffer buffer) throws IOException {
+		while (buffer.hasRemaining()) {
+			if (channel.read(buffer) < 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	public Path getPath() {
+		return path;
+	}
+
+	public int getFormat() {
+		return format;
+	}
+
+	public long getStartTime() {
+		return startTime;
+	}
+
+	@Override
+	public void close() throws IOException {
+		channel.close();
+	}
+
+	/**
+	 * Bytes of one flush of the agent's output
+	 */
+	public static class Block {
+		long time;
+		int flags;
+		long events;
+		byte[] data;
+
+		public long getTime() {
+			return time;
+		}
+
+		public boolean isNewStream() {
+			return (flags & NEW_STREAM) != 0;
+		}
+
+		public long getEvents() {
+			return events;
+		}
+
+		public byte[] getData() {
+			return data;
+		}
+	}
+}
@@ -0,0 +1,291 @@
+package jj.jvminspector.jvmheapsearcher.replay;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import com.lithium.flow.util.Logs;
+
+import java.io.IOException;
+import java.io.InputStream;
+import java.net.Socket;
+import java.nio.file.Path;
+import java.nio.file.Paths;
+import java.util.ArrayList;
+import java.util.Collections;
+import java.util.List;
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.Future;
+import java.util.concurrent.TimeUnit;
+import java.util.concurrent.atomic.AtomicLong;
+import java.util.concurrent.locks.LockSupport;
+
+import org.slf4j.Logger;
+
+import jj.jvminspector.jvmheapsearcher.decoder.impl.BinaryDecoder;
+
+/**
+ * Load generator for the server: plays captures of the agent's record= option against it
+ * from a number of concurrent connections, as agents would have sent them, at their
+ * original pace, N times faster or as fast as the server takes them.
+ * <p>
+ * Connections play the captures round robin, each one from the start. A capture holding
+ * several streams, because the agent reconnected, plays them on connections of their own
+ * one after the other. Compression is not negotiated, the server decodes what the agent
+ * encoded.
+ * <p>
+ * Reports records per second, sustained over the whole run and every few seconds while
+ * playing, and the lag end to end: how late each block went out against the capture's
+ * pace, which grows once the server stops keeping up and the socket blocks, and how long
+ * the server took after the last byte of a stream to close it, which it does once its
+ * processor took everything off the queue.
+ * <p>
+ * Usage: CaptureReplayer &lt;host:port&gt; &lt;speed|max&gt; &lt;connections&gt; &lt;capture&gt;...
+ */
+public class CaptureReplayer {
+	private static final long REPORT_SECONDS = 5;
+
+	private static final Logger log = Logs.getLogger();
+	private final String host;
+	private final int port;
+	// 0 to play as fast as the server takes it
+	private final double speed;
+	private final AtomicLong records = new AtomicLong();
+	private final AtomicLong bytes = new AtomicLong();
+
+	public CaptureReplayer(String host, int port, double speed) {
+		this.host = host;
+		this.port = port;
+		this.speed = speed;
+	}
+
+	/**
+	 * Plays one capture on a connection of its own
+	 */
+	public Result play(Path capture) throws IOException {
+		Result result = new Result();
+		try (CaptureReader reader = new CaptureReader(capture)) {
+			boolean binary = reader.getFormat() == CaptureReader.FORMAT_BINARY;
+			Socket socket = null;
+			RecordCounter counter = null;
+			long base = -1;
+			long start = System.nanoTime();
+			try {
+				CaptureReader.Block block;
+				while ((block = reader.next()) != null) {
+					if (base < 0) {
+						base = block.getTime();
+					}
+					if (socket == null || block.isNewStream()) {
+						if (socket != null) {
+							finish(socket, result);
+						}
+						socket = new Socket(host, port);
+						counter = new RecordCounter(binary);
+						result.streams++;
+					}
+					if (speed > 0) {
+						long due = start + (long) ((block.getTime() - base) / speed);
+						long wait = due - System.nanoTime();
+						if (wait > 0) {
+							LockSupport.parkNanos(wait);
+						}
+						socket.getOutputStream().write(block.getData());
+						result.lags.add(Math.max(0, System.nanoTime() - due));
+					} else {
+						socket.getOutputStream().write(block.getData());
+					}
+					long count = counter.count(block.getData());
+					result.records += count;
+					result.events += block.getEvents();
+					result.bytes += block.getData().length;
+					records.addAndGet(count);
+					bytes.addAndGet(block.getData().length);
+				}
+				if (socket != null) {
+					finish(socket, result);
+					socket = null;
+				}
+			} finally {
+				if (socket != null) {
+					socket.close();
+				}
+				result.nanos = System.nanoTime() - start;
+			}
+		}
+		return result;
+	}
+
+	/**
+	 * Ends a stream and waits for the server to be done with it
+	 */
+	private void finish(Socket socket, Result result) throws IOException {
+		socket.shutdownOutput();
+		long start = System.nanoTime();
+		// commands the server sent are of no use without an agent
+		InputStream in = socket.getInputStream();
+		byte[] discard = new byte[4096];
+		while (in.read(discard) >= 0) {
+			continue;
+		}
+		result.drainNanos = Math.max(result.drainNanos, System.nanoTime() - start);
+		socket.close();
+	}
+
+	/**
+	 * Counts records of a stream as its bytes go out, binary records may span blocks
+	 */
+	static class RecordCounter {
+		private final boolean binary;
+		// bytes left of the stream header or the current record
+		private long skip;
+		private long length;
+		private int shift;
+
+		RecordCounter(boolean binary) {
+			this.binary = binary;
+			this.skip = binary ? BinaryDecoder.MAGIC.length + 1 : 0;
+		}
+
+		/**
+		 * @return number of records completed by the bytes
+		 */
+		long count(byte[] data) {
+			long count = 0;
+			if (!binary) {
+				for (byte b : data) {
+					if (b == '\n') {
+						count++;
+					}
+				}
+				return count;
+			}
+			int position = 0;
+			while (position < data.length) {
+				if (skip > 0) {
+					int n = (int) Math.min(skip, data.length - position);
+					position += n;
+					skip -= n;
+					continue;
+				}
+				int b = data[position++] & 0xff;
+				length |= (long) (b & 0x7f) << shift;
+				shift += 7;
+				if ((b & 0x80) == 0) {
+					count++;
+					skip = length;
+					length = 0;
+					shift = 0;
+				}
+			}
+			return count;
+		}
+	}
+
+	/**
+	 * What one connection played
+	 */
+	public static class Result {
+		int streams;
+		long records;
+		long events;
+		long bytes;
+		long nanos;
+		long drainNanos;
+		List<Long> lags = new ArrayList<>();
+
+		void add(Result other) {
+			streams += other.streams;
+			records += other.records;
+			events += other.events;
+			bytes += other.bytes;
+			nanos = Math.max(nanos, other.nanos);
+			drainNanos = Math.max(drainNanos, other.drainNanos);
+			lags.addAll(other.lags);
+		}
+
+		/**
+		 * @return the given percentile of block lags in milliseconds, 0 if none were measured
+		 */
+		double lagMillis(double percentile) {
+			if (lags.isEmpty()) {
+				return 0;
+			}
+			Collections.sort(lags);
+			int rank = (int) Math.ceil(lags.size() * percentile / 100.0);
+			return lags.get(Math.max(0, rank - 1)) / 1e6;
+		}
+
+		@Override
+		public String toString() {
+			double seconds = nanos / 1e9;
+			return "Result{" +
+					"streams=" + streams +
+					", records=" + records +
+					", events=" + events +
+					", bytes=" + bytes +
+					", seconds=" + String.format("%.3f", seconds) +
+					", recordsPerSecond=" + String.format("%.0f", seconds > 0 ? records / seconds : 0) +
+					", megabytesPerSecond=" + String.format("%.2f", seconds > 0 ? bytes / seconds / 1e6 : 0) +
+					", p50LagMillis=" + String.format("%.3f", lagMillis(50)) +
+					", p99LagMillis=" + String.format("%.3f", lagMillis(99)) +
+					", maxLagMillis=" + String.format("%.3f", lagMillis(100)) +
+					", drainMillis=" + String.format("%.3f", drainNanos / 1e6) +
+					'}';
+		}
+	}
+
+	public static void main(String[] args) throws Exception {
+		if (args.length < 4 || args[0].indexOf(':') < 0) {
+			System.err.println("usage: CaptureReplayer <host:port> <speed|max> <connections> <capture>...");
+			System.exit(1);
+		}
+		String host = args[0].substring(0, args[0].lastIndexOf(':'));
+		int port = Integer.parseInt(args[0].substring(args[0].lastIndexOf(':') + 1));
+		double speed = "max".equals(args[1]) ? 0 : Double.parseDouble(args[1]);
+		int connections = Integer.parseInt(args[2]);
+		if (speed < 0 || connections <= 0) {
+			System.err.println("speed must be positive or max, connections at least 1");
+			System.exit(1);
+		}
+		List<Path> captures = new ArrayList<>();
+		for (int i = 3; i < args.length; i++) {
+			captures.add(Paths.get(args[i]));
+		}
+
+		CaptureReplayer replayer = new CaptureReplayer(host, port, speed);
+		ExecutorService executor = Executors.newFixedThreadPool(connections);
+		List<Future<Result>> futures = new ArrayList<>();
+		for (int i = 0; i < connections; i++) {
+			Path capture = captures.get(i % captures.size());
+			futures.add(executor.submit(() -> replayer.play(capture)));
+		}
+		executor.shutdown();
+		log.info("playing {} captures to {}:{} from {} connections at {}", captures.size(), host, port,
+				connections, speed > 0 ? speed + "x" : "max speed");
+
+		long lastRecords = 0;
+		long lastBytes = 0;
+		while (!executor.awaitTermination(REPORT_SECONDS, TimeUnit.SECONDS)) {
+			long recordsNow = replayer.records.get();
+			long bytesNow = replayer.bytes.get();
+			log.info("{} records/s, {} MB/s", (recordsNow - lastRecords) / REPORT_SECONDS,
+					String.format("%.2f", (bytesNow - lastBytes) / 1e6 / REPORT_SECONDS));
+			lastRecords = recordsNow;
+			lastBytes = bytesNow;
+		}
+
+		Result total = new Result();
+		for (int i = 0; i < futures.size(); i++) {
+			try {
+				Result result = futures.get(i).get();
+				log.info("connection {}: {}", i, result);
+				total.add(result);
+			} catch (ExecutionException e) {
+				log.error("connection {} failed", i, e.getCause());
+			}
+		}
+		log.info("total: {}", total);
+	}
+}
@@ -0,0 +1,215 @@
+package jj.jvminspector.jvmheapsearcher.shm;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import java.io.IOException;
+import java.io.InputStream;
+import java.lang.management.ManagementFactory;
+import java.lang.reflect.Field;
+import java.nio.Buffer;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.MappedByteBuffer;
+import java.nio.channels.FileChannel;
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.nio.file.Paths;
+import java.nio.file.StandardOpenOption;
+import java.util.concurrent.TimeUnit;
+import java.util.concurrent.locks.LockSupport;
+
+import sun.misc.Unsafe;
+
+/**
+ * Reads the stream an agent started with output=shm:&lt;name&gt; writes into the ring at
+ * /dev/shm/&lt;name&gt;, straight out of the mapping. The stream is the same one a socket
+ * connection would carry.
+ * <p>
+ * The ring starts with a 192 byte header in the agent's native byte order: {@link #MAGIC},
+ * version, capacity, the agent's pid, a closed flag, then the reader's attach requests and
+ * pid, the epoch and start of the stream the agent restarted for the last attach, and heap
+ * snapshot requests. Head, the bytes the agent wrote, and tail, the bytes read, sit on
+ * cache lines of their own. The agent never wakes the reader, an idle reader polls head,
+ * yielding at first and then parking for up to {@link #MAX_PARK_NANOS}.
+ * <p>
+ * The agent publishes with acquire/release atomics, so the fields the two sides hand over
+ * are loaded and stored here with {@link Unsafe}'s volatile loads and ordered stores on
+ * the mapping's address: data is only copied after head is loaded, and tail only moves
+ * once it was copied.
+ */
+public class ShmRing extends InputStream {
+	public static final byte[] MAGIC = {'J', 'O', 'M'};
+	public static final int VERSION = 1;
+	private static final int CAPACITY = 4;
+	private static final int AGENT_PID = 8;
+	private static final int CLOSED = 12;
+	private static final int ATTACH_REQUESTS = 16;
+	private static final int READER_PID = 20;
+	private static final int STREAM_EPOCH = 24;
+	private static final int STREAM_START = 32;
+	private static final int SNAPSHOT_REQUESTS = 40;
+	private static final int HEAD = 64;
+	private static final int TAIL = 128;
+	private static final int HEADER_SIZE = 192;
+	private static final int YIELDS = 100;
+	private static final long MAX_PARK_NANOS = TimeUnit.MILLISECONDS.toNanos(1);
+	// how often an idle reader checks the agent is still there
+	private static final long LIVENESS_NANOS = TimeUnit.SECONDS.toNanos(1);
+	private static final Unsafe UNSAFE;
+	private static final long ADDRESS_OFFSET;
+
+	static {
+		try {
+			Field field = Unsafe.class.getDeclaredField("theUnsafe");
+			field.setAccessible(true);
+			UNSAFE = (Unsafe) field.get(null);
+			ADDRESS_OFFSET = UNSAFE.objectFieldOffset(Buffer.class.getDeclaredField("address"));
+		} catch (ReflectiveOperationException e) {
+			throw new ExceptionInInitializerError(e);
+		}
+	}
+
+	private final MappedByteBuffer header;
+	private final ByteBuffer data;
+	// address of the mapping, which header keeps alive
+	private final long address;
+	private final int mask;
+	private final int agentPid;
+	private long tail;
+	private long head;
+	private boolean ended;
+
+	/**
+	 * Maps the ring
+	 * @throws IOException if there is no ring, or the agent did not finish creating it yet
+	 */
+	public ShmRing(String name) throws IOException {
+		Path path = Paths.get("/dev/shm", name);
+		try (FileChannel channel = FileChannel.open(path, StandardOpenOption.READ, StandardOpenOption.WRITE)) {
+			if (channel.size() < HEADER_SIZE) {
+				throw new IOException(path + " is not a ring");
+			}
+			header = channel.map(FileChannel.MapMode.READ_WRITE, 0, channel.size());
+		}
+		header.order(ByteOrder.nativeOrder());
+		if (header.get(0) != MAGIC[0] || header.get(1) != MAGIC[1] || header.get(2) != MAGIC[2]) {
+			throw new IOException(path + " is not a ring");
+		}
+		if (header.get(3) != VERSION) {
+			throw new IOException(path + " has unsupported version " + header.get(3));
+		}
+		int capacity = header.getInt(CAPACITY);
+		if (Integer.bitCount(capacity) != 1 || header.capacity() < HEADER_SIZE + capacity) {
+			throw new IOException(path + " has invalid capacity " + capacity);
+		}
+		mask = capacity - 1;
+		agentPid = header.getInt(AGENT_PID);
+		address = UNSAFE.getLong(header, ADDRESS_OFFSET);
+		header.position(HEADER_SIZE);
+		data = header.slice();
+		header.position(0);
+	}
+
+	/**
+	 * Asks the agent for a fresh stream and waits until it started one
+	 * @return false if the agent went away first
+	 */
+	public boolean attach() {
+		header.putInt(READER_PID, currentPid());
+		int epoch = header.getInt(ATTACH_REQUESTS) + 1;
+		// the agent finds the reader pid once it sees the request
+		UNSAFE.putOrderedInt(null, address + ATTACH_REQUESTS, epoch);
+		for (int idle = 0; UNSAFE.getIntVolatile(null, address + STREAM_EPOCH) != epoch; idle++) {
+			if (!backoff(idle)) {
+				return false;
+			}
+		}
+		tail = header.getLong(STREAM_START);
+		head = tail;
+		UNSAFE.putOrderedLong(null, address + TAIL, tail);
+		return true;
+	}
+
+	public void requestHeapSnapshot() {
+		UNSAFE.putOrderedLong(null, address + SNAPSHOT_REQUESTS, header.getLong(SNAPSHOT_REQUESTS) + 1);
+	}
+
+	@Override
+	public int read() throws IOException {
+		byte[] b = new byte[1];
+		return read(b, 0, 1) < 0 ? -1 : b[0] & 0xff;
+	}
+
+	/**
+	 * Blocks until the agent wrote something
+	 * @return -1 once the agent closed the ring or died and everything it wrote was read
+	 */
+	@Override
+	public int read(byte[] b, int off, int len) throws IOException {
+		if (len == 0) {
+			return 0;
+		}
+		for (int idle = 0; head == tail; idle++) {
+			head = UNSAFE.getLongVolatile(null, address + HEAD);
+			if (head != tail) {
+				break;
+			}
+			if (ended || !backoff(idle)) {
+				ended = true;
+				return -1;
+			}
+		}
+		int offset = (int) (tail & mask);
+		int n = (int) Math.min(Math.min(len, head - tail), mask + 1 - offset);
+		ByteBuffer view = data.duplicate();
+		view.position(offset);
+		view.get(b, off, n);
+		tail += n;
+		// the agent may overwrite the bytes once it sees them read
+		UNSAFE.putOrderedLong(null, address + TAIL, tail);
+		return n;
+	}
+
+	@Override
+	public int available() {
+		return (int) Math.min(Integer.MAX_VALUE, head - tail);
+	}
+
+	/**
+	 * Detaches, the agent removes the ring once it is done with it
+	 */
+	@Override
+	public void close() {
+		UNSAFE.putOrderedInt(null, address + READER_PID, 0);
+	}
+
+	/**
+	 * Waits a little longer the longer the ring stays idle
+	 * @return false if the agent is gone
+	 */
+	private boolean backoff(int idle) {
+		if (idle < YIELDS) {
+			Thread.yield();
+			return true;
+		}
+		long parkNanos = Math.min(MAX_PARK_NANOS, 1000L << Math.min(idle - YIELDS, 10));
+		if (idle % (LIVENESS_NANOS / MAX_PARK_NANOS) == 0 && !agentAlive()) {
+			return false;
+		}
+		LockSupport.parkNanos(parkNanos);
+		// the closed flag is set after the last byte
+		return UNSAFE.getIntVolatile(null, address + CLOSED) == 0
+				|| UNSAFE.getLongVolatile(null, address + HEAD) != tail;
+	}
+
+	private boolean agentAlive() {
+		return UNSAFE.getIntVolatile(null, address + CLOSED) == 0
+				&& Files.exists(Paths.get("/proc", Integer.toString(agentPid)));
+	}
+
+	private static int currentPid() {
+		String name = ManagementFactory.getRuntimeMXBean().getName();
+		return Integer.parseInt(name.substring(0, name.indexOf('@')));
+	}
+}
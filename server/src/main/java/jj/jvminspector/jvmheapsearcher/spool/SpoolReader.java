@@ -0,0 +1,176 @@
+package jj.jvminspector.jvmheapsearcher.spool;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import com.lithium.flow.util.Logs;
+
+import java.io.BufferedOutputStream;
+import java.io.IOException;
+import java.io.OutputStream;
+import java.net.Socket;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.MappedByteBuffer;
+import java.nio.channels.FileChannel;
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.nio.file.Paths;
+import java.nio.file.StandardOpenOption;
+import java.util.ArrayList;
+import java.util.List;
+
+import org.slf4j.Logger;
+
+import jj.jvminspector.jvmheapsearcher.decoder.impl.BinaryDecoder;
+
+/**
+ * Streams a spool written by the agent's output=file:&lt;path&gt; mode into a server,
+ * exactly as the agent would have sent it over a socket.
+ * <p>
+ * The spool is a sequence of segments &lt;path&gt;.000000, &lt;path&gt;.000001, ... each starting
+ * with a 16 byte header: {@link #MAGIC}, version, segment sequence and the number of
+ * committed data bytes in the agent's native byte order. A spool left behind by a crashed
+ * agent may end in the middle of a record, the incomplete tail is not sent.
+ * <p>
+ * Usage: SpoolReader &lt;path&gt; [host] [port]
+ */
+public class SpoolReader {
+	public static final byte[] MAGIC = {'J', 'O', 'S'};
+	public static final int VERSION = 1;
+	private static final int HEADER_SIZE = 16;
+
+	private static final Logger log = Logs.getLogger();
+	private final List<ByteBuffer> segments = new ArrayList<>();
+	private final List<Long> starts = new ArrayList<>();
+	private long length;
+	private int cursor;
+
+	public SpoolReader(Path path) throws IOException {
+		for (int sequence = 0; ; sequence++) {
+			Path segmentPath = Paths.get(path + String.format(".%06d", sequence));
+			if (!Files.exists(segmentPath)) {
+				break;
+			}
+			ByteBuffer data = readSegment(segmentPath, sequence);
+			if (data == null) {
+				break;
+			}
+			starts.add(length);
+			segments.add(data);
+			length += data.remaining();
+		}
+		log.info("found {} segments, {} bytes in {}", segments.size(), length, path);
+	}
+
+	private ByteBuffer readSegment(Path segmentPath, int sequence) throws IOException {
+		MappedByteBuffer buffer;
+		try (FileChannel channel = FileChannel.open(segmentPath, StandardOpenOption.READ)) {
+			buffer = channel.map(FileChannel.MapMode.READ_ONLY, 0, channel.size());
+		}
+		buffer.order(ByteOrder.nativeOrder());
+		if (buffer.capacity() < HEADER_SIZE || buffer.get(0) != MAGIC[0] || buffer.get(1) != MAGIC[1]
+				|| buffer.get(2) != MAGIC[2]) {
+			log.warn("{} is not a spool segment, stopping", segmentPath);
+			return null;
+		}
+		if (buffer.get(3) != VERSION || buffer.getInt(4) != sequence) {
+			log.warn("{} has unsupported version or sequence, stopping", segmentPath);
+			return null;
+		}
+		long committed = buffer.getLong(8);
+		if (committed < 0 || committed > buffer.capacity() - HEADER_SIZE) {
+			log.warn("{} has invalid committed length {}, stopping", segmentPath, committed);
+			return null;
+		}
+		buffer.position(HEADER_SIZE);
+		buffer.limit(HEADER_SIZE + (int) committed);
+		return buffer.slice();
+	}
+
+	/**
+	 * @return length of the stream up to the end of its last complete record
+	 */
+	public long completeLength() {
+		if (length >= BinaryDecoder.MAGIC.length + 1 && byteAt(0) == BinaryDecoder.MAGIC[0]
+				&& byteAt(1) == BinaryDecoder.MAGIC[1] && byteAt(2) == BinaryDecoder.MAGIC[2]) {
+			long position = BinaryDecoder.MAGIC.length + 1;
+			while (position < length) {
+				long recordLength = 0;
+				int shift = 0;
+				long next = position;
+				int b;
+				do {
+					if (next >= length) {
+						return position;
+					}
+					b = byteAt(next++);
+					recordLength |= (long) (b & 0x7f) << shift;
+					shift += 7;
+				} while ((b & 0x80) != 0);
+				if (next + recordLength > length) {
+					return position;
+				}
+				position = next + recordLength;
+			}
+			return position;
+		}
+		// text format, complete up to the last line break
+		for (long position = length - 1; position >= 0; position--) {
+			if (byteAt(position) == '\n') {
+				return position + 1;
+			}
+		}
+		return 0;
+	}
+
+	/**
+	 * Writes the complete part of the stream
+	 * @return number of bytes written
+	 */
+	public long copyTo(OutputStream out) throws IOException {
+		long end = completeLength();
+		if (end < length) {
+			log.warn("dropping {} bytes of incomplete record at the end of spool", length - end);
+		}
+		byte[] chunk = new byte[65536];
+		long written = 0;
+		for (ByteBuffer segment : segments) {
+			ByteBuffer data = segment.duplicate();
+			while (data.hasRemaining() && written < end) {
+				int n = (int) Math.min(Math.min(chunk.length, data.remaining()), end - written);
+				data.get(chunk, 0, n);
+				out.write(chunk, 0, n);
+				written += n;
+			}
+		}
+		return written;
+	}
+
+	private int byteAt(long position) {
+		// mostly walked forward, so start from the last segment looked at
+		if (position < starts.get(cursor)) {
+			cursor = 0;
+		}
+		while (cursor + 1 < starts.size() && starts.get(cursor + 1) <= position) {
+			cursor++;
+		}
+		return segments.get(cursor).get((int) (position - starts.get(cursor))) & 0xff;
+	}
+
+	public static void main(String[] args) throws IOException {
+		if (args.length < 1) {
+			System.err.println("usage: SpoolReader <path> [host] [port]");
+			System.exit(1);
+		}
+		String host = args.length > 1 ? args[1] : "127.0.0.1";
+		int port = args.length > 2 ? Integer.parseInt(args[2]) : 9000;
+		SpoolReader reader = new SpoolReader(Paths.get(args[0]));
+		try (Socket socket = new Socket(host, port);
+		     OutputStream out = new BufferedOutputStream(socket.getOutputStream())) {
+			long written = reader.copyTo(out);
+			out.flush();
+			log.info("sent {} bytes to {}:{}", written, host, port);
+		}
+	}
+}
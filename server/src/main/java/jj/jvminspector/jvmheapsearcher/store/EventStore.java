@@ -0,0 +1,187 @@
+package jj.jvminspector.jvmheapsearcher.store;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import com.lithium.flow.util.Logs;
+
+import java.util.Arrays;
+
+import org.slf4j.Logger;
+
+import jj.jvminspector.jvmheapsearcher.model.SiteLifetimes;
+
+/**
+ * In memory columnar store of the change in live objects per allocation site: one row per
+ * create, free or aggregate snapshot, with its time, dictionary encoded site, change in live
+ * count and change in live bytes, each column in chunks of primitive arrays. Lifetimes are
+ * kept as histograms per site, with the same buckets as {@link SiteLifetimes}.
+ * <p>
+ * Any number of connections append, serialized on the store. Queries scan the rows appended
+ * before they started without taking the lock, rows are never changed once appended.
+ */
+public class EventStore {
+	private static final int CHUNK_BITS = 16;
+	private static final int CHUNK_SIZE = 1 << CHUNK_BITS;
+	// 2^31 rows at 28 bytes each
+	private static final int MAX_CHUNKS = 1 << 15;
+
+	private static final Logger log = Logs.getLogger();
+	private final SiteDictionary sites = new SiteDictionary();
+	private final long[][] times = new long[MAX_CHUNKS][];
+	private final int[][] siteCodes = new int[MAX_CHUNKS][];
+	private final long[][] counts = new long[MAX_CHUNKS][];
+	private final long[][] bytes = new long[MAX_CHUNKS][];
+	// rows visible to queries, bumped after the row is written
+	private volatile long size;
+	private volatile long lastTime;
+	private long lost;
+	// lifetime histograms by site code, guarded by the store
+	private long[][] lifetimes = new long[0][];
+
+	public SiteDictionary getSites() {
+		return sites;
+	}
+
+	/**
+	 * Adds a row, dropped if the store is full
+	 * @param count change in live objects, weighted
+	 * @param byteCount change in live bytes
+	 */
+	public synchronized void append(long time, int site, long count, long byteCount) {
+		long row = size;
+		int chunk = (int) (row >>> CHUNK_BITS);
+		if (chunk >= MAX_CHUNKS) {
+			if (lost++ == 0) {
+				log.warn("event store is full, dropping rows");
+			}
+			return;
+		}
+		if (times[chunk] == null) {
+			times[chunk] = new long[CHUNK_SIZE];
+			siteCodes[chunk] = new int[CHUNK_SIZE];
+			counts[chunk] = new long[CHUNK_SIZE];
+			bytes[chunk] = new long[CHUNK_SIZE];
+		}
+		int index = (int) row & (CHUNK_SIZE - 1);
+		times[chunk][index] = time;
+		siteCodes[chunk][index] = site;
+		counts[chunk][index] = count;
+		bytes[chunk][index] = byteCount;
+		if (time > lastTime) {
+			lastTime = time;
+		}
+		size = row + 1;
+	}
+
+	/**
+	 * Counts a weighted lifetime of an object of the site
+	 */
+	public synchronized void addLifetime(int site, long nanos, long weight) {
+		lifetimes(site)[SiteLifetimes.bucket(nanos, SiteLifetimes.LIFETIME_BUCKETS)] += weight;
+	}
+
+	/**
+	 * Adds bucket counts of lifetimes of objects of the site
+	 */
+	public synchronized void addLifetimes(int site, long[] nanos) {
+		long[] histogram = lifetimes(site);
+		for (int i = 0; i < nanos.length && i < histogram.length; i++) {
+			histogram[i] += nanos[i];
+		}
+	}
+
+	private long[] lifetimes(int site) {
+		if (site >= lifetimes.length) {
+			lifetimes = Arrays.copyOf(lifetimes, Math.max(site + 1, lifetimes.length * 2));
+		}
+		if (lifetimes[site] == null) {
+			lifetimes[site] = new long[SiteLifetimes.LIFETIME_BUCKETS];
+		}
+		return lifetimes[site];
+	}
+
+	/**
+	 * @return lifetime histograms by site code, null for sites with none
+	 */
+	public synchronized long[][] lifetimeHistograms() {
+		long[][] result = new long[sites.size()][];
+		for (int site = 0; site < result.length && site < lifetimes.length; site++) {
+			if (lifetimes[site] != null) {
+				result[site] = lifetimes[site].clone();
+			}
+		}
+		return result;
+	}
+
+	/**
+	 * @return live count and live bytes by site code, as of the rows appended so far
+	 */
+	public long[][] liveBySite() {
+		long end = size;
+		// rows reference only sites encoded before them
+		int siteCount = sites.size();
+		long[] liveCount = new long[siteCount];
+		long[] liveBytes = new long[siteCount];
+		for (int chunk = 0; (long) chunk << CHUNK_BITS < end; chunk++) {
+			int rows = (int) Math.min(CHUNK_SIZE, end - ((long) chunk << CHUNK_BITS));
+			int[] chunkSites = siteCodes[chunk];
+			long[] chunkCounts = counts[chunk];
+			long[] chunkBytes = bytes[chunk];
+			for (int i = 0; i < rows; i++) {
+				liveCount[chunkSites[i]] += chunkCounts[i];
+				liveBytes[chunkSites[i]] += chunkBytes[i];
+			}
+		}
+		return new long[][]{liveCount, liveBytes};
+	}
+
+	/**
+	 * Live count of each site at the end of consecutive windows, the last one ending at the
+	 * latest row. Rows before the first window count towards it.
+	 * @return live counts by site code and window
+	 */
+	public long[][] liveByWindow(long windowNanos, int windows) {
+		long end = size;
+		int siteCount = sites.size();
+		long first = lastTime - windowNanos * windows;
+		long[][] live = new long[siteCount][windows];
+		for (int chunk = 0; (long) chunk << CHUNK_BITS < end; chunk++) {
+			int rows = (int) Math.min(CHUNK_SIZE, end - ((long) chunk << CHUNK_BITS));
+			long[] chunkTimes = times[chunk];
+			int[] chunkSites = siteCodes[chunk];
+			long[] chunkCounts = counts[chunk];
+			for (int i = 0; i < rows; i++) {
+				long time = chunkTimes[i];
+				int window = time <= first ? 0 : (int) Math.min(windows - 1, (time - first - 1) / windowNanos);
+				live[chunkSites[i]][window] += chunkCounts[i];
+			}
+		}
+		for (long[] site : live) {
+			for (int window = 1; window < windows; window++) {
+				site[window] += site[window - 1];
+			}
+		}
+		return live;
+	}
+
+	public long getSize() {
+		return size;
+	}
+
+	public long getLastTime() {
+		return lastTime;
+	}
+
+	public synchronized long getLost() {
+		return lost;
+	}
+
+	/**
+	 * @return bytes taken by the columns
+	 */
+	public long getMemory() {
+		long chunks = (size + CHUNK_SIZE - 1) >>> CHUNK_BITS;
+		return chunks * CHUNK_SIZE * (8 + 4 + 8 + 8);
+	}
+}
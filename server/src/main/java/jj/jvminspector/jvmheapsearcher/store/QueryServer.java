@@ -0,0 +1,193 @@
+package jj.jvminspector.jvmheapsearcher.store;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import com.lithium.flow.util.Logs;
+
+import java.io.BufferedReader;
+import java.io.IOException;
+import java.io.InputStreamReader;
+import java.io.PrintWriter;
+import java.net.ServerSocket;
+import java.net.Socket;
+import java.nio.charset.StandardCharsets;
+import java.util.ArrayList;
+import java.util.List;
+import java.util.concurrent.TimeUnit;
+
+import org.slf4j.Logger;
+
+import jj.jvminspector.jvmheapsearcher.model.SiteLifetimes;
+
+/**
+ * Line based query interface of an {@link EventStore}, for leak triage with nc or telnet.
+ * Each command answers with tab separated lines, a header first, and ends with an empty
+ * line:
+ * <ul>
+ * <li>top [n] [count|bytes]: sites with the most live objects, or bytes</li>
+ * <li>growing [windowSeconds] [windows] [n]: leak suspects, sites whose live count never
+ * went down from one window to the next and grew overall, most growth first</li>
+ * <li>lifetimes [n]: lifetime percentiles of the sites with the most objects freed</li>
+ * <li>stats: rows, sites and memory of the store</li>
+ * </ul>
+ */
+public class QueryServer extends Thread {
+	private static final int DEFAULT_LIMIT = 20;
+	private static final long DEFAULT_WINDOW_SECONDS = 60;
+	private static final int DEFAULT_WINDOWS = 5;
+
+	private static final Logger log = Logs.getLogger();
+	private final EventStore store;
+	private final int port;
+	private ServerSocket serverSocket;
+
+	public QueryServer(EventStore store, int port) {
+		this.store = store;
+		this.port = port;
+		setDaemon(true);
+	}
+
+	public void startServer() throws IOException {
+		serverSocket = new ServerSocket(port);
+		log.info("answering event store queries on port: {}", port);
+		this.start();
+	}
+
+	@Override
+	public void run() {
+		while (true) {
+			try {
+				Socket socket = serverSocket.accept();
+				Thread client = new Thread(() -> serve(socket));
+				client.setDaemon(true);
+				client.start();
+			} catch (IOException ioException) {
+				log.error("Failed to accept query connection", ioException);
+			}
+		}
+	}
+
+	private void serve(Socket socket) {
+		try (Socket client = socket;
+		     BufferedReader in = new BufferedReader(new InputStreamReader(client.getInputStream(),
+				     StandardCharsets.UTF_8));
+		     PrintWriter out = new PrintWriter(client.getOutputStream())) {
+			String line;
+			while ((line = in.readLine()) != null) {
+				String[] args = line.trim().split("\\s+");
+				if ("quit".equals(args[0])) {
+					break;
+				}
+				try {
+					answer(args, out);
+				} catch (NumberFormatException e) {
+					out.println("invalid number: " + e.getMessage());
+				}
+				out.println();
+				out.flush();
+			}
+		} catch (IOException e) {
+			log.warn("query connection failed", e);
+		}
+	}
+
+	private void answer(String[] args, PrintWriter out) {
+		long start = System.nanoTime();
+		switch (args[0]) {
+			case "top":
+				top(out, intArg(args, 1, DEFAULT_LIMIT), args.length > 2 && "bytes".equals(args[2]));
+				break;
+			case "growing":
+				long windowSeconds = args.length > 1 ? Long.parseLong(args[1]) : DEFAULT_WINDOW_SECONDS;
+				int windows = intArg(args, 2, DEFAULT_WINDOWS);
+				if (windowSeconds <= 0 || windows < 2) {
+					out.println("need a positive window and at least 2 windows");
+					return;
+				}
+				growing(out, TimeUnit.SECONDS.toNanos(windowSeconds), windows, intArg(args, 3, DEFAULT_LIMIT));
+				break;
+			case "lifetimes":
+				lifetimes(out, intArg(args, 1, DEFAULT_LIMIT));
+				break;
+			case "stats":
+				out.println("rows\tsites\tlost\tmemoryBytes\tlastTime");
+				out.println(store.getSize() + "\t" + store.getSites().size() + "\t" + store.getLost() + "\t"
+						+ store.getMemory() + "\t" + store.getLastTime());
+				return;
+			default:
+				out.println("commands: top [n] [count|bytes], growing [windowSeconds] [windows] [n], "
+						+ "lifetimes [n], stats, quit");
+				return;
+		}
+		log.info("answered {} in {} ms", args[0], TimeUnit.NANOSECONDS.toMillis(System.nanoTime() - start));
+	}
+
+	private void top(PrintWriter out, int limit, boolean byBytes) {
+		long[][] live = store.liveBySite();
+		long[] key = byBytes ? live[1] : live[0];
+		out.println("liveCount\tliveBytes\tsite");
+		for (int site : largest(key, limit)) {
+			out.println(live[0][site] + "\t" + live[1][site] + "\t" + store.getSites().decode(site));
+		}
+	}
+
+	private void growing(PrintWriter out, long windowNanos, int windows, int limit) {
+		long[][] live = store.liveByWindow(windowNanos, windows);
+		long[] growth = new long[live.length];
+		for (int site = 0; site < live.length; site++) {
+			long[] counts = live[site];
+			boolean monotonic = counts[windows - 1] > counts[0];
+			for (int window = 1; window < windows && monotonic; window++) {
+				monotonic = counts[window] >= counts[window - 1];
+			}
+			growth[site] = monotonic ? counts[windows - 1] - counts[0] : 0;
+		}
+		out.println("growth\tliveCount\tliveCountByWindow\tsite");
+		for (int site : largest(growth, limit)) {
+			StringBuilder byWindow = new StringBuilder();
+			for (int window = 0; window < windows; window++) {
+				byWindow.append(window == 0 ? "" : ",").append(live[site][window]);
+			}
+			out.println(growth[site] + "\t" + live[site][windows - 1] + "\t" + byWindow + "\t"
+					+ store.getSites().decode(site));
+		}
+	}
+
+	private void lifetimes(PrintWriter out, int limit) {
+		long[][] histograms = store.lifetimeHistograms();
+		long[] freed = new long[histograms.length];
+		for (int site = 0; site < histograms.length; site++) {
+			if (histograms[site] != null) {
+				for (long count : histograms[site]) {
+					freed[site] += count;
+				}
+			}
+		}
+		out.println("freed\tp50Nanos\tp90Nanos\tp99Nanos\tsite");
+		for (int site : largest(freed, limit)) {
+			long[] histogram = histograms[site];
+			out.println(freed[site] + "\t" + SiteLifetimes.percentile(histogram, 50) + "\t"
+					+ SiteLifetimes.percentile(histogram, 90) + "\t" + SiteLifetimes.percentile(histogram, 99)
+					+ "\t" + store.getSites().decode(site));
+		}
+	}
+
+	/**
+	 * @return sites with the largest positive values, largest first
+	 */
+	private static List<Integer> largest(long[] values, int limit) {
+		List<Integer> sites = new ArrayList<>();
+		for (int site = 0; site < values.length; site++) {
+			if (values[site] > 0) {
+				sites.add(site);
+			}
+		}
+		sites.sort((a, b) -> Long.compare(values[b], values[a]));
+		return sites.subList(0, Math.min(limit, sites.size()));
+	}
+
+	private static int intArg(String[] args, int index, int defaultValue) {
+		return args.length > index ? Integer.parseInt(args[index]) : defaultValue;
+	}
+}
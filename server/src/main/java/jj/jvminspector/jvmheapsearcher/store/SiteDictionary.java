@@ -0,0 +1,61 @@
+package jj.jvminspector.jvmheapsearcher.store;
+/**
+ * Created by jigar.joshi on 10/17/26.
+ */
+
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.List;
+import java.util.Map;
+
+import jj.jvminspector.jvmheapsearcher.model.StackTraceElement;
+
+/**
+ * Dictionary encoding of allocation sites: every distinct stack gets a small dense code,
+ * the same one whichever agent or connection it came from, trace ids only mean something
+ * within their connection
+ */
+public class SiteDictionary {
+	private final Map<String, Integer> codes = new HashMap<>();
+	private final List<String> labels = new ArrayList<>();
+
+	/**
+	 * @return code of the site allocating at the stack
+	 */
+	public synchronized int encode(List<StackTraceElement> stack) {
+		String label = label(stack);
+		Integer code = codes.get(label);
+		if (code == null) {
+			code = labels.size();
+			codes.put(label, code);
+			labels.add(label);
+		}
+		return code;
+	}
+
+	/**
+	 * @return stack of the site, innermost frame first
+	 */
+	public synchronized String decode(int code) {
+		return labels.get(code);
+	}
+
+	public synchronized int size() {
+		return labels.size();
+	}
+
+	private static String label(List<StackTraceElement> stack) {
+		if (stack == null || stack.isEmpty()) {
+			return "<unknown>";
+		}
+		StringBuilder sb = new StringBuilder();
+		for (StackTraceElement frame : stack) {
+			if (sb.length() > 0) {
+				sb.append(" <- ");
+			}
+			sb.append(frame.getClassSignature()).append('.').append(frame.getMethodName())
+					.append('(').append(frame.getFileName()).append(':').append(frame.getLineNumber()).append(')');
+		}
+		return sb.toString();
+	}
+}